@@ -0,0 +1,234 @@
+/* DroidCam & DroidCamX (C) 2010-2021
+ * https://github.com/dev47apps
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#if __FreeBSD__
+#include <netinet/in.h>
+#include <sys/wait.h>
+#endif
+
+#include "common.h"
+#include "adb.h"
+
+#define ADB_TIMEOUT_MS 2000
+#define ADB_REPLY_MAX  4096
+
+// the adb binary takes the same variable
+static int adb_server_port(void) {
+    const char *env = getenv("ANDROID_ADB_SERVER_PORT");
+    int port = env ? atoi(env) : 0;
+    return (port > 0 && port < 65536) ? port : ADB_SERVER_PORT;
+}
+
+static SOCKET adb_connect(void) {
+    struct sockaddr_in sin;
+    SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (s == INVALID_SOCKET)
+        return INVALID_SOCKET;
+
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = inet_addr(ADB_LOCALHOST_IP);
+    sin.sin_port = htons(adb_server_port());
+
+    // loopback, a missing server is refused right away
+    if (connect(s, (struct sockaddr*)&sin, sizeof(sin)) < 0) {
+        dbgprint("adb: server not reachable: %s\n", strerror(errno));
+        close(s);
+        return INVALID_SOCKET;
+    }
+
+    SetRecvTimeout(s, ADB_TIMEOUT_MS);
+    return s;
+}
+
+static int adb_send(SOCKET s, const char *service) {
+    char buf[256];
+    int len = snprintf(buf, sizeof(buf), "%04x%s", (unsigned) strlen(service), service);
+    if (len >= (int) sizeof(buf))
+        return -1;
+
+    dbgprint("adb: > %s\n", service);
+    return Send(buf, len, s) > 0 ? 0 : -1;
+}
+
+// hex length prefixed string, returns its length
+static int adb_read_string(SOCKET s, char *buf, int size) {
+    char hex[5] = {0};
+    if (RecvAll(hex, 4, s) != 4)
+        return -1;
+
+    int len = (int) strtol(hex, NULL, 16);
+    int keep = (len < size) ? len : size - 1;
+    if (keep > 0 && RecvAll(buf, keep, s) != keep)
+        return -1;
+    buf[keep] = 0;
+
+    // drop whatever doesn't fit
+    for (int left = len - keep; left > 0; ) {
+        char skip[256];
+        int r = RecvAll(skip, left < (int) sizeof(skip) ? left : (int) sizeof(skip), s);
+        if (r <= 0)
+            return -1;
+        left -= r;
+    }
+
+    return keep;
+}
+
+static int adb_status(SOCKET s) {
+    char status[5] = {0};
+    char msg[256];
+
+    if (RecvAll(status, 4, s) != 4)
+        return -1;
+
+    if (memcmp(status, "OKAY", 4) == 0)
+        return 0;
+
+    if (memcmp(status, "FAIL", 4) == 0 && adb_read_string(s, msg, sizeof(msg)) >= 0)
+        errprint("adb: %s\n", msg);
+    else
+        errprint("adb: unexpected reply '%s'\n", status);
+    return -1;
+}
+
+static int adb_query(const char *service, char *reply, int size) {
+    int rc = -1;
+    SOCKET s = adb_connect();
+    if (s == INVALID_SOCKET)
+        return -1;
+
+    if (adb_send(s, service) < 0 || adb_status(s) < 0)
+        goto out;
+
+    rc = reply ? adb_read_string(s, reply, size) : 0;
+
+out:
+    disconnect(s);
+    return rc;
+}
+
+static int adb_parse_devices(char *list, struct adb_device *devices, int max) {
+    int count = 0;
+    char *save = NULL;
+
+    for (char *line = strtok_r(list, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+        if (count == max)
+            break;
+        if (sscanf(line, "%63s %23s", devices[count].serial, devices[count].state) == 2)
+            count++;
+    }
+
+    return count;
+}
+
+int AdbStartServer(void) {
+    // the only step that still needs the adb binary
+    int rc = system("adb start-server");
+    return (rc == -1 || WEXITSTATUS(rc) != 0) ? -1 : 0;
+}
+
+int AdbKillServer(void) {
+    return adb_query("host:kill", NULL, 0);
+}
+
+int AdbListDevices(struct adb_device *devices, int max) {
+    char *reply = malloc(ADB_REPLY_MAX);
+    int count = -1;
+
+    if (!reply)
+        return -1;
+
+    if (adb_query("host:devices-l", reply, ADB_REPLY_MAX) >= 0) {
+        count = adb_parse_devices(reply, devices, max);
+        dbgprint("adb: %d devices\n", count);
+    }
+
+    free(reply);
+    return count;
+}
+
+int AdbForward(const char *serial, int local_port, int remote_port) {
+    char service[128];
+    int rc = -1;
+    SOCKET s = adb_connect();
+    if (s == INVALID_SOCKET)
+        return -1;
+
+    snprintf(service, sizeof(service), "host-serial:%s:forward:tcp:%d;tcp:%d",
+        serial, local_port, remote_port);
+
+    // one status for the transport, one for the forward itself
+    if (adb_send(s, service) < 0 || adb_status(s) < 0 || adb_status(s) < 0)
+        goto out;
+
+    rc = 0;
+
+out:
+    disconnect(s);
+    return rc;
+}
+
+SOCKET AdbTrackOpen(void) {
+    SOCKET s = adb_connect();
+    if (s == INVALID_SOCKET)
+        return INVALID_SOCKET;
+
+    if (adb_send(s, "host:track-devices") < 0 || adb_status(s) < 0) {
+        disconnect(s);
+        return INVALID_SOCKET;
+    }
+    return s;
+}
+
+/* Waits for device list updates. Returns 1 when a device came online,
+ * 0 on timeout, -1 if the tracking connection is gone.
+ * *online carries the last state between calls, start it at -1.
+ */
+int AdbTrackWait(SOCKET s, int *online, int timeout_ms) {
+    struct adb_device devices[ADB_DEVICES_MAX];
+    struct pollfd pfd = { .fd = s, .events = POLLIN };
+    char *reply;
+    int rc = 0;
+
+    if (poll(&pfd, 1, timeout_ms) <= 0)
+        return 0;
+
+    reply = malloc(ADB_REPLY_MAX);
+    if (!reply)
+        return -1;
+
+    if (adb_read_string(s, reply, ADB_REPLY_MAX) < 0) {
+        rc = -1;
+        goto out;
+    }
+
+    int now = 0;
+    int count = adb_parse_devices(reply, devices, ADB_DEVICES_MAX);
+    for (int i = 0; i < count; i++) {
+        if (strcmp(devices[i].state, "device") == 0)
+            now = 1;
+    }
+
+    dbgprint("adb: track: %d devices, online=%d\n", count, now);
+    if (*online == 0 && now)
+        rc = 1;
+    *online = now;
+
+out:
+    free(reply);
+    return rc;
+}
@@ -0,0 +1,34 @@
+/* DroidCam & DroidCamX (C) 2010-2021
+ * https://github.com/dev47apps
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __ADB_H__
+#define __ADB_H__
+
+#include "connection.h"
+
+/* Client for the adb server's host protocol on localhost:5037, or the
+ * port in ANDROID_ADB_SERVER_PORT. Requests are a 4 digit hex length plus the service name, replies
+ * start with OKAY or FAIL (followed by a hex length prefixed message).
+ */
+#define ADB_SERVER_PORT 5037
+#define ADB_DEVICES_MAX 16
+
+struct adb_device {
+    char serial[64];
+    char state[24]; // device, offline, unauthorized, ...
+};
+
+int AdbStartServer(void);
+int AdbListDevices(struct adb_device *devices, int max);
+int AdbForward(const char *serial, int local_port, int remote_port);
+int AdbKillServer(void);
+
+SOCKET AdbTrackOpen(void);
+int AdbTrackWait(SOCKET s, int *online, int timeout_ms);
+
+#endif
@@ -6,11 +6,20 @@
  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
  */
 
+#define _GNU_SOURCE
 #include "common.h"
 #include "settings.h"
 #include "connection.h"
 #include "decoder.h"
+#include "adb.h"
+#include "uring.h"
+#include "reactor.h"
+#include "latency.h"
+#include "trace.h"
+#include <fcntl.h>
 #include <stdint.h>
+#include <poll.h>
+#include <pthread.h>
 
 extern int a_active;
 extern int v_active;
@@ -20,338 +29,1677 @@ extern int thread_cmd;
 extern struct settings g_settings;
 
 const char *thread_cmd_val_str;
+struct udp_stream_stats audio_udp_stats;
+unsigned long video_reconnects;
 
-SOCKET GetConnection(void) {
-    char *err;
-    SOCKET socket = INVALID_SOCKET;
+#define AUDIO_POLLFD_MAX      8
+#define AUDIO_POLL_TIMEOUT_MS 100
+#define AUDIO_PACKET_US       (CHUNKS_PER_PACKET * DROIDCAM_CHUNK_MS_2 * 1000)
 
-    if (g_settings.connection == CB_RADIO_IOS) {
-        socket = CheckiOSDevices(g_settings.port);
-        if (socket <= 0) socket = INVALID_SOCKET;
-    } else {
-        socket = Connect(g_settings.ip, g_settings.port, &err);
+#define VIDEO_HOLD_AFTER_MS    250
+#define VIDEO_HOLD_INTERVAL_MS 100
+#define VIDEO_PROBE_AFTER_MS   2000
+#define RECONNECT_MIN_MS       250
+#define RECONNECT_MAX_MS       4000
+
+// sanity limit on a single frame, anything bigger is a broken stream
+#define VIDEO_FRAME_MAX            (32 * 1024 * 1024)
+
+#define BATTERY_INTERVAL_S 30
+#define BATTERY_TIMEOUT_S  5
+#define STATUS_MIN_S       5
+#define STATUS_MAX_S       30
+
+const char* codec_names[] = {
+    "jpg", "avc",
+};
+
+/* Route and address of this session's phone. A connection race can win
+ * over another route than the selected one, that route is used for the
+ * rest of the session and g_settings keeps what the user picked.
+ */
+static struct {
+    int route;
+    char ip[16];
+} phone;
+
+void PhoneRoute(int route, const char *ip) {
+    phone.route = route;
+    strncpy(phone.ip, ip, sizeof(phone.ip) - 1);
+    phone.ip[sizeof(phone.ip) - 1] = '\0';
+}
+
+/* Non-blocking connect to the phone over the session's route, wait for
+ * EPOLLOUT and check ConnectError(). The usbmuxd socket comes back
+ * already connected.
+ */
+static SOCKET ConnectPhone(void) {
+    SOCKET s;
+
+    if (phone.route == CB_RADIO_IOS) {
+        s = CheckiOSDevices(g_settings.port);
+        if (s <= 0)
+            return INVALID_SOCKET;
+        fcntl(s, F_SETFL, fcntl(s, F_GETFL, NULL) | O_NONBLOCK);
+        return s;
     }
 
-    return socket;
+    s = ConnectNonBlock(phone.ip, g_settings.port);
+    if (s == INVALID_SOCKET && phone.route == CB_RADIO_ADB
+        && CheckAdbDevices(g_settings.port) == NO_ERROR)
+    {
+        // a replugged device loses its forward
+        s = ConnectNonBlock(phone.ip, g_settings.port);
+    }
+    return s;
 }
 
-// Battry Check thread
-void *BatteryThreadProc(__attribute__((__unused__)) void *args) {
-    SOCKET socket = INVALID_SOCKET;
-    char buf[128] = {0};
-    char battery_value[32] = {0};
-    int i, j;
+/* ConnectPhone() and the usbmuxd or adb lookups can block for seconds
+ * (adb start-server, a busy usbmuxd), so the reactor runs them on a
+ * thread and gets the socket back from a pipe. Both sides hold a
+ * reference, a job cancelled while its thread still runs is freed by
+ * the thread, closing whatever socket it came up with.
+ */
+struct phone_job {
+    atomic_int refs;
+    int wake[2];
+    SOCKET result;
+    SOCKET (*work)(void);
+    void (*done)(SOCKET s);
+    struct phone_job **owner;
+};
 
-    dbgprint("Battery Thread Start\n");
+static void PhoneJobRelease(struct phone_job *job) {
+    if (atomic_fetch_sub(&job->refs, 1) > 1)
+        return;
 
-    while (v_running || a_running) {
-	if (v_active == 0 && a_active == 0) {
-            usleep(50000);
-            continue;
-        }
+    if (job->result != INVALID_SOCKET)
+        disconnect(job->result);
+    close(job->wake[0]);
+    close(job->wake[1]);
+    free(job);
+}
+
+static void *PhoneJobThreadProc(void *args) {
+    struct phone_job *job = args;
+    char c = 0;
+
+    job->result = job->work();
+    if (write(job->wake[1], &c, 1) < 0) {}
+    PhoneJobRelease(job);
+    return 0;
+}
+
+static void PhoneJobIO(int fd, __attribute__((__unused__)) uint32_t events, void *data) {
+    struct phone_job *job = data;
+    void (*done)(SOCKET s) = job->done;
+    SOCKET s = job->result;
+
+    reactor_del(fd);
+    *job->owner = NULL;
+    job->result = INVALID_SOCKET;
+    PhoneJobRelease(job);
+    done(s);
+}
 
-        socket = GetConnection();
-        if (socket == INVALID_SOCKET) {
-            goto LOOP;
+static void PhoneJobCancel(struct phone_job **owner) {
+    struct phone_job *job = *owner;
+    if (!job)
+        return;
+
+    reactor_del(job->wake[0]);
+    *owner = NULL;
+    PhoneJobRelease(job);
+}
+
+/* Runs work() off the reactor, then done() on it with the socket.
+ * done() is not called once the job is cancelled.
+ */
+static int PhoneJobStart(struct phone_job **owner, SOCKET (*work)(void), void (*done)(SOCKET s)) {
+    pthread_t t;
+    struct phone_job *job;
+
+    PhoneJobCancel(owner);
+    job = calloc(1, sizeof(*job));
+    if (!job)
+        return -1;
+
+    if (pipe(job->wake) < 0) {
+        errprint("pipe() error %d '%s'\n", errno, strerror(errno));
+        free(job);
+        return -1;
+    }
+    atomic_init(&job->refs, 2);
+    job->result = INVALID_SOCKET;
+    job->work = work;
+    job->done = done;
+    job->owner = owner;
+
+    if (reactor_add(job->wake[0], EPOLLIN, PhoneJobIO, job) < 0)
+        goto error;
+    if (pthread_create(&t, NULL, PhoneJobThreadProc, job) != 0) {
+        reactor_del(job->wake[0]);
+        goto error;
+    }
+    pthread_detach(t);
+    *owner = job;
+    return 0;
+
+error:
+    close(job->wake[0]);
+    close(job->wake[1]);
+    free(job);
+    return -1;
+}
+
+extern char* DROIDCAM_CONNECT_ERROR;
+
+// handshake reply of a raced connection, picked up by VideoConnected()
+static char video_reply[CONNECT_REPLY_MAX];
+static int video_reply_len;
+
+struct route_prep {
+    struct connect_race *race;
+    int route;
+    int port;
+};
+
+static void *RoutePrepThreadProc(void *args) {
+    struct route_prep *prep = args;
+    int rc;
+
+    if (prep->route == CB_RADIO_ADB) {
+        rc = CheckAdbDevices(prep->port);
+        if (rc == NO_ERROR)
+            ConnectRaceAddIP(prep->race, ADB_LOCALHOST_IP, prep->port, CB_RADIO_ADB);
+    } else {
+        rc = CheckiOSDevices(prep->port);
+        if (rc > 0) {
+            ConnectRaceAddSocket(prep->race, rc, CB_RADIO_IOS);
+            rc = NO_ERROR;
         }
+    }
+
+    ConnectRacePrepared(prep->race, prep->route, rc);
+    ConnectRaceRelease(prep->race);
+    free(prep);
+    return 0;
+}
+
+static void StartRoutePrep(struct connect_race *race, int route, int port) {
+    pthread_t t;
+    struct route_prep *prep = malloc(sizeof(*prep));
+    if (!prep)
+        return;
+
+    prep->race = race;
+    prep->route = route;
+    prep->port = port;
+    ConnectRaceRetain(race);
+    ConnectRacePreparing(race);
+    if (pthread_create(&t, NULL, RoutePrepThreadProc, prep) != 0) {
+        ConnectRacePrepared(race, route, ERROR_LOADING_DEVICES);
+        ConnectRaceRelease(race);
+        free(prep);
+        return;
+    }
+    pthread_detach(t);
+}
 
-        if (Send(BATTERY_REQ, CSTR_LEN(BATTERY_REQ), socket) <= 0) {
-            dbgprint("error sending battery status request: (%d) '%s'\n",
-                                        errno, strerror(errno));
-            goto LOOP;
+/* Try the routes the selected mode can use at the same time and keep
+ * whichever completes the video handshake first: the Wi-Fi IP, plus the adb
+ * forward or usbmuxd in the USB modes, where the phone is often on Wi-Fi
+ * too. Blocks, so call it off the UI thread; ConnectRaceCancel() from
+ * another thread aborts it.
+ */
+SOCKET RaceConnection(struct connect_race *race, const char *ip, int port, int *route) {
+    char req[32];
+    int mode = g_settings.connection;
+    SOCKET s;
+
+    if (g_settings.video) {
+        race->request_len = snprintf(req, sizeof(req), VIDEO_REQ, codec_names[g_settings.encoder],
+                                decoder_get_video_width(), decoder_get_video_height());
+        race->request = req;
+        race->reply_len = 9;
+    }
+
+    if (ip && strlen(ip) >= 7 && strcmp(ip, ADB_LOCALHOST_IP) != 0)
+        ConnectRaceAddIP(race, ip, port, CB_RADIO_WIFI);
+    if (mode == CB_RADIO_ADB || mode == CB_RADIO_IOS)
+        StartRoutePrep(race, mode, port);
+
+    video_reply_len = 0;
+    s = ConnectRaceRun(race, route, video_reply);
+    if (s != INVALID_SOCKET) {
+        video_reply_len = race->reply_len;
+        return s;
+    }
+
+    if (atomic_load(&race->cancel))
+        return s;
+
+    // only complain about the route the user picked
+    if (mode == CB_RADIO_ADB && race->route_rc[mode] != NO_ERROR)
+        AdbErrorPrint(race->route_rc[mode]);
+    else if (mode == CB_RADIO_IOS && race->route_rc[mode] != NO_ERROR)
+        iOSErrorPrint(race->route_rc[mode]);
+    else
+        MSG_ERROR(DROIDCAM_CONNECT_ERROR);
+
+    return s;
+}
+
+/* Status channel
+ * Battery level polling runs on the reactor, over one keep-alive HTTP
+ * connection that stays open while streaming: no reconnect (or usbmuxd
+ * lookup) per poll, and each request on the warm connection times the
+ * link. Polls speed up to STATUS_MIN_S while the level or the RTT moves
+ * and back off to STATUS_MAX_S while they hold. A phone that closes
+ * after every reply gets the old fixed 30s one-shot requests.
+ */
+enum {
+    STATUS_CLOSED,
+    STATUS_CONNECTING,
+    STATUS_IDLE,
+    STATUS_WAITING,
+};
+
+static struct {
+    int timer;
+    int state;
+    int wait_s;
+    int interval_s;
+    int pending_s;
+    int keepalive;
+    int warm;
+    SOCKET sock;
+    int got;
+    char buf[512];
+    int64_t sent_us;
+    int rtt_ms;
+    int srtt_ms;
+    char level[32];
+    struct phone_job *job;
+} status = { .timer = -1, .sock = INVALID_SOCKET };
+
+static int64_t mono_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// smoothed status channel round trip in ms, -1 until measured
+int StatusRttMs(void) {
+    return status.srtt_ms > 0 ? status.srtt_ms : -1;
+}
+
+// last battery level the phone reported, -1 if none yet
+int StatusBattery(void) {
+    return (status.level[0] >= '0' && status.level[0] <= '9') ? atoi(status.level) : -1;
+}
+
+static void BatteryParse(char *buf, int len, char *battery_value, size_t size) {
+    int i, j;
+
+    for (i = 0; i < (len-4); i++) {
+        if (buf[i] == '\r' && buf[i+1] == '\n' && buf[i+2] == '\r' && buf[i+3] == '\n') {
+            i += 4;
+            break;
         }
+    }
+
+    j = 0;
+    while (i < len && j < (size-2) && buf[i] >= '0' && buf[i] <= '9')
+        battery_value[j++] = buf[i++];
+
+    if (j == 0)
+        battery_value[j++] = '-';
+
+    battery_value[j++] = '%';
+    battery_value[j++] = 0;
+    dbgprint("battery_value: %s\n", battery_value);
+}
+
+static void StatusClose(void) {
+    PhoneJobCancel(&status.job);
+    if (status.sock != INVALID_SOCKET) {
+        reactor_del(status.sock);
+        disconnect(status.sock);
+        status.sock = INVALID_SOCKET;
+    }
+    status.state = STATUS_CLOSED;
+}
+
+static int StatusSend(void) {
+    const char *req = status.keepalive ? BATTERY_REQ_KEEPALIVE : BATTERY_REQ;
+    if (Send(req, strlen(req), status.sock) <= 0) {
+        dbgprint("error sending battery status request: (%d) '%s'\n",
+                                    errno, strerror(errno));
+        return -1;
+    }
+
+    status.got = 0;
+    status.pending_s = 0;
+    status.sent_us = mono_us();
+    status.state = STATUS_WAITING;
+    return 0;
+}
+
+/* Returns 1 once a whole reply is in: headers, plus Content-Length bytes
+ * of body when the phone sent one, otherwise everything up to the close.
+ */
+static int StatusReplyDone(int closed) {
+    char *body, *clen;
+
+    status.buf[status.got] = 0;
+    body = strstr(status.buf, "\r\n\r\n");
+    if (!body)
+        return closed;
+
+    clen = strcasestr(status.buf, "\r\nContent-Length:");
+    if (!clen || clen > body)
+        return closed;
+
+    return status.buf + status.got >= body + 4 + strtol(clen + 17, NULL, 10);
+}
+
+static void StatusReply(int closed) {
+    char level[32];
+    char label[64];
+    int changed;
+
+    // the phone may still opt out of keep-alive per reply
+    if (!closed && strcasestr(status.buf, "\r\nConnection: close"))
+        closed = 1;
+
+    BatteryParse(status.buf, status.got, level, sizeof(level));
+    changed = strcmp(level, status.level) != 0;
+    strcpy(status.level, level);
+
+    // the first request also paid for the connect, only time the warm ones
+    if (status.keepalive && status.warm) {
+        status.rtt_ms = (int) ((mono_us() - status.sent_us) / 1000);
+        if (status.srtt_ms > 0 && status.rtt_ms > 2 * status.srtt_ms)
+            changed = 1;
+        status.srtt_ms = status.srtt_ms > 0
+            ? (7 * status.srtt_ms + status.rtt_ms) / 8 : status.rtt_ms;
+        dbgprint("status rtt %dms, smoothed %dms\n", status.rtt_ms, status.srtt_ms);
+    }
+    status.warm = 1;
+
+    if (status.srtt_ms > 0) {
+        snprintf(label, sizeof(label), "%s  %dms", level, status.srtt_ms);
+        UpdateBatteryLabel(label);
+    } else {
+        UpdateBatteryLabel(level);
+    }
+
+    if (closed) {
+        // no keep-alive, fall back to polling with a new connection
+        status.keepalive = 0;
+        status.interval_s = BATTERY_INTERVAL_S;
+        StatusClose();
+        return;
+    }
+
+    status.interval_s = changed ? STATUS_MIN_S : status.interval_s * 2;
+    if (status.interval_s > STATUS_MAX_S)
+        status.interval_s = STATUS_MAX_S;
+    status.state = STATUS_IDLE;
+}
 
-        memset(buf, 0, sizeof(buf));
-        if (RecvAll(buf, sizeof(buf), socket) <= 0) {
-            goto LOOP;
+static void StatusIO(int fd, __attribute__((__unused__)) uint32_t events,
+    __attribute__((__unused__)) void *data)
+{
+    int closed = 0;
+
+    if (status.state == STATUS_CONNECTING) {
+        int err = ConnectError(fd);
+        if (err != 0) {
+            dbgprint("status: connect failed: %s\n", strerror(err));
+            goto fail;
         }
+        status.warm = 0;
+        if (StatusSend() < 0)
+            goto fail;
+        reactor_mod(fd, EPOLLIN);
+        return;
+    }
 
-        for (i = 0; i < (sizeof(buf)-4); i++) {
-            if (buf[i] == '\r' && buf[i+1] == '\n' && buf[i+2] == '\r' && buf[i+3] == '\n') {
-                i += 4;
-                break;
-            }
+    while (status.got < (int) sizeof(status.buf) - 1) {
+        int r = RecvNonBlock(status.buf + status.got, sizeof(status.buf) - 1 - status.got, fd);
+        if (r > 0) {
+            status.got += r;
+            continue;
         }
+        closed = (r < 0);
+        break;
+    }
 
-        j = 0;
-        while (i < sizeof(buf) && j < (sizeof(battery_value)-2) && buf[i] >= '0' && buf[i] <= '9')
-            battery_value[j++] = buf[i++];
+    // the phone dropping an idle connection is fine, the next poll reopens it
+    if (status.state != STATUS_WAITING)
+        goto fail;
 
-        if (j == 0)
-            battery_value[j++] = '-';
+    if (status.got == (int) sizeof(status.buf) - 1)
+        closed = 1;
 
-        battery_value[j++] = '%';
-        battery_value[j++] = 0;
-        dbgprint("battery_value: %s\n", battery_value);
-        UpdateBatteryLabel(battery_value);
+    if (!StatusReplyDone(closed))
+        return;
 
-    LOOP:
-        disconnect(socket);
-        for (j = 0; j < 30000 && (v_running || a_running); j++)
-            usleep(1000);
+    if (status.got > 0) {
+        StatusReply(closed);
+        return;
     }
 
-    dbgprint("Battery Thread End\n");
-    return 0;
+fail:
+    StatusClose();
+}
+
+// runs on a phone job thread, no adb fallback for a status poll
+static SOCKET StatusConnect(void) {
+    SOCKET s;
+
+    if (phone.route == CB_RADIO_IOS) {
+        s = CheckiOSDevices(g_settings.port);
+        if (s <= 0)
+            return INVALID_SOCKET;
+        fcntl(s, F_SETFL, fcntl(s, F_GETFL, NULL) | O_NONBLOCK);
+        return s;
+    }
+    return ConnectNonBlock(phone.ip, g_settings.port);
+}
+
+static void StatusConnected(SOCKET s) {
+    if (s == INVALID_SOCKET) {
+        status.state = STATUS_CLOSED;
+        return;
+    }
+
+    if (reactor_add(s, EPOLLOUT, StatusIO, NULL) < 0) {
+        disconnect(s);
+        status.state = STATUS_CLOSED;
+        return;
+    }
+    status.sock = s;
+}
+
+static void StatusTick(__attribute__((__unused__)) int fd,
+    __attribute__((__unused__)) uint32_t events, __attribute__((__unused__)) void *data)
+{
+    if (status.state == STATUS_CONNECTING || status.state == STATUS_WAITING) {
+        if (++status.pending_s < BATTERY_TIMEOUT_S)
+            return;
+        dbgprint("status: request timed out\n");
+        StatusClose();
+    }
+
+    if (v_active == 0 && a_active == 0) {
+        StatusClose();
+        status.wait_s = 0;
+        return;
+    }
+    if (status.wait_s-- > 0)
+        return;
+    status.wait_s = status.interval_s - 1;
+
+    if (status.state == STATUS_IDLE) {
+        if (StatusSend() < 0)
+            StatusClose();
+        return;
+    }
+
+    // the lookup and the connect both count against BATTERY_TIMEOUT_S
+    if (PhoneJobStart(&status.job, StatusConnect, StatusConnected) < 0)
+        return;
+    status.state = STATUS_CONNECTING;
+    status.pending_s = 0;
+}
+
+void BatteryStart(void) {
+    if (status.timer >= 0)
+        return;
+
+    status.wait_s = 0;
+    status.interval_s = STATUS_MIN_S;
+    status.keepalive = 1;
+    status.srtt_ms = 0;
+    status.level[0] = 0;
+    status.timer = reactor_timer_add(1000, 1000, StatusTick, NULL);
+}
+
+void BatteryStop(void) {
+    StatusClose();
+    reactor_timer_del(status.timer);
+    status.timer = -1;
 }
 
+/* Decodes queued frames, the only work that stays on a thread of its
+ * own. It sleeps until a frame is queued, and while the stream is
+ * interrupted repeats the last frame every VIDEO_HOLD_INTERVAL_MS.
+ */
 void *DecodeThreadProc(__attribute__((__unused__)) void *args) {
+    unsigned seen = 0;
+    int64_t idle_from = mono_us();
     dbgprint("Decode Thread Start\n");
+    trace_thread("decode");
     while (v_running != 0) {
-        JPGFrame *f = pull_ready_jpg_frame();
-        if (!f) {
-            usleep(2000);
+        if (decoder_decode_next()) {
+            idle_from = mono_us();
+            continue;
+        }
+        if (decoder_wait_frame(&seen, VIDEO_HOLD_INTERVAL_MS))
             continue;
+
+        int idle_ms = (int) ((mono_us() - idle_from) / 1000);
+        if (idle_ms >= VIDEO_HOLD_AFTER_MS + VIDEO_HOLD_INTERVAL_MS) {
+            trace_instant("hold", idle_ms);
+            decoder_hold_frame();
+            idle_from = mono_us() - VIDEO_HOLD_AFTER_MS * 1000;
         }
-        process_frame(f);
-        push_jpg_frame(f, true);
     }
     dbgprint("Decode Thread End\n");
     return 0;
 }
 
-const char* codec_names[] = {
-    "jpg", "avc",
+/* Video
+ * The stream runs on the reactor as a state machine: listen or connect,
+ * handshake, then frames read without blocking straight into the receive
+ * slots. A periodic check replaces the socket timeout, probing a stalled
+ * stream and dropping it if the probe goes unanswered. Reconnects back
+ * off on timers, cut short by the adb tracking socket or a usbmuxd
+ * attach.
+ */
+enum {
+    VIDEO_IDLE,
+    VIDEO_LISTEN,
+    VIDEO_CONNECTING,
+    VIDEO_HANDSHAKE,
+    VIDEO_STREAM,
+    VIDEO_BACKOFF,
 };
 
-void *VideoThreadProc(void *args) {
+#define VIDEO_STALL_CHECK_MS 250
+#define VIDEO_IOS_POLL_MS    100
+#define VIDEO_REPLY_LEN      9
+
+static struct {
+    int state;
+    SOCKET sock;
+    SOCKET server;
+    int timer;        // connect or handshake timeout, stall check, backoff
+    int ios_timer;
+    int keep_waiting; // listen mode, wait for the next phone after this one
+    int reconnecting;
+    int backoff_ms;
+    int probed;
+    int64_t last_rx_us;
+    int64_t probe_us;
+    SOCKET adb_track;
+    struct phone_job *job;
+    struct phone_job *track_job;
+    int adb_online;
+    int ios_seq;
+    struct uring_rx *ring;
+    char reply[CONNECT_REPLY_MAX];
+    int reply_got;
+
+    // the frame being received, f is NULL when it's skipped
+    char hdr[4];
+    int hdr_got;
+    JPGFrame *f;
+    unsigned length;
+    unsigned body_got;
+    int64_t t_start;
+} video = {
+    .sock = INVALID_SOCKET,
+    .server = INVALID_SOCKET,
+    .timer = -1,
+    .ios_timer = -1,
+    .adb_track = INVALID_SOCKET,
+};
+
+static char video_skip[4096];
+
+static void VideoIO(int fd, uint32_t events, void *data);
+static void VideoRetry(int fd, uint32_t events, void *data);
+static void VideoReconnect(void);
+static void VideoLost(void);
+static void VideoEnd(void);
+
+static void VideoTimer(int first_ms, int interval_ms, reactor_cb cb) {
+    reactor_timer_del(video.timer);
+    video.timer = cb ? reactor_timer_add(first_ms, interval_ms, cb, NULL) : -1;
+}
+
+// where the next bytes of the stream go
+static char *VideoTarget(int *len) {
+    if (video.hdr_got < 4) {
+        *len = 4 - video.hdr_got;
+        return video.hdr + video.hdr_got;
+    }
+
+    unsigned left = video.length - video.body_got;
+    if (!video.f) {
+        *len = left < sizeof(video_skip) ? (int) left : (int) sizeof(video_skip);
+        return video_skip;
+    }
+
+    *len = left;
+    return (char*) video.f->data + video.body_got;
+}
+
+static void VideoRingRegister(void) {
+#ifdef USE_IO_URING
+    size_t len;
+    void *pool = decoder_get_frame_pool(&len);
+    if (video.ring && pool)
+        uring_rx_register(video.ring, pool, len);
+#endif
+}
+
+static void VideoRingIO(int fd, uint32_t events, void *data);
+
+// the ring takes over the socket's receives, if one can be set up
+static int VideoRingStart(void) {
+#ifdef USE_IO_URING
+    video.ring = uring_rx_new(VideoRingIO, NULL);
+    if (!video.ring)
+        return -1;
+
+    VideoRingRegister();
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+static void VideoRingStop(void) {
+#ifdef USE_IO_URING
+    uring_rx_free(video.ring);
+    video.ring = NULL;
+#endif
+}
+
+static int VideoRingNext(void) {
+#ifdef USE_IO_URING
+    int len;
+    char *buf = VideoTarget(&len);
+    return uring_rx_submit(video.ring, video.sock, buf, len);
+#else
+    return -1;
+#endif
+}
+
+static void VideoSendCommand(void) {
+    char buf[32];
+    int len = 0;
+
+    if (thread_cmd == 0)
+        return;
+
+    if (thread_cmd == CB_CONTROL_WB) {
+        len = snprintf(buf, sizeof(buf), OTHER_REQ_STR, thread_cmd, thread_cmd_val_str);
+    }
+    else {
+        len = snprintf(buf, sizeof(buf), OTHER_REQ, thread_cmd);
+    }
+#ifdef USE_IO_URING
+    // one request in flight at a time, a newer one waits for the next frame
+    if (len && video.ring) {
+        if (uring_rx_send(video.ring, video.sock, buf, len) == 0)
+            thread_cmd = 0;
+        return;
+    }
+#endif
+    if (len) {
+        Send(buf, len, video.sock);
+    }
+    thread_cmd = 0;
+}
+
+static int VideoFrameStart(unsigned length) {
+    video.t_start = lat_now();
+    video.length = length;
+    video.body_got = 0;
+
+    // sanity limit, anything bigger is a broken stream
+    if (length > VIDEO_FRAME_MAX) {
+        errprint("can't take a %u byte frame\n", length);
+        return -1;
+    }
+
+    video.f = pull_empty_jpg_frame();
+    if (video.f && length > video.f->size) {
+        // bigger than the receive slots, the phone went up in resolution
+        push_jpg_frame(video.f, true);
+        video.f = NULL;
+        if (!decoder_grow_frames(length)) {
+            errprint("can't take a %u byte frame\n", length);
+            return -1;
+        }
+
+        VideoRingRegister();
+        video.f = pull_empty_jpg_frame();
+    }
+
+    if (video.f)
+        video.f->length = length;
+    else
+        lat_drop(LAT_DROP_NO_SLOT);
+    return 0;
+}
+
+static void VideoFrameDone(void) {
+    if (video.f) {
+        video.f->t_start = video.t_start;
+        lat_record(LAT_RECV, lat_now() - video.t_start);
+        push_jpg_frame(video.f, false);
+        video.f = NULL;
+    }
+
+    video.hdr_got = 0;
+    RearmQuickAck(video.sock);
+    VideoSendCommand();
+}
+
+// n more bytes landed at VideoTarget(), returns -1 to drop the stream
+static int VideoReceived(int n) {
+    video.last_rx_us = mono_us();
+    video.probed = 0;
+
+    if (video.hdr_got < 4) {
+        video.hdr_got += n;
+        if (video.hdr_got < 4)
+            return 0;
+        if (VideoFrameStart(le32toh(*(uint32_t*) video.hdr)) < 0)
+            return -1;
+    } else {
+        video.body_got += n;
+    }
+
+    if (video.body_got == video.length)
+        VideoFrameDone();
+    return 0;
+}
+
+static void VideoRingIO(__attribute__((__unused__)) int fd,
+    __attribute__((__unused__)) uint32_t events, __attribute__((__unused__)) void *data)
+{
+#ifdef USE_IO_URING
+    int res;
+    while (video.ring && uring_rx_reap(video.ring, &res)) {
+        if (res == -EINVAL || res == -EOPNOTSUPP) {
+            // the kernel can't do this receive, nothing was read
+            dbgprint("io_uring: video receive failed: %s\n", strerror(-res));
+            VideoRingStop();
+            if (reactor_add(video.sock, EPOLLIN, VideoIO, NULL) < 0)
+                VideoLost();
+            return;
+        }
+        if (res <= 0) {
+            errno = res < 0 ? -res : ECONNRESET;
+            VideoLost();
+            return;
+        }
+        if (VideoReceived(res) < 0 || VideoRingNext() < 0) {
+            VideoLost();
+            return;
+        }
+    }
+#endif
+}
+
+// drops the connection, the session carries on
+static void VideoClose(void) {
+    PhoneJobCancel(&video.job);
+    VideoTimer(0, 0, NULL);
+    reactor_timer_del(video.ios_timer);
+    video.ios_timer = -1;
+
+    // the ring may still be receiving into the frame
+    VideoRingStop();
+    if (video.f) {
+        push_jpg_frame(video.f, true);
+        video.f = NULL;
+    }
+
+    if (video.sock != INVALID_SOCKET) {
+        reactor_del(video.sock);
+        disconnect(video.sock);
+        video.sock = INVALID_SOCKET;
+    }
+}
+
+static void VideoFinish(void) {
+    PhoneJobCancel(&video.track_job);
+    if (video.adb_track != INVALID_SOCKET) {
+        reactor_del(video.adb_track);
+        disconnect(video.adb_track);
+        video.adb_track = INVALID_SOCKET;
+    }
+
+    connection_cleanup();
+    video.server = INVALID_SOCKET;
+    lat_report();
+    video.state = VIDEO_IDLE;
+    dbgprint("Video stopped\n");
+}
+
+static void VideoPrepare(void) {
+    VideoTimer(0, 0, NULL);
+    if (decoder_prepare_video(video.reply) == 0) {
+        VideoEnd();
+        return;
+    }
+
+    if (video.reconnecting) {
+        infoprint("video reconnected\n");
+        video_reconnects++;
+    }
+    video.reconnecting = 0;
+    video.backoff_ms = RECONNECT_MIN_MS;
+    video.probed = 0;
+    video.last_rx_us = mono_us();
+    video.hdr_got = 0;
+    video.body_got = 0;
+    video.length = 0;
+    TuneStreamSocket(video.sock);
+
+    reactor_del(video.sock);
+    if (VideoRingStart() < 0 && reactor_add(video.sock, EPOLLIN, VideoIO, NULL) < 0) {
+        errprint("epoll error %d '%s'\n", errno, strerror(errno));
+        VideoEnd();
+        return;
+    }
+
+    video.state = VIDEO_STREAM;
+    VideoTimer(VIDEO_STALL_CHECK_MS, VIDEO_STALL_CHECK_MS, VideoIO);
+    v_active = 1;
+    if (video.ring && VideoRingNext() < 0)
+        VideoLost();
+}
+
+static void VideoFail(const char *msg) {
+    if (video.reconnecting) {
+        VideoReconnect();
+        return;
+    }
+
+    MSG_ERROR(msg);
+    VideoEnd();
+}
+
+static void VideoConnected(SOCKET s) {
     char buf[32];
-    SOCKET videoSocket = (SOCKET_PTR) args;
     int len;
-    int keep_waiting = 0;
-    dbgprint("Video Thread Started s=%d\n", videoSocket);
 
-server_wait:
-    if (videoSocket == INVALID_SOCKET) {
-        videoSocket = accept_connection(g_settings.port);
-        if (videoSocket == INVALID_SOCKET) { goto early_out; }
-        keep_waiting = 1;
+    fcntl(s, F_SETFL, fcntl(s, F_GETFL, NULL) | O_NONBLOCK);
+    video.sock = s;
+    if (video_reply_len > 0) {
+        // the connection race already did the handshake
+        memcpy(video.reply, video_reply, video_reply_len);
+        video_reply_len = 0;
+        VideoPrepare();
+        return;
     }
 
     len = snprintf(buf, sizeof(buf), VIDEO_REQ, codec_names[g_settings.encoder],
                             decoder_get_video_width(), decoder_get_video_height());
 
-    if (Send(buf, len, videoSocket) <= 0){
+    if (Send(buf, len, s) <= 0) {
         errprint("send error (%d) '%s'\n", errno, strerror(errno));
-        MSG_ERROR("Error sending request, DroidCam might be busy with another client.");
-        goto early_out;
+        VideoFail("Error sending request, DroidCam might be busy with another client.");
+        return;
     }
 
-    memset(buf, 0, sizeof(buf));
-    if (RecvAll(buf, 9, videoSocket) <= 0) {
-        errprint("recv error (%d) '%s'\n", errno, strerror(errno));
-        MSG_ERROR("Connection reset!\nIs the app running?");
-        goto early_out;
+    if (reactor_add(s, EPOLLIN, VideoIO, NULL) < 0) {
+        errprint("epoll error %d '%s'\n", errno, strerror(errno));
+        VideoEnd();
+        return;
     }
 
-    if (decoder_prepare_video(buf) == 0) {
-        goto early_out;
-    }
+    memset(video.reply, 0, sizeof(video.reply));
+    video.reply_got = 0;
+    video.state = VIDEO_HANDSHAKE;
+    VideoTimer(HANDSHAKE_TIMEOUT_MS, 0, VideoIO);
+}
 
-    v_active = 1;
-    while (v_running != 0){
-        if (thread_cmd != 0) {
-            len = 0;
-            if (thread_cmd == CB_CONTROL_WB) {
-                len = snprintf(buf, sizeof(buf), OTHER_REQ_STR, thread_cmd, thread_cmd_val_str);
-            }
-            else {
-                len = snprintf(buf, sizeof(buf), OTHER_REQ, thread_cmd);
-            }
-            if (len) {
-                Send(buf, len, videoSocket);
-            }
-            thread_cmd = 0;
-        }
+static void VideoAccept(int fd, __attribute__((__unused__)) uint32_t events,
+    __attribute__((__unused__)) void *data)
+{
+    SOCKET s = AcceptClient(fd, NULL, 0);
+    if (s == INVALID_SOCKET) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED)
+            return;
 
-        JPGFrame *f = pull_empty_jpg_frame();
-        if (RecvAll(buf, 4, videoSocket) <= 0)
-            break;
+        MSG_LASTERROR("Accept Failed");
+        reactor_del(fd);
+        VideoFinish();
+        return;
+    }
 
-        f->length = le32toh(*(uint32_t*) buf);
-        if (RecvAll((const char*)f->data, f->length, videoSocket) <= 0)
-            break;
+    errprint("got socket %d\n", s);
+    reactor_del(fd);
+    video.keep_waiting = 1;
+    VideoConnected(s);
+}
 
-        push_jpg_frame(f, false);
+static void VideoListen(void) {
+    video.server = ListenSocket(g_settings.port);
+    if (video.server == INVALID_SOCKET || reactor_add(video.server, EPOLLIN, VideoAccept, NULL) < 0) {
+        VideoFinish();
+        return;
     }
 
-early_out:
+    errprint("waiting on port %d..", g_settings.port);
+    video.state = VIDEO_LISTEN;
+}
+
+// early_out: the session ends, or goes back to waiting for a phone
+static void VideoEnd(void) {
     v_active = 0;
     dbgprint("disconnect\n");
-    disconnect(videoSocket);
+    VideoClose();
     decoder_cleanup();
 
-    if (v_running && keep_waiting){
-        videoSocket = INVALID_SOCKET;
-        goto server_wait;
+    if (v_running && video.keep_waiting) {
+        VideoListen();
+        return;
     }
+    VideoFinish();
+}
 
-    connection_cleanup();
-    dbgprint("Video Thread End\n");
-    return 0;
+static void VideoLost(void) {
+    // a listen mode session was handed its phone, it ends with it
+    if (v_running && !video.keep_waiting && g_settings.connection != CB_WIFI_SRVR) {
+        errprint("video connection lost (%d) '%s'\n", errno, strerror(errno));
+        video.reconnecting = 1;
+        VideoReconnect();
+        return;
+    }
+    VideoEnd();
 }
 
+static void VideoIosPoll(__attribute__((__unused__)) int fd,
+    __attribute__((__unused__)) uint32_t events, __attribute__((__unused__)) void *data)
+{
+    if (iOSWaitAttach(&video.ios_seq, 0)) {
+        dbgprint("ios device is back\n");
+        video.backoff_ms = RECONNECT_MIN_MS;
+        VideoRetry(-1, 0, NULL);
+    }
+}
+
+static void VideoAdbTrack(int fd, __attribute__((__unused__)) uint32_t events,
+    __attribute__((__unused__)) void *data)
+{
+    int rc = AdbTrackWait(fd, &video.adb_online, 0);
+    if (rc < 0) {
+        reactor_del(fd);
+        disconnect(fd);
+        video.adb_track = INVALID_SOCKET;
+    }
+    else if (rc > 0 && video.state == VIDEO_BACKOFF) {
+        dbgprint("adb device is back\n");
+        video.backoff_ms = RECONNECT_MIN_MS;
+        VideoRetry(-1, 0, NULL);
+    }
+}
 
-void *AudioThreadProc(void *arg) {
-    char     stream_buf[STREAM_BUF_SIZE];
-    short    decode_buf[DECODE_BUF_SIZE]={0};
-    int      decode_buf_used = 0;
-    int      chunks_per_packet;
-    int      bytes_per_packet;
-    int      keepAliveCounter = 0;
-    int      mode = 0;
-    SOCKET   socket = 0;
-    (void)   arg;
+static void VideoAdbTrackOpened(SOCKET s) {
+    if (s == INVALID_SOCKET)
+        return;
 
-    struct snd_transfer_s transfer;
-    snd_pcm_t *handle = decoder_prepare_audio();
-    transfer.first = 1;
-    if (!handle) {
-        MSG_ERROR("Missing audio device");
-        return 0;
+    if (reactor_add(s, EPOLLIN, VideoAdbTrack, NULL) < 0) {
+        disconnect(s);
+        return;
     }
+    video.adb_track = s;
+}
 
-    // wait for video
-    while (v_running) {
-        usleep(200000);
-        if (v_active) break;
-        if (!a_running) return 0;
+static void VideoReconnect(void) {
+    // decoder and frame buffers stay, the decode thread keeps the last frame up
+    v_active = 0;
+    VideoClose();
+
+    if (phone.route == CB_RADIO_ADB && video.adb_track == INVALID_SOCKET && !video.track_job)
+        PhoneJobStart(&video.track_job, AdbTrackOpen, VideoAdbTrackOpened);
+
+    // a device coming back over usb cuts the backoff short
+    dbgprint("reconnect in %dms\n", video.backoff_ms);
+    trace_instant("reconnect", video.backoff_ms);
+    video.state = VIDEO_BACKOFF;
+    VideoTimer(video.backoff_ms, 0, VideoRetry);
+    if (phone.route == CB_RADIO_IOS)
+        video.ios_timer = reactor_timer_add(VIDEO_IOS_POLL_MS, VIDEO_IOS_POLL_MS, VideoIosPoll, NULL);
+}
+
+static void VideoPhoneConnected(SOCKET s) {
+    if (s == INVALID_SOCKET) {
+        VideoReconnect();
+        return;
     }
 
-    if (g_settings.connection == CB_RADIO_IOS)
-        goto TCP_ONLY;
-    if (strncmp(g_settings.ip, ADB_LOCALHOST_IP, CSTR_LEN(ADB_LOCALHOST_IP)) == 0)
-        goto TCP_ONLY;
+    if (phone.route == CB_RADIO_IOS) {
+        VideoConnected(s);
+        return;
+    }
 
-    // Try to stream via UDP first
-    socket = CreateUdpSocket();
-    if (socket <= 0) goto TCP_ONLY;
-
-    for (int tries = 0; tries < 3; tries++) {
-        dbgprint("Audio Thread UDP try #%d\n", tries);
-        SendUDPMessage(socket, AUDIO_REQ, CSTR_LEN(AUDIO_REQ), g_settings.ip, g_settings.port + 1);
-        for (int i = 0; i < 12; i++) {
-            usleep(32000);
-            int len = RecvNonBlockUDP(stream_buf, STREAM_BUF_SIZE, socket);
-            if (len < 0) { goto TCP_ONLY; }
-            if (len > 0) {
-                bytes_per_packet = CHUNKS_PER_PACKET * DROIDCAM_SPX_CHUNK_BYTES_2;
-                mode = UDP_STREAM;
-                goto STREAM;
-            }
-        }
+    if (reactor_add(s, EPOLLOUT, VideoIO, NULL) < 0) {
+        disconnect(s);
+        VideoReconnect();
+        return;
     }
 
-TCP_ONLY:
-    dbgprint("UDP didnt work, trying TCP\n");
-    mode = TCP_STREAM;
-    socket = GetConnection();
+    video.sock = s;
+    VideoTimer(CONNECT_TIMEOUT_MS, 0, VideoIO);
+}
 
-    if (socket == INVALID_SOCKET) {
-        errprint("Audio Connection failed\n");
-        return 0;
+static void VideoRetry(__attribute__((__unused__)) int fd,
+    __attribute__((__unused__)) uint32_t events, __attribute__((__unused__)) void *data)
+{
+    VideoClose();
+    video.backoff_ms *= 2;
+    if (video.backoff_ms > RECONNECT_MAX_MS)
+        video.backoff_ms = RECONNECT_MAX_MS;
+
+    if (PhoneJobStart(&video.job, ConnectPhone, VideoPhoneConnected) < 0) {
+        VideoReconnect();
+        return;
     }
+    video.state = VIDEO_CONNECTING;
+}
 
-    if (Send(AUDIO_REQ, CSTR_LEN(AUDIO_REQ), socket) <= 0) {
-        errprint("send error (audio) (%d) '%s'\n", errno, strerror(errno));
-        MSG_ERROR("Error sending audio request");
-        goto early_out;
+// a stalled stream gets a ping, and is dropped if that goes unanswered
+static void VideoStallCheck(void) {
+    int64_t now = mono_us();
+
+    VideoSendCommand();
+    if (!video.probed && now - video.last_rx_us >= VIDEO_PROBE_AFTER_MS * 1000LL) {
+        dbgprint("video stalled, probing\n");
+        trace_instant("stall", VIDEO_PROBE_AFTER_MS);
+        video.probed = 1;
+        video.probe_us = now;
+        if (Send(PING_REQ, CSTR_LEN(PING_REQ), video.sock) <= 0)
+            VideoLost();
+        return;
     }
 
-    memset(stream_buf, 0, 6);
-    if (RecvAll(stream_buf, 6, socket) <= 0) {
-        errprint("recv error (audio) (%d) '%s'\n", errno, strerror(errno));
-        MSG_ERROR("Audio connection reset!");
-        goto early_out;
+    if (video.probed && now - video.probe_us >= VIDEO_PROBE_AFTER_MS * 1000LL) {
+        errno = ETIMEDOUT;
+        VideoLost();
     }
+}
 
-    if (stream_buf[0] != '-' || stream_buf[1] != '@'
-        || stream_buf[2] != 'v'
-        || stream_buf[3] != '0'
-        || stream_buf[4] != '2'){
-        MSG_ERROR("Invalid audio data stream!");
-        goto early_out;
+static void VideoTimeout(void) {
+    errno = ETIMEDOUT;
+    if (video.state == VIDEO_CONNECTING) {
+        dbgprint("video: connect timed out\n");
+        VideoReconnect();
+        return;
     }
 
-    chunks_per_packet = stream_buf[5];
-    if (CHUNKS_PER_PACKET != chunks_per_packet) {
-        MSG_ERROR("Unsupported audio stream");
-        goto early_out;
+    errprint("recv error (%d) '%s'\n", errno, strerror(errno));
+    VideoFail("Connection reset!\nIs the app running?");
+}
+
+static void VideoIO(int fd, __attribute__((__unused__)) uint32_t events,
+    __attribute__((__unused__)) void *data)
+{
+    int len, err;
+
+    if (fd == video.timer) {
+        if (video.state == VIDEO_STREAM)
+            VideoStallCheck();
+        else
+            VideoTimeout();
+        return;
     }
 
-    bytes_per_packet = CHUNKS_PER_PACKET * DROIDCAM_SPX_CHUNK_BYTES_2;
+    switch (video.state) {
+    case VIDEO_CONNECTING:
+        err = ConnectError(fd);
+        if (err != 0) {
+            dbgprint("video: connect failed: %s\n", strerror(err));
+            VideoReconnect();
+            return;
+        }
+        reactor_del(fd);
+        video.sock = INVALID_SOCKET;
+        VideoTimer(0, 0, NULL);
+        VideoConnected(fd);
+        return;
 
-STREAM:
-    a_active = 1;
-    while (a_running) {
-        int len = (mode == UDP_STREAM)
-            ? RecvNonBlockUDP(stream_buf, STREAM_BUF_SIZE, socket)
-            : RecvNonBlock   (stream_buf, STREAM_BUF_SIZE, socket);
+    case VIDEO_HANDSHAKE:
+        len = RecvNonBlock(video.reply + video.reply_got, VIDEO_REPLY_LEN - video.reply_got, fd);
         if (len < 0) {
-            errprint("recv error (audio) (%d) '%s'\n", errno, strerror(errno));
-            goto early_out;
+            errprint("recv error (%d) '%s'\n", errno, strerror(errno));
+            VideoFail("Connection reset!\nIs the app running?");
+            return;
         }
+        video.reply_got += len;
+        if (video.reply_got == VIDEO_REPLY_LEN)
+            VideoPrepare();
+        return;
 
-        if (len > 0) {
-            // dbgprint("recv %d frames\n", (len / DROIDCAM_SPX_CHUNK_BYTES_2));
-            // if we get more than 1 frame, fast-fwd to latest one
-            int idx = 0;
-            if (len > bytes_per_packet) {
-                // dbgprint("got excess data: %u bytes\n", len);
-                idx = (len - bytes_per_packet);
-                // not needed, but: len = bytes_per_packet;
+    case VIDEO_STREAM:
+        for (;;) {
+            char *buf = VideoTarget(&len);
+            len = RecvNonBlock(buf, len, fd);
+            if (len == 0)
+                return;
+            if (len < 0 || VideoReceived(len) < 0) {
+                VideoLost();
+                return;
             }
-            decode_speex_frame(&stream_buf[idx], decode_buf, CHUNKS_PER_PACKET);
-            // if (decode_buf_used) dbgprint("overwriting %d frames\n", decode_buf_used);
-            decode_buf_used = CHUNKS_PER_PACKET * DROIDCAM_PCM_CHUNK_SAMPLES_2;
         }
+    }
+}
 
-        int err = snd_transfer_check(handle, &transfer);
-        if (err < 0) {
-            MSG_ERROR("Audio Error: snd_transfer_check failed");
-            goto early_out;
-        }
-        if (err == 0) {
-            usleep(1000);
-            continue;
+/* Starts a video session on a connected socket, or with INVALID_SOCKET
+ * waits for the phone on g_settings.port. Call from the reactor thread.
+ */
+void VideoStart(SOCKET s) {
+    dbgprint("Video start s=%d\n", s);
+    video.keep_waiting = 0;
+    video.reconnecting = 0;
+    video.backoff_ms = RECONNECT_MIN_MS;
+    video.adb_online = -1;
+    video.ios_seq = -1;
+
+    if (s == INVALID_SOCKET) {
+        VideoListen();
+        return;
+    }
+    VideoConnected(s);
+}
+
+void VideoStop(void) {
+    if (video.state == VIDEO_IDLE)
+        return;
+
+    if (video.state == VIDEO_LISTEN)
+        reactor_del(video.server);
+    v_active = 0;
+    VideoClose();
+    decoder_cleanup();
+    VideoFinish();
+}
+
+// 0 once the session ended by itself
+int VideoBusy(void) {
+    return video.state != VIDEO_IDLE;
+}
+
+/* Audio
+ * Also on the reactor: the UDP probe and the TCP fallback handshake run
+ * on timers and readiness events, then packets are decoded as they come
+ * in and the device is fed whenever its descriptors say it can take a
+ * period, or at least every AUDIO_POLL_TIMEOUT_MS so stalls and xruns
+ * get recovered.
+ */
+enum {
+    AUDIO_IDLE,
+    AUDIO_WAIT_VIDEO,
+    AUDIO_UDP_PROBE,
+    AUDIO_CONNECTING,
+    AUDIO_HANDSHAKE,
+    AUDIO_STREAM,
+};
+
+#define AUDIO_WAIT_VIDEO_MS 200
+#define AUDIO_UDP_TRIES     3
+#define AUDIO_UDP_TRY_MS    (12 * 32)
+#define AUDIO_REPLY_LEN     6
+
+static struct {
+    int state;
+    int mode;
+    SOCKET sock;
+    int timer;
+    int tries;
+    int keepalive;
+    int staged_max;
+    int bytes_per_packet;
+    snd_pcm_t *handle;
+    struct snd_transfer_s transfer;
+    struct pollfd pfds[AUDIO_POLLFD_MAX];
+    int snd_nfds;
+    char reply[AUDIO_REPLY_LEN];
+    int reply_got;
+    struct uring_rx *ring;
+    struct udp_batch batch;
+    struct phone_job *job;
+    char stream_buf[STREAM_BUF_SIZE];
+} audio = {
+    .sock = INVALID_SOCKET,
+    .timer = -1,
+};
+
+static void AudioTimer(int first_ms, int interval_ms, reactor_cb cb) {
+    reactor_timer_del(audio.timer);
+    audio.timer = cb ? reactor_timer_add(first_ms, interval_ms, cb, NULL) : -1;
+}
+
+// early_out
+static void AudioEnd(void) {
+    a_active = 0;
+    if (audio.mode == UDP_STREAM) {
+        SendUDPMessage(audio.sock, STOP_REQ, CSTR_LEN(STOP_REQ), phone.ip, g_settings.port + 1);
+        infoprint("audio: %lu packets, %lu lost, %lu late, %lu filtered, jitter %dus\n",
+            audio_udp_stats.packets, audio_udp_stats.lost, audio_udp_stats.late,
+            audio_udp_stats.filtered, audio_udp_stats.jitter_us);
+    }
+
+    PhoneJobCancel(&audio.job);
+    AudioTimer(0, 0, NULL);
+    for (int i = 0; i < audio.snd_nfds; i++)
+        reactor_del(audio.pfds[i].fd);
+    audio.snd_nfds = 0;
+
+#ifdef USE_IO_URING
+    uring_rx_free(audio.ring);
+    audio.ring = NULL;
+#endif
+
+    if (audio.sock != INVALID_SOCKET) {
+        reactor_del(audio.sock);
+        disconnect(audio.sock);
+        audio.sock = INVALID_SOCKET;
+    }
+
+    audio.mode = 0;
+    audio.state = AUDIO_IDLE;
+    dbgprint("Audio stopped\n");
+}
+
+static void AudioTransfer(void) {
+    int64_t t0 = lat_now();
+    int err;
+
+    while ((err = snd_transfer_check(audio.handle, &audio.transfer)) > 0) {
+        struct snd_transfer_s *transfer = &audio.transfer;
+        // dbgprint("can transfer %ld frames with offset=%ld\n", transfer->frames, transfer->offset);
+        // the drift compensation should keep this rare, drop the oldest audio if
+        // the phone got too far ahead (eg. after a network stall)
+        int dropped = decoder_audio_trim(audio.staged_max);
+        if (dropped) {
+            dbgprint("dropped %d staged frames\n", dropped);
         }
 
-        // dbgprint("can transfer %ld frames with offset=%ld\n", transfer.frames, transfer.offset);
-        if (decode_buf_used == 0) {
-            decoder_speex_plc(&transfer);
+        int staged = decoder_audio_staged();
+        decoder_audio_drift_update(staged + transfer->queued);
+        if (staged == 0) {
+            trace_instant("plc", (int) transfer->frames);
+            decoder_speex_plc(transfer);
         } else {
-            short *output_buffer = (short *)transfer.my_areas->addr;
-            if ((int)transfer.frames >= decoder_get_audio_frame_size()) {
-                transfer.frames = decoder_get_audio_frame_size();
-            }
-            memcpy(&output_buffer[transfer.offset], decode_buf, transfer.frames * sizeof(short));
-            memmove(decode_buf, &decode_buf[transfer.frames], transfer.frames * sizeof(short));
-            decode_buf_used -= transfer.frames;
-            // dbgprint("copied %ld frames\n", transfer.frames);
+            short *output_buffer = (short *)transfer->my_areas->addr;
+            transfer->frames = decoder_audio_read(&output_buffer[transfer->offset], transfer->frames);
+            // dbgprint("copied %ld frames\n", transfer->frames);
         }
 
-        err = snd_transfer_commit(handle, &transfer);
+        err = snd_transfer_commit(audio.handle, transfer);
         if (err < 0) {
             MSG_ERROR("Audio Error: snd_transfer_commit failed");
-            goto early_out;
+            AudioEnd();
+            return;
         }
 
-        if (mode == UDP_STREAM && ++keepAliveCounter > 1024) {
-            keepAliveCounter = 0;
+        if (audio.mode == UDP_STREAM && ++audio.keepalive > 1024) {
+            audio.keepalive = 0;
             dbgprint("audio keepalive\n");
-            SendUDPMessage(socket, AUDIO_REQ, CSTR_LEN(AUDIO_REQ), g_settings.ip, g_settings.port + 1);
+            SendUDPMessage(audio.sock, AUDIO_REQ, CSTR_LEN(AUDIO_REQ), phone.ip, g_settings.port + 1);
         }
-        usleep(2000);
+        trace_span("alsa write", t0, lat_now() - t0);
+        t0 = lat_now();
+    }
+    if (err < 0) {
+        MSG_ERROR("Audio Error: snd_transfer_check failed");
+        AudioEnd();
     }
+}
 
-early_out:
-    a_active = 0;
-    if (mode == UDP_STREAM)
-        SendUDPMessage(socket, STOP_REQ, CSTR_LEN(STOP_REQ), g_settings.ip, g_settings.port + 1);
+static void AudioTick(__attribute__((__unused__)) int fd,
+    __attribute__((__unused__)) uint32_t events, __attribute__((__unused__)) void *data)
+{
+    AudioTransfer();
+}
 
-    if (socket > 0)
-        disconnect(socket);
+static void AudioDeviceIO(__attribute__((__unused__)) int fd, uint32_t events, void *data) {
+    struct pollfd *pfd = data;
 
-    dbgprint("Audio Thread End\n");
-    return 0;
+    // the epoll and poll event bits are the same
+    for (int i = 0; i < audio.snd_nfds; i++)
+        audio.pfds[i].revents = 0;
+    pfd->revents = (short) events;
+
+    if (snd_poll_ready(audio.handle, audio.pfds, audio.snd_nfds))
+        AudioTransfer();
+}
+
+static void AudioRecvIO(int fd, uint32_t events, void *data);
+
+static int AudioRecvBatch(void) {
+#ifdef USE_IO_URING
+    if (audio.ring) {
+        int count = uring_udp_reap(audio.ring, &audio.batch, phone.ip, g_settings.port + 1);
+        if (count != URING_FALLBACK)
+            return count;
+
+        // carry on with recvmmsg() on the socket
+        uring_rx_free(audio.ring);
+        audio.ring = NULL;
+        if (reactor_add(audio.sock, EPOLLIN, AudioRecvIO, NULL) < 0)
+            return -1;
+    }
+#endif
+    return RecvBatchUDP(&audio.batch, audio.sock, phone.ip, g_settings.port + 1);
+}
+
+static void AudioRecvIO(__attribute__((__unused__)) int fd,
+    __attribute__((__unused__)) uint32_t events, __attribute__((__unused__)) void *data)
+{
+    int64_t t0 = lat_now();
+
+    if (audio.mode == UDP_STREAM) {
+        // drain everything queued since the last wakeup
+        int count;
+        do {
+            count = AudioRecvBatch();
+            if (count < 0) {
+                errprint("recv error (audio) (%d) '%s'\n", errno, strerror(errno));
+                AudioEnd();
+                return;
+            }
+
+            audio_udp_stats.filtered += audio.batch.filtered;
+            if (count > 0) audio_udp_stats.batches++;
+
+            for (int i = 0; i < count; i++) {
+                UdpStreamTrack(&audio_udp_stats, audio.batch.stamp[i], audio.batch.len[i], AUDIO_PACKET_US);
+                if (audio.batch.len[i] >= audio.bytes_per_packet)
+                    decode_speex_frame(&audio.batch.data[i][audio.batch.len[i] - audio.bytes_per_packet], CHUNKS_PER_PACKET);
+            }
+        } while (count == UDP_BATCH_MAX);
+
+        if (audio_udp_stats.packets > 0)
+            audio.staged_max = AUDIO_STAGED_MAX + decoder_audio_set_jitter(audio_udp_stats.jitter_us);
+        trace_span("audio recv", t0, lat_now() - t0);
+        return;
+    }
+
+    int len = RecvNonBlock(audio.stream_buf, STREAM_BUF_SIZE, audio.sock);
+    if (len < 0) {
+        errprint("recv error (audio) (%d) '%s'\n", errno, strerror(errno));
+        AudioEnd();
+        return;
+    }
+
+    if (len > 0) {
+        // dbgprint("recv %d frames\n", (len / DROIDCAM_SPX_CHUNK_BYTES_2));
+        // if we get more than 1 frame, fast-fwd to latest one
+        int idx = 0;
+        if (len > audio.bytes_per_packet) {
+            // dbgprint("got excess data: %u bytes\n", len);
+            idx = (len - audio.bytes_per_packet);
+            // not needed, but: len = bytes_per_packet;
+        }
+        decode_speex_frame(&audio.stream_buf[idx], CHUNKS_PER_PACKET);
+        trace_span("audio recv", t0, lat_now() - t0);
+    }
+}
+
+static void AudioStream(void) {
+    int nfds;
+
+    // wake up only when a packet arrives or the device can take a period
+    AudioTimer(0, 0, NULL);
+    reactor_del(audio.sock);
+#ifdef USE_IO_URING
+    if (audio.mode == UDP_STREAM && (audio.ring = uring_rx_new(AudioRecvIO, NULL)) != NULL
+        && uring_udp_start(audio.ring, audio.sock) < 0)
+    {
+        uring_rx_free(audio.ring);
+        audio.ring = NULL;
+    }
+#endif
+    if (!audio.ring && reactor_add(audio.sock, EPOLLIN, AudioRecvIO, NULL) < 0) {
+        errprint("epoll error (audio) %d '%s'\n", errno, strerror(errno));
+        AudioEnd();
+        return;
+    }
+
+    nfds = snd_poll_descriptors(audio.handle, audio.pfds, AUDIO_POLLFD_MAX);
+    if (nfds < 0) {
+        MSG_ERROR("Audio Error: snd_poll_descriptors failed");
+        AudioEnd();
+        return;
+    }
+    for (audio.snd_nfds = 0; audio.snd_nfds < nfds; audio.snd_nfds++) {
+        struct pollfd *pfd = &audio.pfds[audio.snd_nfds];
+        if (reactor_add(pfd->fd, pfd->events, AudioDeviceIO, pfd) < 0) {
+            MSG_ERROR("Audio Error: can't watch the device");
+            AudioEnd();
+            return;
+        }
+    }
+
+    AudioTimer(AUDIO_POLL_TIMEOUT_MS, AUDIO_POLL_TIMEOUT_MS, AudioTick);
+    audio.state = AUDIO_STREAM;
+    a_active = 1;
+}
+
+static void AudioTcpIO(int fd, uint32_t events, void *data);
+
+static void AudioConnected(void) {
+    TuneStreamSocket(audio.sock);
+    if (Send(AUDIO_REQ, CSTR_LEN(AUDIO_REQ), audio.sock) <= 0) {
+        errprint("send error (audio) (%d) '%s'\n", errno, strerror(errno));
+        MSG_ERROR("Error sending audio request");
+        AudioEnd();
+        return;
+    }
+
+    reactor_del(audio.sock);
+    if (reactor_add(audio.sock, EPOLLIN, AudioTcpIO, NULL) < 0) {
+        errprint("epoll error (audio) %d '%s'\n", errno, strerror(errno));
+        AudioEnd();
+        return;
+    }
+
+    memset(audio.reply, 0, sizeof(audio.reply));
+    audio.reply_got = 0;
+    audio.state = AUDIO_HANDSHAKE;
+    AudioTimer(HANDSHAKE_TIMEOUT_MS, 0, AudioTcpIO);
+}
+
+static void AudioHandshake(void) {
+    if (audio.reply[0] != '-' || audio.reply[1] != '@'
+        || audio.reply[2] != 'v'
+        || audio.reply[3] != '0'
+        || audio.reply[4] != '2'){
+        MSG_ERROR("Invalid audio data stream!");
+        AudioEnd();
+        return;
+    }
+
+    if (CHUNKS_PER_PACKET != audio.reply[5]) {
+        MSG_ERROR("Unsupported audio stream");
+        AudioEnd();
+        return;
+    }
+
+    audio.bytes_per_packet = CHUNKS_PER_PACKET * DROIDCAM_SPX_CHUNK_BYTES_2;
+    AudioStream();
+}
+
+static void AudioTcpIO(int fd, __attribute__((__unused__)) uint32_t events,
+    __attribute__((__unused__)) void *data)
+{
+    int len;
+
+    if (fd == audio.timer) {
+        errno = ETIMEDOUT;
+        if (audio.state == AUDIO_CONNECTING) {
+            errprint("Audio Connection failed\n");
+        } else {
+            errprint("recv error (audio) (%d) '%s'\n", errno, strerror(errno));
+            MSG_ERROR("Audio connection reset!");
+        }
+        AudioEnd();
+        return;
+    }
+
+    if (audio.state == AUDIO_CONNECTING) {
+        int err = ConnectError(fd);
+        if (err != 0) {
+            errprint("Audio Connection failed: %s\n", strerror(err));
+            AudioEnd();
+            return;
+        }
+        AudioConnected();
+        return;
+    }
+
+    len = RecvNonBlock(audio.reply + audio.reply_got, AUDIO_REPLY_LEN - audio.reply_got, fd);
+    if (len < 0) {
+        errprint("recv error (audio) (%d) '%s'\n", errno, strerror(errno));
+        MSG_ERROR("Audio connection reset!");
+        AudioEnd();
+        return;
+    }
+
+    audio.reply_got += len;
+    if (audio.reply_got == AUDIO_REPLY_LEN)
+        AudioHandshake();
+}
+
+static void AudioPhoneConnected(SOCKET s) {
+    audio.sock = s;
+    if (audio.sock == INVALID_SOCKET) {
+        errprint("Audio Connection failed\n");
+        AudioEnd();
+        return;
+    }
+
+    if (phone.route == CB_RADIO_IOS) {
+        AudioConnected();
+        return;
+    }
+
+    if (reactor_add(audio.sock, EPOLLOUT, AudioTcpIO, NULL) < 0) {
+        errprint("epoll error (audio) %d '%s'\n", errno, strerror(errno));
+        AudioEnd();
+        return;
+    }
+    AudioTimer(CONNECT_TIMEOUT_MS, 0, AudioTcpIO);
+}
+
+static void AudioTcp(void) {
+    dbgprint("UDP didnt work, trying TCP\n");
+    AudioTimer(0, 0, NULL);
+    if (audio.sock != INVALID_SOCKET) {
+        reactor_del(audio.sock);
+        disconnect(audio.sock);
+        audio.sock = INVALID_SOCKET;
+    }
+
+    audio.mode = TCP_STREAM;
+    if (PhoneJobStart(&audio.job, ConnectPhone, AudioPhoneConnected) < 0) {
+        errprint("Audio Connection failed\n");
+        AudioEnd();
+        return;
+    }
+    audio.state = AUDIO_CONNECTING;
+}
+
+static void AudioProbeIO(__attribute__((__unused__)) int fd,
+    __attribute__((__unused__)) uint32_t events, __attribute__((__unused__)) void *data)
+{
+    int len = RecvBatchUDP(&audio.batch, audio.sock, phone.ip, g_settings.port + 1);
+    if (len < 0) {
+        AudioTcp();
+        return;
+    }
+    if (len > 0) {
+        audio.bytes_per_packet = CHUNKS_PER_PACKET * DROIDCAM_SPX_CHUNK_BYTES_2;
+        audio.mode = UDP_STREAM;
+        AudioStream();
+    }
+}
+
+static void AudioProbeTry(__attribute__((__unused__)) int fd,
+    __attribute__((__unused__)) uint32_t events, __attribute__((__unused__)) void *data)
+{
+    if (audio.tries == AUDIO_UDP_TRIES) {
+        AudioTcp();
+        return;
+    }
+
+    dbgprint("Audio UDP try #%d\n", audio.tries++);
+    SendUDPMessage(audio.sock, AUDIO_REQ, CSTR_LEN(AUDIO_REQ), phone.ip, g_settings.port + 1);
+}
+
+static void AudioConnect(void) {
+    AudioTimer(0, 0, NULL);
+    if (phone.route == CB_RADIO_IOS
+        || strncmp(phone.ip, ADB_LOCALHOST_IP, CSTR_LEN(ADB_LOCALHOST_IP)) == 0)
+    {
+        AudioTcp();
+        return;
+    }
+
+    // Try to stream via UDP first
+    audio.sock = CreateUdpSocket();
+    if (audio.sock <= 0) {
+        audio.sock = INVALID_SOCKET;
+        AudioTcp();
+        return;
+    }
+    if (reactor_add(audio.sock, EPOLLIN, AudioProbeIO, NULL) < 0) {
+        AudioTcp();
+        return;
+    }
+
+    audio.tries = 0;
+    audio.state = AUDIO_UDP_PROBE;
+    AudioProbeTry(-1, 0, NULL);
+    AudioTimer(AUDIO_UDP_TRY_MS, AUDIO_UDP_TRY_MS, AudioProbeTry);
+}
+
+static void AudioWaitVideo(__attribute__((__unused__)) int fd,
+    __attribute__((__unused__)) uint32_t events, __attribute__((__unused__)) void *data)
+{
+    if (v_active || !v_running)
+        AudioConnect();
+}
+
+// Call from the reactor thread, a_running set
+void AudioStart(void) {
+    memset(&audio_udp_stats, 0, sizeof(audio_udp_stats));
+
+    audio.handle = decoder_prepare_audio();
+    if (!audio.handle) {
+        MSG_ERROR("Missing audio device");
+        return;
+    }
+
+    audio.transfer.first = 1;
+    audio.mode = 0;
+    audio.keepalive = 0;
+    audio.staged_max = AUDIO_STAGED_MAX;
+
+    // wait for video
+    if (v_running && !v_active) {
+        audio.state = AUDIO_WAIT_VIDEO;
+        AudioTimer(AUDIO_WAIT_VIDEO_MS, AUDIO_WAIT_VIDEO_MS, AudioWaitVideo);
+        return;
+    }
+    AudioConnect();
+}
+
+void AudioStop(void) {
+    if (audio.state != AUDIO_IDLE)
+        AudioEnd();
 }
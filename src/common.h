@@ -28,16 +28,15 @@ void ShowError(const char*, const char*);
 
 #define PING_REQ "CMD /ping"
 #define BATTERY_REQ "GET /battery HTTP/1.0\r\n\r\n"
+#define BATTERY_REQ_KEEPALIVE "GET /battery HTTP/1.1\r\nHost: droidcam\r\nConnection: keep-alive\r\n\r\n"
 
 #define CSTR_LEN(x) (sizeof(x)-1)
 #define ARRAY_LEN(a) (sizeof(a) / sizeof(a[0]))
 
-#define errprint(...) fprintf(stderr, __VA_ARGS__)
-#ifdef DEBUG
-#define dbgprint      errprint
-#else
-#define dbgprint(...) /* */
-#endif
+#include "log.h"
+#define errprint(...)  LOG_AT(LL_ERROR, __VA_ARGS__)
+#define infoprint(...) LOG_AT(LL_INFO, __VA_ARGS__)
+#define dbgprint(...)  LOG_AT(LL_DEBUG, __VA_ARGS__)
 
 #define VIDEO_INBUF_SZ 4096
 #define AUDIO_INBUF_SZ 32
@@ -6,13 +6,19 @@
  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
  */
 
+#define _GNU_SOURCE
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -24,15 +30,85 @@
 
 #include "common.h"
 #include "connection.h"
+#include "settings.h"
 
 SOCKET wifiServerSocket = INVALID_SOCKET;
-extern int v_running;
+static int socket_latency = LATENCY_NORMAL;
 
 char* DROIDCAM_CONNECT_ERROR = \
     "Connect failed, please try again.\n"
     "Check IP and Port.\n"
     "Check network connection.\n";
 
+static void SetBlocking(SOCKET sock) {
+    struct timeval timeout;
+    int flags = fcntl(sock, F_GETFL, NULL);
+    flags &= ~O_NONBLOCK;
+    fcntl(sock, F_SETFL, flags);
+
+    timeout.tv_sec = 5;
+    timeout.tv_usec = 0;
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0
+    || setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0)
+        perror("setsockopt failed");
+}
+
+/* Socket profiles
+ * Stream sockets get TCP_NODELAY so control requests don't sit behind
+ * Nagle. The receive buffer is left to the kernel's autotuning, setting
+ * it on a connected socket turns that off and can't change the window
+ * scale any more. The low latency profile also busy polls and acks
+ * right away.
+ */
+#define BUSY_POLL_US 50
+
+void SetSocketLatencyProfile(int profile) {
+    socket_latency = profile;
+}
+
+static void set_busy_poll(SOCKET sock) {
+#ifdef SO_BUSY_POLL
+    int usec = BUSY_POLL_US;
+    // needs CAP_NET_ADMIN above net.core.busy_read
+    if (setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) < 0) {
+        dbgprint("SO_BUSY_POLL failed: %s\n", strerror(errno));
+    }
+#else
+    (void) sock;
+#endif
+}
+
+void TuneStreamSocket(SOCKET sock) {
+    int on = 1;
+    if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0) {
+        dbgprint("TCP_NODELAY failed: %s\n", strerror(errno));
+    }
+
+    if (socket_latency == LATENCY_LOW) {
+        set_busy_poll(sock);
+        RearmQuickAck(sock);
+    }
+}
+
+// TCP_QUICKACK doesn't stick, the stack may go back to delayed acks after a read
+void RearmQuickAck(SOCKET sock) {
+#ifdef TCP_QUICKACK
+    int on = 1;
+    if (socket_latency == LATENCY_LOW)
+        setsockopt(sock, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+#else
+    (void) sock;
+#endif
+}
+
+void SetRecvTimeout(SOCKET sock, int ms) {
+    struct timeval timeout;
+    timeout.tv_sec = ms / 1000;
+    timeout.tv_usec = (ms % 1000) * 1000;
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0)
+        perror("setsockopt failed");
+}
+
 SOCKET Connect(const char* ip, int port, char **errormsg) {
     int flags;
     struct sockaddr_in sin;
@@ -77,20 +153,289 @@ SOCKET Connect(const char* ip, int port, char **errormsg) {
         goto _error_out;
     }
 
-    flags = fcntl(sock, F_GETFL, NULL);
-    flags &= ~O_NONBLOCK;
-    fcntl(sock, F_SETFL, flags);
-
-    timeout.tv_sec = 5;
-    if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0
-    || setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0)
-        perror("setsockopt failed");
+    SetBlocking(sock);
 
 _error_out:
     dbgprint(" - return fd: %d\n", sock);
     return sock;
 }
 
+enum connect_states {
+    CONNECT_IDLE,
+    CONNECT_WAIT,  // tcp connect in progress
+    CONNECT_REPLY, // request sent, waiting for the reply
+    CONNECT_FAILED,
+};
+
+static int64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void race_wake(struct connect_race *race) {
+    char c = 0;
+    if (write(race->wake[1], &c, 1) < 0) {}
+}
+
+struct connect_race *ConnectRaceNew(void) {
+    struct connect_race *race = calloc(1, sizeof(*race));
+    if (!race)
+        return NULL;
+
+    if (pipe(race->wake) < 0) {
+        errprint("pipe() error %d '%s'\n", errno, strerror(errno));
+        free(race);
+        return NULL;
+    }
+    fcntl(race->wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(race->wake[1], F_SETFL, O_NONBLOCK);
+    pthread_mutex_init(&race->lock, NULL);
+    race->refs = 1;
+    return race;
+}
+
+void ConnectRaceRetain(struct connect_race *race) {
+    pthread_mutex_lock(&race->lock);
+    race->refs++;
+    pthread_mutex_unlock(&race->lock);
+}
+
+void ConnectRaceRelease(struct connect_race *race) {
+    pthread_mutex_lock(&race->lock);
+    int refs = --race->refs;
+    pthread_mutex_unlock(&race->lock);
+    if (refs > 0)
+        return;
+
+    for (int i = 0; i < race->count; i++) {
+        if (race->targets[i].fd != INVALID_SOCKET)
+            close(race->targets[i].fd);
+    }
+    close(race->wake[0]);
+    close(race->wake[1]);
+    pthread_mutex_destroy(&race->lock);
+    free(race);
+}
+
+void ConnectRaceCancel(struct connect_race *race) {
+    atomic_store(&race->cancel, 1);
+    race_wake(race);
+}
+
+void ConnectRacePreparing(struct connect_race *race) {
+    pthread_mutex_lock(&race->lock);
+    race->preparing++;
+    pthread_mutex_unlock(&race->lock);
+}
+
+void ConnectRacePrepared(struct connect_race *race, int route, int rc) {
+    pthread_mutex_lock(&race->lock);
+    race->preparing--;
+    if (route >= 0 && route < CONNECT_ROUTES_MAX)
+        race->route_rc[route] = rc;
+    pthread_mutex_unlock(&race->lock);
+    race_wake(race);
+}
+
+static int race_add(struct connect_race *race, SOCKET fd, int route) {
+    pthread_mutex_lock(&race->lock);
+    if (race->finished || race->count == CONNECT_TARGETS_MAX) {
+        pthread_mutex_unlock(&race->lock);
+        close(fd);
+        return 0;
+    }
+
+    struct connect_target *t = &race->targets[race->count++];
+    t->fd = fd;
+    t->route = route;
+    t->state = CONNECT_WAIT;
+    t->got = 0;
+    t->deadline = now_ms() + CONNECT_TIMEOUT_MS;
+    pthread_mutex_unlock(&race->lock);
+
+    race_wake(race);
+    return 1;
+}
+
+/* Starts a connect without waiting for it, the socket turns writable
+ * once it completes (check SO_ERROR) and stays non-blocking.
+ */
+SOCKET ConnectNonBlock(const char *ip, int port) {
+    struct sockaddr_in sin;
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+    if (sock == INVALID_SOCKET) {
+        errprint("socket() error %d '%s'\n", errno, strerror(errno));
+        return INVALID_SOCKET;
+    }
+
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = inet_addr(ip);
+    sin.sin_port = htons(port);
+
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, NULL) | O_NONBLOCK);
+    if (connect(sock, (struct sockaddr*)&sin, sizeof(sin)) < 0 && errno != EINPROGRESS) {
+        dbgprint("connect error=%d '%s'\n", errno, strerror(errno));
+        close(sock);
+        return INVALID_SOCKET;
+    }
+
+    return sock;
+}
+
+// Outcome of a ConnectNonBlock(): 0 once connected, else the errno value
+int ConnectError(SOCKET sock) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+        return errno;
+    return err;
+}
+
+int ConnectRaceAddIP(struct connect_race *race, const char *ip, int port, int route) {
+    dbgprint("race: connect to %s:%d\n", ip, port);
+    SOCKET sock = ConnectNonBlock(ip, port);
+    if (sock == INVALID_SOCKET)
+        return 0;
+
+    return race_add(race, sock, route);
+}
+
+int ConnectRaceAddSocket(struct connect_race *race, SOCKET fd, int route) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, NULL) | O_NONBLOCK);
+    return race_add(race, fd, route);
+}
+
+// Advance one target; returns 1 once it completed the handshake.
+static int race_step(struct connect_race *race, struct connect_target *t, short revents) {
+    int err;
+
+    if (t->state == CONNECT_WAIT && (revents & (POLLOUT | POLLERR | POLLHUP))) {
+        if ((err = ConnectError(t->fd)) != 0) {
+            dbgprint("race: route %d connect failed: %s\n", t->route, strerror(err));
+            return -1;
+        }
+        if (race->request_len == 0)
+            return 1;
+
+        if (send(t->fd, race->request, race->request_len, MSG_NOSIGNAL) != race->request_len) {
+            dbgprint("race: route %d send failed\n", t->route);
+            return -1;
+        }
+        t->state = CONNECT_REPLY;
+        t->deadline = now_ms() + HANDSHAKE_TIMEOUT_MS;
+        return 0;
+    }
+
+    if (t->state == CONNECT_REPLY && (revents & (POLLIN | POLLERR | POLLHUP))) {
+        ssize_t r = recv(t->fd, t->reply + t->got, race->reply_len - t->got, MSG_DONTWAIT);
+        if (r <= 0) {
+            if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return 0;
+            // adb forwards accept and then drop when the app isn't listening
+            dbgprint("race: route %d closed during handshake\n", t->route);
+            return -1;
+        }
+        t->got += r;
+        return (t->got == race->reply_len);
+    }
+
+    return 0;
+}
+
+SOCKET ConnectRaceRun(struct connect_race *race, int *route, char *reply) {
+    struct pollfd pfds[CONNECT_TARGETS_MAX + 1];
+    int index[CONNECT_TARGETS_MAX];
+    SOCKET winner = INVALID_SOCKET;
+
+    while (!atomic_load(&race->cancel)) {
+        int n = 0;
+        int64_t now = now_ms();
+        int64_t next = now + 100;
+
+        pthread_mutex_lock(&race->lock);
+        for (int i = 0; i < race->count; i++) {
+            struct connect_target *t = &race->targets[i];
+            if (t->state == CONNECT_FAILED)
+                continue;
+            if (now >= t->deadline) {
+                dbgprint("race: route %d timed out\n", t->route);
+                t->state = CONNECT_FAILED;
+                close(t->fd);
+                t->fd = INVALID_SOCKET;
+                continue;
+            }
+            if (t->deadline < next)
+                next = t->deadline;
+            pfds[n].fd = t->fd;
+            pfds[n].events = (t->state == CONNECT_WAIT) ? POLLOUT : POLLIN;
+            pfds[n].revents = 0;
+            index[n++] = i;
+        }
+        int preparing = race->preparing;
+        pthread_mutex_unlock(&race->lock);
+
+        if (n == 0 && preparing == 0)
+            break;
+
+        pfds[n].fd = race->wake[0];
+        pfds[n].events = POLLIN;
+        pfds[n].revents = 0;
+
+        if (poll(pfds, n + 1, (int) (next - now)) < 0) {
+            if (errno == EINTR)
+                continue;
+            errprint("poll() error %d '%s'\n", errno, strerror(errno));
+            break;
+        }
+
+        if (pfds[n].revents & POLLIN) {
+            char drain[16];
+            while (read(race->wake[0], drain, sizeof(drain)) > 0) {}
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (pfds[i].revents == 0)
+                continue;
+
+            // targets is only appended to, entries below count are stable
+            struct connect_target *t = &race->targets[index[i]];
+            int rc = race_step(race, t, pfds[i].revents);
+            if (rc < 0) {
+                t->state = CONNECT_FAILED;
+                close(t->fd);
+                t->fd = INVALID_SOCKET;
+            }
+            else if (rc > 0) {
+                winner = t->fd;
+                t->fd = INVALID_SOCKET;
+                *route = t->route;
+                if (reply)
+                    memcpy(reply, t->reply, race->reply_len);
+                goto _done;
+            }
+        }
+    }
+
+_done:
+    pthread_mutex_lock(&race->lock);
+    race->finished = 1;
+    for (int i = 0; i < race->count; i++) {
+        if (race->targets[i].fd != INVALID_SOCKET) {
+            close(race->targets[i].fd);
+            race->targets[i].fd = INVALID_SOCKET;
+        }
+    }
+    pthread_mutex_unlock(&race->lock);
+
+    if (winner != INVALID_SOCKET) {
+        dbgprint("race: route %d won, fd=%d\n", *route, winner);
+        SetBlocking(winner);
+    }
+    return winner;
+}
+
 int Send(const char * buffer, int bytes, SOCKET s) {
     ssize_t w = 0;
     char *ptr = (char*) buffer;
@@ -115,14 +460,128 @@ int RecvAll(const char* buffer, int bytes, SOCKET s) {
 
 int RecvNonBlock(char * buffer, int bytes, SOCKET s) {
     int res = recv(s, buffer, bytes, MSG_DONTWAIT);
+    if (res == 0 && bytes > 0) {
+        // orderly shutdown, don't confuse it with "no data yet"
+        errno = ECONNRESET;
+        return -1;
+    }
     return (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) ? 0 : res;
 }
 
-int RecvNonBlockUDP(char * buffer, int bytes, SOCKET s) {
-    struct sockaddr_in from;
-    socklen_t fromLen = sizeof(from);
-    int res = recvfrom(s, buffer, bytes, MSG_DONTWAIT, (struct sockaddr *)&from, &fromLen);
-    return (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) ? 0 : res;
+static int64_t now_us(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int RecvBatchUDP(struct udp_batch *batch, SOCKET s, const char *ip, int port) {
+    struct mmsghdr msgs[UDP_BATCH_MAX];
+    struct iovec iov[UDP_BATCH_MAX];
+    struct sockaddr_in from[UDP_BATCH_MAX];
+#ifdef SO_TIMESTAMPNS
+    char control[UDP_BATCH_MAX][CMSG_SPACE(sizeof(struct timespec))];
+#endif
+    in_addr_t phone_addr = inet_addr(ip);
+    uint16_t phone_port = htons((uint16_t)port);
+
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < UDP_BATCH_MAX; i++) {
+        iov[i].iov_base = batch->data[i];
+        iov[i].iov_len  = UDP_PACKET_MAX;
+        msgs[i].msg_hdr.msg_iov     = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen  = 1;
+        msgs[i].msg_hdr.msg_name    = &from[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+#ifdef SO_TIMESTAMPNS
+        msgs[i].msg_hdr.msg_control    = control[i];
+        msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+#endif
+    }
+
+    batch->count = 0;
+    batch->filtered = 0;
+    int res = recvmmsg(s, msgs, UDP_BATCH_MAX, MSG_DONTWAIT, NULL);
+    if (res < 0)
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+
+    // kernel timestamps are CLOCK_REALTIME, so use the same clock without them
+    int64_t fallback = now_us(CLOCK_REALTIME);
+    for (int i = 0; i < res; i++) {
+        if (from[i].sin_addr.s_addr != phone_addr || from[i].sin_port != phone_port) {
+            batch->filtered++;
+            continue;
+        }
+
+        int n = batch->count++;
+        if (n != i)
+            memcpy(batch->data[n], batch->data[i], msgs[i].msg_len);
+        batch->len[n] = msgs[i].msg_len;
+        batch->stamp[n] = fallback;
+
+#ifdef SO_TIMESTAMPNS
+        for (struct cmsghdr *c = CMSG_FIRSTHDR(&msgs[i].msg_hdr); c; c = CMSG_NXTHDR(&msgs[i].msg_hdr, c)) {
+            if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPNS) {
+                struct timespec ts;
+                memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+                batch->stamp[n] = (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+            }
+        }
+#endif
+    }
+
+    return batch->count;
+}
+
+void UdpStreamTrack(struct udp_stream_stats *st, int64_t arrival_us, int len, int64_t packet_us) {
+    st->packets++;
+    st->bytes += len;
+
+    if (st->packets == 1) {
+        st->anchor_us = arrival_us;
+        st->next_slot = 1;
+        st->min_delay_us = INT64_MAX;
+        return;
+    }
+
+    int64_t delay = arrival_us - (st->anchor_us + (int64_t) st->next_slot * packet_us);
+
+    // ahead of schedule: a packet we already counted lost, or the phone clock is faster
+    if (delay < -packet_us / 2) {
+        if (st->lost_pending > 0) {
+            st->lost_pending--;
+            st->lost--;
+            st->late++;
+            return;
+        }
+        st->anchor_us += delay;
+        st->last_delay_us -= delay;
+        delay = 0;
+    }
+
+    // RFC 3550 style interarrival jitter
+    int64_t d = delay - st->last_delay_us;
+    st->jitter_us += ((d < 0 ? -d : d) - st->jitter_us) / 16;
+    st->last_delay_us = delay;
+    st->next_slot++;
+
+    // queueing only ever adds delay, so the window minimum is the schedule
+    // offset. A whole packet of offset means packets went missing, anything
+    // less is clock drift.
+    if (delay < st->min_delay_us)
+        st->min_delay_us = delay;
+    if (++st->window < UDP_LOSS_WINDOW)
+        return;
+
+    int64_t offset = st->min_delay_us;
+    unsigned long missing = (offset + packet_us / 2) / packet_us;
+    if (missing > 0) {
+        st->lost += missing;
+        st->lost_pending = missing;
+    }
+    st->anchor_us += offset;
+    st->last_delay_us -= offset;
+    st->min_delay_us = INT64_MAX;
+    st->window = 0;
 }
 
 int SendUDPMessage(SOCKET s, const char *message, int length, char *ip, int port) {
@@ -134,9 +593,24 @@ int SendUDPMessage(SOCKET s, const char *message, int length, char *ip, int port
 }
 
 SOCKET CreateUdpSocket(void) {
-    return socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    SOCKET s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+#ifdef SO_TIMESTAMPNS
+    int on = 1;
+    if (s >= 0 && setsockopt(s, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0) {
+        dbgprint("SO_TIMESTAMPNS failed: %s\n", strerror(errno));
+    }
+#endif
+    if (s >= 0 && socket_latency == LATENCY_LOW)
+        set_busy_poll(s);
+    return s;
 }
 
+/* Listen mode
+ * Several phones may connect at once, the backlog holds them until
+ * they are accepted.
+ */
+#define LISTEN_BACKLOG 8
+
 static int StartInetServer(int port)
 {
     int flags = 0;
@@ -158,7 +632,7 @@ static int StartInetServer(int port)
         MSG_LASTERROR("Error: bind");
         goto _error_out;
     }
-    if(listen(wifiServerSocket, 1) < 0)
+    if(listen(wifiServerSocket, LISTEN_BACKLOG) < 0)
     {
         MSG_LASTERROR("Error: listen");
         goto _error_out;
@@ -195,34 +669,85 @@ void disconnect(SOCKET s) {
     close(s);
 }
 
-SOCKET accept_connection(int port)
-{
-    int flags;
-    SOCKET client =  INVALID_SOCKET;
-
-    dbgprint("serverSocket=%d\n", wifiServerSocket);
+SOCKET ListenSocket(int port) {
     if (wifiServerSocket == INVALID_SOCKET && !StartInetServer(port))
-        goto _error_out;
+        return INVALID_SOCKET;
 
-    errprint("waiting on port %d..", port);
-    while(v_running && (client = accept(wifiServerSocket, NULL, NULL)) == INVALID_SOCKET)
-    {
-        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR){
-            usleep(50000);
-            continue;
+    return wifiServerSocket;
+}
+
+/* Non-blocking listener only reachable from this machine: a unix socket
+ * when addr is a path, else a port on the loopback interface.
+ */
+SOCKET ListenLocal(const char *addr) {
+    struct sockaddr_un sun = { .sun_family = AF_UNIX };
+    struct sockaddr_in sin = { .sin_family = AF_INET };
+    struct sockaddr *sa;
+    socklen_t sa_len;
+    SOCKET s;
+
+    if (strchr(addr, '/')) {
+        if (strlen(addr) >= sizeof(sun.sun_path)) {
+            errprint("socket path too long: %s\n", addr);
+            return INVALID_SOCKET;
+        }
+        strcpy(sun.sun_path, addr);
+        // a socket left over from an earlier run is replaced, anything else is kept
+        struct stat st;
+        if (lstat(addr, &st) == 0) {
+            if (!S_ISSOCK(st.st_mode)) {
+                errprint("can't listen on %s: %s\n", addr, strerror(EADDRINUSE));
+                errno = EADDRINUSE;
+                return INVALID_SOCKET;
+            }
+            unlink(addr);
+        }
+        sa = (struct sockaddr*) &sun;
+        sa_len = sizeof(sun);
+    } else {
+        int port = strtol(addr, NULL, 10);
+        if (port <= 0 || port > 65535) {
+            errprint("invalid port: %s\n", addr);
+            return INVALID_SOCKET;
         }
-        MSG_LASTERROR("Accept Failed");
-        break;
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        sin.sin_port = htons(port);
+        sa = (struct sockaddr*) &sin;
+        sa_len = sizeof(sin);
     }
-    errprint("got socket %d\n", client);
 
-    if (client != INVALID_SOCKET) {
-        // Blocking..
-        flags = fcntl(wifiServerSocket, F_GETFL, NULL);
-        flags |= O_NONBLOCK;
-        fcntl(wifiServerSocket, F_SETFL, flags);
+    s = socket(sa->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (s == INVALID_SOCKET) {
+        errprint("socket() error %d '%s'\n", errno, strerror(errno));
+        return INVALID_SOCKET;
     }
 
-_error_out:
+    if (sa->sa_family == AF_INET) {
+        int one = 1;
+        setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    }
+
+    if (bind(s, sa, sa_len) < 0 || listen(s, LISTEN_BACKLOG) < 0) {
+        errprint("can't listen on %s: %s\n", addr, strerror(errno));
+        close(s);
+        return INVALID_SOCKET;
+    }
+
+    return s;
+}
+
+/* Accepts one pending phone off the (non-blocking) listen socket, the
+ * returned socket is blocking. ip gets the peer address when not NULL.
+ */
+SOCKET AcceptClient(SOCKET server, char *ip, size_t ip_len) {
+    struct sockaddr_in sin;
+    socklen_t sin_len = sizeof(sin);
+
+    SOCKET client = accept(server, (struct sockaddr*)&sin, &sin_len);
+    if (client == INVALID_SOCKET)
+        return INVALID_SOCKET;
+
+    if (ip)
+        inet_ntop(AF_INET, &sin.sin_addr, ip, ip_len);
     return client;
 }
@@ -9,21 +9,116 @@
 #ifndef __CONN_H__
 #define __CONN_H__
 
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
 #define INVALID_SOCKET -1
 typedef int SOCKET;
 typedef long int SOCKET_PTR;
 
+#define UDP_BATCH_MAX  16
+#define UDP_PACKET_MAX 512
+
+struct udp_batch {
+    int count;
+    int filtered; // datagrams not coming from the phone
+    int len[UDP_BATCH_MAX];
+    int64_t stamp[UDP_BATCH_MAX]; // arrival time, us
+    char data[UDP_BATCH_MAX][UDP_PACKET_MAX];
+};
+
+/* The audio datagrams carry no sequence numbers, so sequence is tracked
+ * against the packet schedule (one packet every packet_us): when the
+ * smallest delay over a window of packets is a whole packet or more, the
+ * missing slots count as lost, and a packet showing up for a slot already
+ * counted lost counts as late.
+ */
+#define UDP_LOSS_WINDOW 8
+
+struct udp_stream_stats {
+    unsigned long packets;
+    unsigned long bytes;
+    unsigned long lost;
+    unsigned long late;
+    unsigned long filtered;
+    unsigned long batches;
+    int jitter_us;
+
+    int64_t anchor_us;
+    int64_t last_delay_us;
+    int64_t min_delay_us;
+    unsigned long next_slot;
+    unsigned long lost_pending;
+    int window;
+};
+
+/* Race-to-first connection: every candidate route connects in parallel and
+ * the first one to complete the handshake (request sent, reply_len bytes
+ * back) wins. Routes that need slow preparation (adb forward, usbmuxd) are
+ * added from their own threads while the race runs, so the race is shared
+ * and reference counted; the last ConnectRaceRelease() frees it.
+ */
+#define CONNECT_TARGETS_MAX 4
+#define CONNECT_REPLY_MAX   16
+#define CONNECT_TIMEOUT_MS  2000
+#define HANDSHAKE_TIMEOUT_MS 5000
+#define CONNECT_ROUTES_MAX  4
+
+struct connect_target {
+    SOCKET fd;
+    int route;
+    int state;
+    int got;
+    int64_t deadline;
+    char reply[CONNECT_REPLY_MAX];
+};
+
+struct connect_race {
+    pthread_mutex_t lock;
+    int refs;
+    int wake[2];
+    atomic_int cancel;
+    int finished;
+    int preparing;
+    int route_rc[CONNECT_ROUTES_MAX]; // preparation result per route
+    const char *request;
+    int request_len;
+    int reply_len;
+    int count;
+    struct connect_target targets[CONNECT_TARGETS_MAX];
+};
+
+struct connect_race *ConnectRaceNew(void);
+void ConnectRaceRetain(struct connect_race *race);
+void ConnectRaceRelease(struct connect_race *race);
+void ConnectRaceCancel(struct connect_race *race);
+void ConnectRacePreparing(struct connect_race *race);
+void ConnectRacePrepared(struct connect_race *race, int route, int rc);
+int ConnectRaceAddIP(struct connect_race *race, const char *ip, int port, int route);
+int ConnectRaceAddSocket(struct connect_race *race, SOCKET fd, int route);
+SOCKET ConnectRaceRun(struct connect_race *race, int *route, char *reply);
+
 SOCKET Connect(const char* ip, int port, char **errormsg);
+SOCKET ConnectNonBlock(const char *ip, int port);
+int ConnectError(SOCKET s);
 void connection_cleanup();
 void disconnect(SOCKET s);
 
-SOCKET accept_connection(int port);
+SOCKET ListenSocket(int port);
+SOCKET AcceptClient(SOCKET server, char *ip, size_t ip_len);
+SOCKET ListenLocal(const char *addr);
 SOCKET CreateUdpSocket(void);
+void SetRecvTimeout(SOCKET s, int ms);
+void SetSocketLatencyProfile(int profile);
+void TuneStreamSocket(SOCKET s);
+void RearmQuickAck(SOCKET s);
 int Send(const char * buffer, int bytes, SOCKET s);
 int Recv(const char * buffer, int bytes, SOCKET s);
 int RecvAll(const char * buffer, int bytes, SOCKET s);
 int RecvNonBlock(char * buffer, int bytes, SOCKET s);
-int RecvNonBlockUDP(char * buffer, int bytes, SOCKET s);
+int RecvBatchUDP(struct udp_batch *batch, SOCKET s, const char *ip, int port);
+void UdpStreamTrack(struct udp_stream_stats *st, int64_t arrival_us, int len, int64_t packet_us);
 int SendUDPMessage(SOCKET s, const char *message, int length, char *ip, int port);
 
 #endif
@@ -26,6 +26,8 @@
 #include "common.h"
 #include "decoder.h"
 #include "queue.h"
+#include "latency.h"
+#include "ring.h"
 
 #include "turbojpeg.h"
 #include "speex/speex.h"
@@ -38,28 +40,65 @@ extern "C"
 }
 #endif
 
+/* The phone's capture clock and the loopback device clock drift apart.
+ * The staging + device fill level is tracked and a small linear resampler
+ * stretches or squeezes the decoded audio to keep it at the target level.
+ */
+#define DRIFT_MAX_PPM      5000.0
+#define DRIFT_KP_PPM       3.0     /* ppm per frame of fill error */
+#define DRIFT_KI_PPM       0.005   /* ppm per frame of accumulated error */
+#define DRIFT_FILL_SMOOTH  64.0    /* fill average, in updates (~1.3s) */
+#define DRIFT_CARRY_MAX    64      /* input held over when the output fills up */
+
+struct audio_drift_s {
+ double ratio;      /* output/input sample rate */
+ double phase;      /* fractional input position, carried between packets */
+ short  last;       /* last input sample of the previous packet */
+ int    carry;      /* input samples left over, at the start of pcm_buf */
+ double fill_avg;
+ double integral;
+ long   target;
+ long   base_target;
+};
+
 struct spx_decoder_s {
  snd_pcm_t *snd_handle;
  void *state;
  SpeexBits bits;
- int audioBoostPerc;
  int frame_size;
+ short pcm_buf[DRIFT_CARRY_MAX + DECODE_BUF_SIZE];
+ short out_buf[DECODE_BUF_SIZE];
+ short plc_buf[DECODE_BUF_SIZE];
+ int plc_used;
+ pcm_ring staging;      /* decoded audio waiting for the device */
+ struct audio_drift_s drift;
+ struct audio_gain_s gain;
 };
 
 struct jpg_dec_ctx_s {
  int invert;
- int subsamp;
+ int subsamp;           // stream's jpeg subsampling, -1 until checked
+ int dec_subsamp;       // what the decode planes are set up for
+ int has_frame;         // m_decodeBuf holds a decoded frame
  int m_width, m_height; // stream WxH
  int d_width, d_height; // decoded WxH (can be inverted)
  int m_Yuv420Size, m_ySize, m_uvSize;
  int m_webcamYuvSize, m_webcam_ySize, m_webcam_uvSize;;
  size_t m_BufferLimit;
+ size_t in_cap, decode_cap; // allocated sizes, buffers only grow
 
  BYTE *m_inBuf;         /* incoming stream */
  BYTE *m_decodeBuf;     /* decoded individual frames */
  BYTE *m_webcamBuf;     /* optional, scale incoming stream for the webcam */
+ BYTE *m_chromaBuf;     /* native chroma planes, for streams that aren't 4:2:0 */
+ size_t chroma_cap;
 
  struct SwsContext *swc;
+ struct {               /* the previous geometry's set, see decoder_switch_geometry */
+   BYTE *decodeBuf;
+   size_t decode_cap;
+   struct SwsContext *swc;
+ } spare;
  tjhandle tj;
  tjhandle tjXform;
  tjtransform transform;
@@ -86,9 +125,25 @@ struct spx_decoder_s  spx_decoder;
 static unsigned int WEBCAM_W, WEBCAM_H;
 
 static int droidcam_device_fd;
+static pthread_mutex_t video_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Held by the decode thread from pulling a frame to handing it back, and
+ * by anything that frees or moves the receive slots: with it held, every
+ * frame the video receiver isn't holding is in a queue. Taken before
+ * video_lock.
+ */
+static pthread_mutex_t frame_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// bumped for every frame queued for decoding, the decode thread sleeps on it
+static pthread_mutex_t ready_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t frame_ready = PTHREAD_COND_INITIALIZER;
+static unsigned frame_seq;
 static snd_output_t *output = NULL;
 
 static void decoder_share_frame();
+static void process_frame(JPGFrame *frame);
+static void decoder_release_video(void);
+static int decoder_setup_geometry(void);
 
 #define FREE_OBJECT(obj, free_func) if(obj){dbgprint(" " #obj " %p\n", obj); free_func(obj); obj=NULL;}
 
@@ -100,11 +155,8 @@ int decoder_init(const char* v4l2_device, unsigned v4l2_width, unsigned v4l2_hei
         set_v4l2_device(v4l2_device);
         droidcam_device_fd = open_v4l2_device();
     } else {
-        droidcam_device_fd = find_v4l2_device(V4L2_PLATFORM_DC);
-        if (droidcam_device_fd < 0) {
-            // check for generic v4l2loopback device
-            droidcam_device_fd = find_v4l2_device(V4L2_PLATFORM);
-        }
+        // droidcam device first, else a generic v4l2loopback one, in one pass
+        droidcam_device_fd = find_v4l2_device();
     }
 
     if (droidcam_device_fd < 0) {
@@ -141,17 +193,18 @@ int decoder_init(const char* v4l2_device, unsigned v4l2_width, unsigned v4l2_hei
 
     dbgprint("init audio\n");
     memset(&spx_decoder, 0, sizeof(struct spx_decoder_s));
-    spx_decoder.snd_handle = find_snd_device();
-    if (!spx_decoder.snd_handle) {
-        errprint("Audio loopback device not found.\n"
-                "Is snd_aloop loaded?\n");
-    }
+    // the device is opened with the first audio session
+    snd_guess_device();
 
-    spx_decoder.audioBoostPerc = 100;
+    audio_gain_init(&spx_decoder.gain, 100, 0);
+    if (pcm_ring_init(&spx_decoder.staging, DECODE_BUF_SIZE) < 0) {
+        return 0;
+    }
     speex_bits_init(&spx_decoder.bits);
     spx_decoder.state = speex_decoder_init(speex_lib_get_mode(SPEEX_MODEID_WB));
     speex_decoder_ctl(spx_decoder.state, SPEEX_GET_FRAME_SIZE, &spx_decoder.frame_size);
     dbgprint("spx_decoder.state=%p, frame_size=%d\n", spx_decoder.state, spx_decoder.frame_size);
+    spx_decoder.plc_used = spx_decoder.frame_size;
 
     queue_init(&decode_queue);
     queue_init(&receive_queue);
@@ -162,11 +215,14 @@ int decoder_init(const char* v4l2_device, unsigned v4l2_width, unsigned v4l2_hei
 void decoder_fini() {
     if (droidcam_device_fd) close(droidcam_device_fd);
     droidcam_device_fd = 0;
-    decoder_cleanup();
+    pthread_mutex_lock(&video_lock);
+    decoder_release_video();
+    pthread_mutex_unlock(&video_lock);
 
     queue_destroy(&decode_queue);
     queue_destroy(&receive_queue);
     FREE_OBJECT(spx_decoder.snd_handle, snd_pcm_close);
+    pcm_ring_destroy(&spx_decoder.staging);
     dbgprint("spx_decoder.state=%p\n", spx_decoder.state);
     if (spx_decoder.state != NULL) {
         speex_bits_destroy(&spx_decoder.bits);
@@ -175,32 +231,92 @@ void decoder_fini() {
     }
 }
 
+static void decoder_release_video(void) {
+    FREE_OBJECT(jpg_decoder.m_inBuf, free);
+    FREE_OBJECT(jpg_decoder.m_decodeBuf, free);
+    FREE_OBJECT(jpg_decoder.m_webcamBuf, free);
+    FREE_OBJECT(jpg_decoder.m_chromaBuf, free);
+    jpg_decoder.chroma_cap = 0;
+    FREE_OBJECT(jpg_decoder.swc, sws_freeContext);
+    FREE_OBJECT(jpg_decoder.spare.decodeBuf, free);
+    FREE_OBJECT(jpg_decoder.spare.swc, sws_freeContext);
+    jpg_decoder.spare.decode_cap = 0;
+    FREE_OBJECT(jpg_decoder.tjXform, tjDestroy);
+    FREE_OBJECT(jpg_decoder.tj, tjDestroy);
+    jpg_decoder.in_cap = 0;
+    jpg_decoder.decode_cap = 0;
+    jpg_decoder.has_frame = 0;
+    queue_clear(&receive_queue);
+    queue_clear(&decode_queue);
+}
+
+static int decoder_alloc_video(void);
+static int decoder_reclaim_frames(void);
+
 int decoder_prepare_video(char * header) {
-    jpg_decoder.m_width = be16toh(*(uint16_t*) &header[0]);
-    jpg_decoder.m_height = be16toh(*(uint16_t*) &header[2]);
+    int width = be16toh(*(uint16_t*) &header[0]);
+    int height = be16toh(*(uint16_t*) &header[2]);
+    int rc;
 
     if (droidcam_device_fd <= 0) {
         MSG_ERROR("Missing video device");
         return 0;
     }
 
-    if (jpg_decoder.m_width <= 0 || jpg_decoder.m_height <= 0) {
+    if (width <= 0 || height <= 0) {
         MSG_ERROR("Invalid data stream!");
         return 0;
     }
 
-    jpg_decoder.tj = tjInitDecompress();
-    if (!jpg_decoder.tj) {
-        MSG_ERROR("Error creating decoder!");
-        return 0;
+    // the decode thread can't be holding a frame while buffers are replaced
+    pthread_mutex_lock(&frame_lock);
+    pthread_mutex_lock(&video_lock);
+    if (jpg_decoder.tj && width == jpg_decoder.m_width && height == jpg_decoder.m_height) {
+        // reconnected to the same stream, keep the decoder and frame buffers
+        dbgprint("Stream W=%d H=%d, reusing decoder\n", width, height);
+        jpg_decoder.subsamp = -1;
+        rc = (jpg_decoder.dec_subsamp == TJSAMP_420) || decoder_setup_geometry();
+        goto out;
     }
 
-    jpg_decoder.tjXform = tjInitTransform();
-    if (!jpg_decoder.tjXform) {
-        MSG_ERROR("Error creating transform!");
-        return 0;
+    // the stream changed across a reconnect
+    if (jpg_decoder.tj && !decoder_reclaim_frames()) {
+        rc = 0;
+        goto out;
     }
 
+    jpg_decoder.has_frame = 0;
+    queue_clear(&receive_queue);
+    queue_clear(&decode_queue);
+    jpg_decoder.subsamp = -1;
+    jpg_decoder.m_width = width;
+    jpg_decoder.m_height = height;
+    rc = decoder_alloc_video();
+    if (!rc)
+        decoder_release_video();
+
+out:
+    pthread_mutex_unlock(&video_lock);
+    pthread_mutex_unlock(&frame_lock);
+    return rc;
+}
+
+// Grow-only buffer, contents are not kept
+static BYTE *decoder_buffer(BYTE *buf, size_t *cap, size_t size) {
+    if (buf && *cap >= size)
+        return buf;
+
+    free(buf);
+    buf = (BYTE*)malloc(size);
+    *cap = buf ? size : 0;
+    return buf;
+}
+
+/* Geometry dependent state (sizes, decode buffer, scaler and the plane
+ * pointers into them) for the stream in m_width/m_height. Buffers and
+ * the scaler are kept from earlier streams when they fit.
+ */
+static int decoder_setup_geometry(void) {
     if (jpg_decoder.invert) {
         jpg_decoder.d_width = jpg_decoder.m_height;
         jpg_decoder.d_height = jpg_decoder.m_width;
@@ -212,16 +328,24 @@ int decoder_prepare_video(char * header) {
     }
 
     dbgprint("Stream W=%d H=%d\n", jpg_decoder.m_width, jpg_decoder.m_height);
-    jpg_decoder.subsamp       = 0;
+    jpg_decoder.dec_subsamp   = TJSAMP_420;
     jpg_decoder.m_ySize       = jpg_decoder.m_width * jpg_decoder.m_height;
     jpg_decoder.m_uvSize      = jpg_decoder.m_ySize / 4;
     jpg_decoder.m_Yuv420Size  = jpg_decoder.m_ySize * 3 / 2;
-    jpg_decoder.m_inBuf       = (BYTE*)malloc((jpg_decoder.m_Yuv420Size * JPG_BACKBUF_MAX + 4096) * sizeof(BYTE));
-    jpg_decoder.m_decodeBuf   = (BYTE*)malloc(jpg_decoder.m_Yuv420Size * sizeof(BYTE));
+    jpg_decoder.m_decodeBuf   = decoder_buffer(jpg_decoder.m_decodeBuf, &jpg_decoder.decode_cap,
+                                    jpg_decoder.m_Yuv420Size * sizeof(BYTE));
+    if (!jpg_decoder.m_decodeBuf) {
+        MSG_ERROR("Out of memory");
+        return 0;
+    }
 
     if (jpg_decoder.m_webcamYuvSize != jpg_decoder.m_Yuv420Size) {
-        jpg_decoder.m_webcamBuf = (BYTE*)malloc(jpg_decoder.m_webcamYuvSize * sizeof(BYTE));
-        jpg_decoder.swc = sws_getCachedContext(NULL,
+        // the webcam size is fixed, so is this buffer
+        if (!jpg_decoder.m_webcamBuf)
+            jpg_decoder.m_webcamBuf = (BYTE*)malloc(jpg_decoder.m_webcamYuvSize * sizeof(BYTE));
+
+        // hands back the same context when the geometry didn't change
+        jpg_decoder.swc = sws_getCachedContext(jpg_decoder.swc,
                 jpg_decoder.d_width, jpg_decoder.d_height, AV_PIX_FMT_YUV420P, /* src */
                 WEBCAM_W, WEBCAM_H , AV_PIX_FMT_YUV420P, /* dst */
                 SWS_FAST_BILINEAR /* flags */, NULL, NULL, NULL);
@@ -248,18 +372,13 @@ int decoder_prepare_video(char * header) {
         jpg_decoder.swcDstSlice[1] = jpg_decoder.swcDstSlice[0] + jpg_decoder.m_webcam_ySize;
         jpg_decoder.swcDstSlice[2] = jpg_decoder.swcDstSlice[1] + jpg_decoder.m_webcam_uvSize;
         jpg_decoder.swcDstSlice[3] = NULL;
+    } else {
+        // the stream already matches the webcam, a scaler left from before would be used
+        FREE_OBJECT(jpg_decoder.swc, sws_freeContext);
     }
 
     dbgprint("jpg: webcambuf: %p\n", jpg_decoder.m_webcamBuf);
     dbgprint("jpg: decodebuf: %p\n", jpg_decoder.m_decodeBuf);
-    dbgprint("jpg: inbuf    : %p\n", jpg_decoder.m_inBuf);
-
-    for (int i = 0; i < JPG_BACKBUF_MAX; i++) {
-        jpg_frames[i].data = &jpg_decoder.m_inBuf[i*jpg_decoder.m_Yuv420Size];
-        jpg_frames[i].length = 0;
-        dbgprint("jpg: jpg_frames[%d]: %p\n", i, jpg_frames[i].data);
-        queue_add(&receive_queue, &jpg_frames[i]);
-    }
 
     int stride = jpg_decoder.d_width;
     jpg_decoder.tjDstStride[0] = stride;
@@ -271,60 +390,375 @@ int decoder_prepare_video(char * header) {
     jpg_decoder.tjDstSlice[1] = jpg_decoder.tjDstSlice[0] + jpg_decoder.m_ySize;
     jpg_decoder.tjDstSlice[2] = jpg_decoder.tjDstSlice[1] + jpg_decoder.m_uvSize;
     jpg_decoder.tjDstSlice[3] = NULL;
+    return 1;
+}
+
+// Carves the receive slots out of m_inBuf, the queues must be empty
+static int decoder_alloc_frames(size_t slot_size) {
+    jpg_decoder.m_inBuf = decoder_buffer(jpg_decoder.m_inBuf, &jpg_decoder.in_cap,
+                            (slot_size * JPG_BACKBUF_MAX + 4096) * sizeof(BYTE));
+    if (!jpg_decoder.m_inBuf) {
+        MSG_ERROR("Out of memory");
+        return 0;
+    }
 
+    dbgprint("jpg: inbuf    : %p\n", jpg_decoder.m_inBuf);
+    for (int i = 0; i < JPG_BACKBUF_MAX; i++) {
+        jpg_frames[i].data = &jpg_decoder.m_inBuf[i*slot_size];
+        jpg_frames[i].length = 0;
+        jpg_frames[i].size = slot_size;
+        dbgprint("jpg: jpg_frames[%d]: %p\n", i, jpg_frames[i].data);
+        queue_add(&receive_queue, &jpg_frames[i]);
+    }
     return 1;
 }
 
+/* Sets up the decoder for the stream in m_width/m_height.
+ * Handles, the scaler and buffers are kept from earlier streams when
+ * they fit, and only freed by decoder_fini().
+ */
+static int decoder_alloc_video(void) {
+    if (!jpg_decoder.tj)
+        jpg_decoder.tj = tjInitDecompress();
+    if (!jpg_decoder.tj) {
+        MSG_ERROR("Error creating decoder!");
+        return 0;
+    }
+
+    if (!jpg_decoder.tjXform)
+        jpg_decoder.tjXform = tjInitTransform();
+    if (!jpg_decoder.tjXform) {
+        MSG_ERROR("Error creating transform!");
+        return 0;
+    }
+
+    return decoder_setup_geometry() && decoder_alloc_frames(jpg_decoder.m_Yuv420Size);
+}
+
+/* The phone changed resolution (or orientation) mid-stream. The current
+ * decode buffer and scaler are swapped with the spare set, which may
+ * still fit from the last switch, then set up for the new geometry.
+ * Called from the decode thread, between frames.
+ */
+static int decoder_switch_geometry(int width, int height) {
+    BYTE *buf;
+    size_t cap;
+    struct SwsContext *swc;
+    int rc;
+
+    dbgprint("stream changed %dx%d -> %dx%d\n",
+        jpg_decoder.m_width, jpg_decoder.m_height, width, height);
+
+    pthread_mutex_lock(&video_lock);
+    buf = jpg_decoder.m_decodeBuf;
+    cap = jpg_decoder.decode_cap;
+    swc = jpg_decoder.swc;
+    jpg_decoder.m_decodeBuf = jpg_decoder.spare.decodeBuf;
+    jpg_decoder.decode_cap = jpg_decoder.spare.decode_cap;
+    jpg_decoder.swc = jpg_decoder.spare.swc;
+    jpg_decoder.spare.decodeBuf = buf;
+    jpg_decoder.spare.decode_cap = cap;
+    jpg_decoder.spare.swc = swc;
+
+    jpg_decoder.has_frame = 0;
+    jpg_decoder.subsamp = -1;
+    jpg_decoder.m_width = width;
+    jpg_decoder.m_height = height;
+    rc = decoder_setup_geometry();
+    pthread_mutex_unlock(&video_lock);
+    return rc;
+}
+
+/* Subsampling of the decoded planes. Transforms that transpose the
+ * image (the portrait webcam rotation) swap 4:2:2 and 4:4:0.
+ */
+static int decoded_subsamp(int subsamp) {
+    switch (jpg_decoder.transform.op) {
+    case TJXOP_TRANSPOSE:
+    case TJXOP_TRANSVERSE:
+    case TJXOP_ROT90:
+    case TJXOP_ROT270:
+        if (subsamp == TJSAMP_422) return TJSAMP_440;
+        if (subsamp == TJSAMP_440) return TJSAMP_422;
+    }
+    return subsamp;
+}
+
+/* Decode planes for streams that aren't 4:2:0. The chroma is decoded in
+ * its native layout into m_chromaBuf, the scaler then reads it directly
+ * so downsampling and scaling happen in one pass. Without a scaler
+ * process_frame() downsamples it into m_decodeBuf. Gray streams decode
+ * luma only, over neutral chroma.
+ */
+static int decoder_setup_subsamp(int subsamp) {
+    static const enum AVPixelFormat pix_fmt[] = {
+        [TJSAMP_444] = AV_PIX_FMT_YUV444P,
+        [TJSAMP_422] = AV_PIX_FMT_YUV422P,
+        [TJSAMP_440] = AV_PIX_FMT_YUV440P,
+    };
+    int rc = 1;
+
+    dbgprint("jpg: decoding subsamp %d\n", subsamp);
+    pthread_mutex_lock(&video_lock);
+    jpg_decoder.has_frame = 0;
+
+    // plain 4:2:0, and gray over the 4:2:0 planes
+    if (!decoder_setup_geometry()) {
+        rc = 0;
+        goto out;
+    }
+
+    if (subsamp == TJSAMP_GRAY) {
+        memset(jpg_decoder.m_decodeBuf + jpg_decoder.m_ySize, 128, jpg_decoder.m_uvSize * 2);
+        jpg_decoder.tjDstSlice[1] = NULL;
+        jpg_decoder.tjDstSlice[2] = NULL;
+        jpg_decoder.dec_subsamp = subsamp;
+        goto out;
+    }
+    if (subsamp == TJSAMP_420)
+        goto out;
+
+    int cw = tjPlaneWidth(1, jpg_decoder.d_width, subsamp);
+    int ch = tjPlaneHeight(1, jpg_decoder.d_height, subsamp);
+    jpg_decoder.m_chromaBuf = decoder_buffer(jpg_decoder.m_chromaBuf, &jpg_decoder.chroma_cap,
+                                cw * ch * 2 * sizeof(BYTE));
+    if (!jpg_decoder.m_chromaBuf) {
+        MSG_ERROR("Out of memory");
+        rc = 0;
+        goto out;
+    }
+
+    jpg_decoder.tjDstStride[1] = cw;
+    jpg_decoder.tjDstStride[2] = cw;
+    jpg_decoder.tjDstSlice[1] = jpg_decoder.m_chromaBuf;
+    jpg_decoder.tjDstSlice[2] = jpg_decoder.m_chromaBuf + cw * ch;
+
+    if (jpg_decoder.swc) {
+        jpg_decoder.swc = sws_getCachedContext(jpg_decoder.swc,
+                jpg_decoder.d_width, jpg_decoder.d_height, pix_fmt[subsamp], /* src */
+                WEBCAM_W, WEBCAM_H , AV_PIX_FMT_YUV420P, /* dst */
+                SWS_FAST_BILINEAR /* flags */, NULL, NULL, NULL);
+
+        jpg_decoder.swcSrcStride[1] = cw;
+        jpg_decoder.swcSrcStride[2] = cw;
+        jpg_decoder.swcSrcSlice[1] = jpg_decoder.tjDstSlice[1];
+        jpg_decoder.swcSrcSlice[2] = jpg_decoder.tjDstSlice[2];
+    }
+    jpg_decoder.dec_subsamp = subsamp;
+
+out:
+    pthread_mutex_unlock(&video_lock);
+    return rc;
+}
+
+// m_chromaBuf -> the 4:2:0 planes of m_decodeBuf
+static void decoder_downsample_chroma(void) {
+    int subsamp = jpg_decoder.dec_subsamp;
+    int xs = (subsamp == TJSAMP_444 || subsamp == TJSAMP_440) ? 2 : 1;
+    int ys = (subsamp == TJSAMP_444 || subsamp == TJSAMP_422) ? 2 : 1;
+    int w = jpg_decoder.d_width >> 1;
+    int h = jpg_decoder.d_height >> 1;
+    BYTE *u = jpg_decoder.m_decodeBuf + jpg_decoder.m_ySize;
+
+    yuv_chroma_to_420(jpg_decoder.tjDstSlice[1], jpg_decoder.tjDstStride[1], u, w, h, xs, ys);
+    yuv_chroma_to_420(jpg_decoder.tjDstSlice[2], jpg_decoder.tjDstStride[2], u + jpg_decoder.m_uvSize, w, h, xs, ys);
+}
+
+/* Moves the frames waiting to be decoded back to the receive queue, with
+ * frame_lock held. Returns 0 if a frame is still out, the slots can't
+ * be freed then.
+ */
+static int decoder_reclaim_frames(void) {
+    JPGFrame *f;
+    while ((f = (JPGFrame*) queue_next(&decode_queue, 0)) != NULL)
+        queue_add(&receive_queue, f);
+
+    if (receive_queue.size != JPG_BACKBUF_MAX) {
+        errprint("error: %zu video frames still in use\n", JPG_BACKBUF_MAX - receive_queue.size);
+        return 0;
+    }
+    return 1;
+}
+
+/* A frame bigger than the receive slots is on the way, called from the
+ * video receiver with every frame handed back.
+ */
+int decoder_grow_frames(unsigned length) {
+    int rc = 0;
+
+    pthread_mutex_lock(&frame_lock);
+    pthread_mutex_lock(&video_lock);
+    if (decoder_reclaim_frames()) {
+        queue_clear(&receive_queue);
+        // some headroom, so a growing stream doesn't do this every frame
+        rc = decoder_alloc_frames(length + length / 2);
+        dbgprint("receive slots grown to %u bytes\n", length + length / 2);
+    }
+    pthread_mutex_unlock(&video_lock);
+    pthread_mutex_unlock(&frame_lock);
+    return rc;
+}
+
 snd_pcm_t * decoder_prepare_audio(void) {
+    snd_pcm_uframes_t period, buffer;
     speex_bits_reset(&spx_decoder.bits);
-    dbgprint("audio boost %d%%\n", spx_decoder.audioBoostPerc);
+    dbgprint("audio gain %d/%d agc=%d\n", spx_decoder.gain.manual, GAIN_UNITY, spx_decoder.gain.agc);
+    spx_decoder.gain.agc_gain = GAIN_UNITY;
+    spx_decoder.gain.peak_env = 0;
+
+    if (!spx_decoder.snd_handle) {
+        spx_decoder.snd_handle = find_snd_device();
+        if (!spx_decoder.snd_handle) {
+            errprint("Audio loopback device not found.\n"
+                    "Is snd_aloop loaded?\n");
+        }
+    }
+
+    pcm_ring_drop(&spx_decoder.staging, pcm_ring_used(&spx_decoder.staging));
+    memset(&spx_decoder.drift, 0, sizeof(struct audio_drift_s));
+    spx_decoder.drift.ratio = 1.0;
+    if (spx_decoder.snd_handle) {
+        // what's left in the device at a period boundary, plus half a packet staged
+        snd_get_geometry(&period, &buffer);
+        spx_decoder.drift.target = (buffer - period) + (CHUNKS_PER_PACKET * DROIDCAM_PCM_CHUNK_SAMPLES_2 / 2);
+        spx_decoder.drift.base_target = spx_decoder.drift.target;
+        spx_decoder.drift.fill_avg = spx_decoder.drift.target;
+        dbgprint("audio drift target %ld frames\n", spx_decoder.drift.target);
+    }
     return spx_decoder.snd_handle;
 }
 
+/* End of a stream. The decoder stays set up for the next phone, only
+ * the frames still queued from this one are dropped.
+ */
 void decoder_cleanup() {
+    JPGFrame *f;
     dbgprint("Cleanup\n");
-    FREE_OBJECT(jpg_decoder.m_inBuf, free);
-    FREE_OBJECT(jpg_decoder.m_decodeBuf, free);
-    FREE_OBJECT(jpg_decoder.m_webcamBuf, free);
-    FREE_OBJECT(jpg_decoder.swc, sws_freeContext);
-    FREE_OBJECT(jpg_decoder.tjXform, tjDestroy);
-    FREE_OBJECT(jpg_decoder.tj, tjDestroy);
-    queue_clear(&receive_queue);
-    queue_clear(&decode_queue);
+    pthread_mutex_lock(&video_lock);
+    jpg_decoder.has_frame = 0;
+    jpg_decoder.subsamp = -1;
+    while ((f = (JPGFrame*) queue_next(&decode_queue, 0)) != NULL)
+        queue_add(&receive_queue, f);
+    pthread_mutex_unlock(&video_lock);
+}
+
+void *decoder_get_frame_pool(size_t *len) {
+    *len = jpg_decoder.in_cap;
+    return jpg_decoder.m_inBuf;
+}
+
+/* Repeat the last frame, so consumers don't see the camera
+ * stall while the stream is interrupted.
+ */
+void decoder_hold_frame(void) {
+    pthread_mutex_lock(&video_lock);
+    if (jpg_decoder.has_frame)
+        decoder_share_frame();
+    pthread_mutex_unlock(&video_lock);
+}
+
+/* Frame size from the JPEG SOFn marker, a few bytes into the frame,
+ * so every frame can be checked without decoding its header.
+ */
+static int jpeg_frame_size(const BYTE *p, unsigned long len, int *width, int *height) {
+    unsigned long i = 2;
+
+    if (len < 4 || p[0] != 0xFF || p[1] != 0xD8)
+        return -1;
+
+    while (i + 4 <= len) {
+        if (p[i] != 0xFF)
+            return -1;
+
+        BYTE marker = p[i+1];
+        if (marker == 0xFF) { // fill byte
+            i++;
+            continue;
+        }
+
+        // SOF0..SOF15, minus DHT, JPG and DAC which share the range
+        if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+            if (i + 9 > len)
+                return -1;
+            *height = (p[i+5] << 8) | p[i+6];
+            *width  = (p[i+7] << 8) | p[i+8];
+            return 0;
+        }
+
+        if (marker == 0xDA) // scan data without a frame header
+            return -1;
+
+        i += 2 + ((p[i+2] << 8) | p[i+3]);
+    }
+
+    return -1;
 }
 
-void process_frame(JPGFrame *frame) {
+static void process_frame(JPGFrame *frame) {
     unsigned long len = (unsigned long)frame->length;
     BYTE *p = frame->data;
+    int width, height;
+    int64_t t0, t1;
+
+    t0 = lat_now();
+    lat_record(LAT_QUEUE, t0 - frame->t_queued);
+
+    if (jpeg_frame_size(p, len, &width, &height) < 0) {
+        errprint("error: no frame header in video image\n");
+        lat_drop(LAT_DROP_DECODE);
+        return;
+    }
 
-    if (jpg_decoder.subsamp == 0) {
-        int width, height, subsamp, colorspace;
+    if (width != jpg_decoder.m_width || height != jpg_decoder.m_height) {
+        if (width < 2 || height < 2 || width > 9999 || height > 9999 || (width | height) & 1) {
+            errprint("error: unexpected video image dimentions: %dx%d\n", width, height);
+            lat_drop(LAT_DROP_DECODE);
+            return;
+        }
+        if (!decoder_switch_geometry(width, height))
+            return;
+    }
+
+    if (jpg_decoder.subsamp < 0) {
+        int subsamp, colorspace;
         if (tjDecompressHeader3(jpg_decoder.tj, p, len, &width, &height, &subsamp, &colorspace) < 0) {
             errprint("tjDecompressHeader3() failure: %d\n", tjGetErrorCode(jpg_decoder.tj));
             errprint("%s\n", tjGetErrorStr2(jpg_decoder.tj));
+            lat_drop(LAT_DROP_DECODE);
             return;
         }
 
         dbgprint("stream is %dx%d subsamp %d colorspace %d\n", width, height, subsamp, colorspace);
-        if (subsamp != TJSAMP_420) {
-            errprint("error: unexpected video image stream subsampling: %d\n", subsamp);
+        if (colorspace != TJCS_YCbCr && colorspace != TJCS_GRAY) {
+            errprint("error: unexpected video image stream colorspace: %d\n", colorspace);
+            lat_drop(LAT_DROP_DECODE);
             return;
         }
-
-        if (width != jpg_decoder.m_width || height != jpg_decoder.m_height) {
-            errprint("error: unexpected video image dimentions: %dx%d vs expected %dx%x\n",
-                width, height, jpg_decoder.m_width, jpg_decoder.m_height);
+        if (subsamp != TJSAMP_420 && subsamp != TJSAMP_422 && subsamp != TJSAMP_440
+            && subsamp != TJSAMP_444 && subsamp != TJSAMP_GRAY) {
+            errprint("error: unexpected video image stream subsampling: %d\n", subsamp);
+            lat_drop(LAT_DROP_DECODE);
             return;
         }
 
         jpg_decoder.subsamp = subsamp;
     }
 
+    // the transform can change with the flip controls
+    int subsamp = decoded_subsamp(jpg_decoder.subsamp);
+    if (subsamp != jpg_decoder.dec_subsamp && !decoder_setup_subsamp(subsamp))
+        return;
+
+    t0 = lat_now();
     if (jpg_decoder.transform.op) {
         if (tjTransform(jpg_decoder.tjXform, p, len, 1, &p, &len, &jpg_decoder.transform, 0)) {
             errprint("tjTransform failure: %s\n", tjGetErrorStr());
+            lat_drop(LAT_DROP_DECODE);
             return;
         }
+        t1 = lat_now();
+        lat_record(LAT_TRANSFORM, t1 - t0);
+        t0 = t1;
     }
 
     if (tjDecompressToYUVPlanes(jpg_decoder.tj, p, len,
@@ -333,15 +767,26 @@ void process_frame(JPGFrame *frame) {
             TJFLAG_FASTDCT | TJFLAG_FASTUPSAMPLE))
     {
         errprint("tjDecompressToYUV2 failure: %d\n", tjGetErrorCode(jpg_decoder.tj));
+        lat_drop(LAT_DROP_DECODE);
         return;
     }
+    t1 = lat_now();
+    lat_record(LAT_DECODE, t1 - t0);
+
+    if (!jpg_decoder.swc && subsamp != TJSAMP_420 && subsamp != TJSAMP_GRAY) {
+        decoder_downsample_chroma();
+        lat_record(LAT_SCALE, lat_now() - t1);
+    }
 
+    jpg_decoder.has_frame = 1;
     decoder_share_frame();
+    lat_record(LAT_TOTAL, lat_now() - frame->t_start);
     return;
 }
 
 static void decoder_share_frame() {
     BYTE *p = jpg_decoder.m_decodeBuf;
+    int64_t t0 = lat_now(), t1;
     if (jpg_decoder.swc != NULL) {
         sws_scale(jpg_decoder.swc,
             (const uint8_t * const*) jpg_decoder.swcSrcSlice,
@@ -352,11 +797,15 @@ static void decoder_share_frame() {
             jpg_decoder.swcDstStride);
 
         p = jpg_decoder.m_webcamBuf;
+        t1 = lat_now();
+        lat_record(LAT_SCALE, t1 - t0);
+        t0 = t1;
     }
 
     if (write(droidcam_device_fd, p, jpg_decoder.m_webcamYuvSize) < 0) {
         errprint("error: write() failed for video device\n");
     }
+    lat_record(LAT_WRITE, lat_now() - t0);
 }
 
 
@@ -398,18 +847,71 @@ void decoder_show_test_image() {
 }
 
 void push_jpg_frame(JPGFrame* frame, bool empty) {
-    if (empty || receive_queue.size == 0 || decode_queue.size > jpg_decoder.m_BufferLimit)
+    if (empty) {
         queue_add(&receive_queue, frame);
-    else
-        queue_add(&decode_queue, frame);
+        return;
+    }
+
+    // keep a slot free for the receiver, and don't fall behind the stream
+    if (receive_queue.size == 0 || decode_queue.size > jpg_decoder.m_BufferLimit) {
+        lat_drop(receive_queue.size == 0 ? LAT_DROP_NO_SLOT : LAT_DROP_BEHIND);
+        queue_add(&receive_queue, frame);
+        return;
+    }
+
+    frame->t_queued = lat_now();
+    queue_add(&decode_queue, frame);
+
+    pthread_mutex_lock(&ready_lock);
+    frame_seq++;
+    pthread_cond_signal(&frame_ready);
+    pthread_mutex_unlock(&ready_lock);
+}
+
+/* Waits up to timeout_ms for a frame queued after the last call.
+ * Returns 1 if there was one, 0 on timeout.
+ */
+int decoder_wait_frame(unsigned *seen, int timeout_ms) {
+    struct timespec ts;
+    int rc = 0;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += timeout_ms / 1000;
+    ts.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&ready_lock);
+    while (frame_seq == *seen) {
+        if (pthread_cond_timedwait(&frame_ready, &ready_lock, &ts) != 0)
+            break;
+    }
+    if (frame_seq != *seen) {
+        *seen = frame_seq;
+        rc = 1;
+    }
+    pthread_mutex_unlock(&ready_lock);
+    return rc;
 }
 
 JPGFrame* pull_empty_jpg_frame(void) {
     return (JPGFrame*) queue_next(&receive_queue, 0);
 }
 
-JPGFrame* pull_ready_jpg_frame(void) {
-    return (JPGFrame*) queue_next(&decode_queue, jpg_decoder.m_BufferLimit);
+/* Decodes the next queued frame onto the device, for the decode thread.
+ * Returns 0 if there was none.
+ */
+int decoder_decode_next(void) {
+    pthread_mutex_lock(&frame_lock);
+    JPGFrame *f = (JPGFrame*) queue_next(&decode_queue, jpg_decoder.m_BufferLimit);
+    if (f) {
+        process_frame(f);
+        push_jpg_frame(f, true);
+    }
+    pthread_mutex_unlock(&frame_lock);
+    return f != NULL;
 }
 
 int decoder_get_video_width() {
@@ -454,30 +956,135 @@ int decoder_get_audio_frame_size(void) {
 
 void decoder_speex_plc(struct snd_transfer_s* transfer) {
     short *output_buffer = (short *)transfer->my_areas->addr;
-    if ((int)transfer->frames >= spx_decoder.frame_size){
-        speex_decode_int(spx_decoder.state, NULL, &output_buffer[transfer->offset]);
-        transfer->frames = spx_decoder.frame_size;
-    } else {
-        memset(&output_buffer[transfer->offset], 0, transfer->frames * sizeof(short));
+
+    // concealment comes in whole speex frames, hand it out in period sized pieces
+    if (spx_decoder.plc_used == spx_decoder.frame_size) {
+        speex_decode_int(spx_decoder.state, NULL, spx_decoder.plc_buf);
+        spx_decoder.plc_used = 0;
     }
+
+    int frames = spx_decoder.frame_size - spx_decoder.plc_used;
+    if ((int)transfer->frames > frames)
+        transfer->frames = frames;
+
+    memcpy(&output_buffer[transfer->offset], &spx_decoder.plc_buf[spx_decoder.plc_used], transfer->frames * sizeof(short));
+    spx_decoder.plc_used += transfer->frames;
     // dbgprint("guessed %ld frames\n", transfer->frames);
 }
 
-int decode_speex_frame(char *stream_buf, short *decode_buf, int droidcam_spx_chunks) {
-    int output_used = 0;
+void decoder_set_audio_gain(int boost_perc, int agc) {
+    audio_gain_init(&spx_decoder.gain, boost_perc, agc);
+}
+
+void decoder_audio_drift_update(long fill) {
+    struct audio_drift_s *d = &spx_decoder.drift;
+    d->fill_avg += (fill - d->fill_avg) / DRIFT_FILL_SMOOTH;
+
+    // fill above target: phone clock is faster, squeeze; below: stretch
+    double error = d->fill_avg - d->target;
+    if (error > -d->target && error < d->target) {
+        d->integral += error;
+        if (d->integral * DRIFT_KI_PPM >  DRIFT_MAX_PPM) d->integral =  DRIFT_MAX_PPM / DRIFT_KI_PPM;
+        if (d->integral * DRIFT_KI_PPM < -DRIFT_MAX_PPM) d->integral = -DRIFT_MAX_PPM / DRIFT_KI_PPM;
+    }
+
+    double ppm = -(error * DRIFT_KP_PPM + d->integral * DRIFT_KI_PPM);
+    if (ppm >  DRIFT_MAX_PPM) ppm =  DRIFT_MAX_PPM;
+    if (ppm < -DRIFT_MAX_PPM) ppm = -DRIFT_MAX_PPM;
+    d->ratio = 1.0 + ppm / 1000000.0;
+}
+
+int decoder_audio_set_jitter(int jitter_us) {
+    // keep twice the network jitter staged, within reason
+    long extra = (long) jitter_us * 2 * DROIDCAM_PCM_CHUNK_SAMPLES_2 / (DROIDCAM_CHUNK_MS_2 * 1000);
+    if (extra > AUDIO_STAGED_MAX)
+        extra = AUDIO_STAGED_MAX;
+
+    spx_decoder.drift.target = spx_decoder.drift.base_target + extra;
+    return extra;
+}
+
+/* Returns the samples written to out, *consumed is how much of in[] was
+ * used. When out fills up first the rest of in[] is the caller's to feed
+ * back in next time, the phase picks up where this call stopped.
+ */
+static int resample_linear(struct audio_drift_s *d, const short *in, int in_len, short *out, int out_max, int *consumed) {
+    // positions are relative to d->last, which sits at index 0 ahead of in[]
+    const double step = 1.0 / d->ratio;
+    double pos = d->phase;
+    int out_len = 0;
+
+    *consumed = 0;
+    if (in_len <= 0)
+        return 0;
+
+    while (pos < in_len && out_len < out_max) {
+        int i = (int) pos;
+        double frac = pos - i;
+        int a = (i == 0) ? d->last : in[i - 1];
+        int b = in[i];
+        out[out_len++] = (short) (a + (b - a) * frac);
+        pos += step;
+    }
+
+    if (pos >= in_len) {
+        *consumed = in_len;
+        d->phase = pos - in_len;
+        d->last = in[in_len - 1];
+        return out_len;
+    }
+
+    int i = (int) pos;
+    *consumed = i;
+    d->phase = pos - i;
+    if (i > 0)
+        d->last = in[i - 1];
+    return out_len;
+}
+
+int decode_speex_frame(char *stream_buf, int droidcam_spx_chunks) {
+    struct audio_drift_s *d = &spx_decoder.drift;
+    short *pcm_buf = spx_decoder.pcm_buf;
+    int carry = d->carry;
+    int output_used = carry;
+    int consumed;
     for (int i = 0; i < droidcam_spx_chunks; i++) {
         speex_bits_read_from(&spx_decoder.bits, &stream_buf[i * DROIDCAM_SPX_CHUNK_BYTES_2], DROIDCAM_SPX_CHUNK_BYTES_2);
-        while (output_used < DECODE_BUF_SIZE) {
-            int ret = speex_decode_int(spx_decoder.state, &spx_decoder.bits, &decode_buf[output_used]);
+        while (output_used + spx_decoder.frame_size <= carry + DECODE_BUF_SIZE) {
+            int ret = speex_decode_int(spx_decoder.state, &spx_decoder.bits, &pcm_buf[output_used]);
             if (ret != 0) break;
             output_used += spx_decoder.frame_size;
         }
     }
-    if (output_used > 0 && spx_decoder.audioBoostPerc != 100 && spx_decoder.audioBoostPerc >= 50 && spx_decoder.audioBoostPerc < 200) {
-        for (int i = 0; i < output_used; i++) {
-            decode_buf[i] += (decode_buf[i] * spx_decoder.audioBoostPerc / 100);
-        }
-    }
+    audio_gain_apply(&spx_decoder.gain, &pcm_buf[carry], output_used - carry);
     // dbgprint("decoded %d frames\n", output_used);
-    return output_used;
+    int out_len = resample_linear(d, pcm_buf, output_used, spx_decoder.out_buf, DECODE_BUF_SIZE, &consumed);
+
+    // stretching can leave a few input samples over, they go first next time
+    d->carry = output_used - consumed;
+    if (d->carry > DRIFT_CARRY_MAX) {
+        dbgprint("dropped %d resampler input frames\n", d->carry - DRIFT_CARRY_MAX);
+        consumed += d->carry - DRIFT_CARRY_MAX;
+        d->carry = DRIFT_CARRY_MAX;
+    }
+    memmove(pcm_buf, &pcm_buf[consumed], d->carry * sizeof(short));
+    return pcm_ring_write(&spx_decoder.staging, spx_decoder.out_buf, out_len);
+}
+
+int decoder_audio_staged(void) {
+    return pcm_ring_used(&spx_decoder.staging);
+}
+
+int decoder_audio_read(short *pcm, int count) {
+    // real audio is back, discard what's left of the concealment
+    spx_decoder.plc_used = spx_decoder.frame_size;
+    return pcm_ring_read(&spx_decoder.staging, pcm, count);
+}
+
+int decoder_audio_trim(int max_staged) {
+    int staged = pcm_ring_used(&spx_decoder.staging);
+    if (staged <= max_staged)
+        return 0;
+
+    return pcm_ring_drop(&spx_decoder.staging, staged - max_staged);
 }
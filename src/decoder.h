@@ -10,19 +10,36 @@
 #define __DECODR_H__
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <poll.h>
 #include <alsa/asoundlib.h>
 struct snd_transfer_s {
     int first;
     snd_pcm_uframes_t offset;
     snd_pcm_uframes_t frames;
+    snd_pcm_uframes_t queued; /* frames still in the device buffer */
     const snd_pcm_channel_area_t *my_areas;
 };
 
+#define GAIN_UNITY      4096 /* Q12 */
+#define AUDIO_BOOST_MIN 10
+#define AUDIO_BOOST_MAX 800
+
+struct audio_gain_s {
+    int manual;     /* Q12 */
+    int agc;
+    int agc_gain;   /* Q12 */
+    int peak_env;
+};
+
 typedef unsigned char BYTE;
 
 typedef struct JPGFrame {
     BYTE *data;
     unsigned length;
+    unsigned size;
+    int64_t t_start;  /* lat_now() at the frame header */
+    int64_t t_queued; /* lat_now() when handed to the decode thread */
 } JPGFrame;
 
 
@@ -33,14 +50,23 @@ void decoder_fini();
 snd_pcm_t * decoder_prepare_audio(void);
 int decoder_get_audio_frame_size(void);
 void decoder_speex_plc(struct snd_transfer_s* transfer);
-int decode_speex_frame(char *stream_buf, short *decode_buf, int droidcam_spx_chunks);
+int decode_speex_frame(char *stream_buf, int droidcam_spx_chunks);
+int decoder_audio_staged(void);
+int decoder_audio_read(short *pcm, int count);
+int decoder_audio_trim(int max_staged);
+void decoder_audio_drift_update(long fill);
+int decoder_audio_set_jitter(int jitter_us);
+void decoder_set_audio_gain(int boost_perc, int agc);
 int  decoder_prepare_video(char * header);
 void decoder_cleanup();
+void decoder_hold_frame(void);
+int decoder_grow_frames(unsigned length);
+void *decoder_get_frame_pool(size_t *len);
 
 JPGFrame* pull_empty_jpg_frame(void);
-JPGFrame* pull_ready_jpg_frame(void);
 void push_jpg_frame(JPGFrame*, bool empty);
-void process_frame(JPGFrame*);
+int decoder_decode_next(void);
+int decoder_wait_frame(unsigned *seen, int timeout_ms);
 int decoder_get_video_width();
 int decoder_get_video_height();
 int decoder_horizontal_flip();
@@ -57,6 +83,7 @@ void decoder_show_test_image();
 #define STREAM_BUF_SIZE (DROIDCAM_SPX_CHUNK_BYTES_2*6)
 #define DECODE_BUF_SIZE (DROIDCAM_PCM_CHUNK_SAMPLES_2*6)
 #define CHUNKS_PER_PACKET 2
+#define AUDIO_STAGED_MAX (DROIDCAM_PCM_CHUNK_SAMPLES_2*CHUNKS_PER_PACKET)
 #define UDP_STREAM 2
 #define TCP_STREAM 1
 
@@ -65,14 +92,26 @@ void decoder_show_test_image();
 
 #define V4L2_PLATFORM    "platform:v4l2loopback"
 #define V4L2_PLATFORM_DC "platform:v4l2loopback_dc"
+#define V4L2_CARD_DC     "Droidcam"
 
 void set_v4l2_device(const char* device);
 int open_v4l2_device(void);
-int find_v4l2_device(const char* bus_info);
+int find_v4l2_device(void);
 void query_v4l_device(int droidcam_device_fd, unsigned *WEBCAM_W, unsigned *WEBCAM_H);
 
+void audio_gain_init(struct audio_gain_s *gain, int boost_perc, int agc);
+void audio_gain_apply(struct audio_gain_s *gain, short *pcm, int count);
+
+void yuv_chroma_to_420(const BYTE *src, int src_stride, BYTE *dst, int dst_w, int dst_h, int xs, int ys);
+
+void snd_set_latency_profile(int profile);
 snd_pcm_t *find_snd_device(void);
+void snd_guess_device(void);
+void snd_get_geometry(snd_pcm_uframes_t *period, snd_pcm_uframes_t *buffer);
 int snd_transfer_check(snd_pcm_t *handle, struct snd_transfer_s *transfer);
 int snd_transfer_commit(snd_pcm_t *handle, struct snd_transfer_s *transfer);
+int snd_poll_descriptors(snd_pcm_t *handle, struct pollfd *pfds, int max);
+int snd_poll_ready(snd_pcm_t *handle, struct pollfd *pfds, int count);
+void snd_get_xruns(unsigned long *underruns, unsigned long *recoveries);
 
 #endif
@@ -0,0 +1,117 @@
+/* DroidCam & DroidCamX (C) 2010-2021
+ * https://github.com/dev47apps
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <stdlib.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "common.h"
+#include "decoder.h"
+
+/* Gains are Q12 fixed point, 4096 == 1.0 */
+#define GAIN_SHIFT 12
+#define GAIN_ROUND (1 << (GAIN_SHIFT - 1))
+
+#define AGC_TARGET_PEAK   23197 /* -3 dBFS */
+#define AGC_NOISE_FLOOR   300   /* don't chase silence */
+#define AGC_MAX_GAIN      (8 * GAIN_UNITY)
+#define AGC_RELEASE_SHIFT 6     /* peak envelope decay, ~2.5s with 40ms packets */
+#define AGC_RISE_STEP     (GAIN_UNITY / 128)
+
+static inline short saturate16(int v) {
+    return (v > 32767) ? 32767 : (v < -32768) ? -32768 : (short) v;
+}
+
+static void pcm_apply_gain(short *pcm, int count, int gain) {
+    int i = 0;
+
+#if defined(__SSE2__)
+    const __m128i g = _mm_set1_epi16((short) gain);
+    const __m128i r = _mm_set1_epi32(GAIN_ROUND);
+    for (; i + 8 <= count; i += 8) {
+        __m128i x  = _mm_loadu_si128((const __m128i*) &pcm[i]);
+        __m128i lo = _mm_mullo_epi16(x, g);
+        __m128i hi = _mm_mulhi_epi16(x, g);
+        __m128i p0 = _mm_srai_epi32(_mm_add_epi32(_mm_unpacklo_epi16(lo, hi), r), GAIN_SHIFT);
+        __m128i p1 = _mm_srai_epi32(_mm_add_epi32(_mm_unpackhi_epi16(lo, hi), r), GAIN_SHIFT);
+        _mm_storeu_si128((__m128i*) &pcm[i], _mm_packs_epi32(p0, p1));
+    }
+#elif defined(__ARM_NEON)
+    const int16x4_t g = vdup_n_s16((short) gain);
+    for (; i + 8 <= count; i += 8) {
+        int16x8_t x = vld1q_s16(&pcm[i]);
+        int32x4_t p0 = vmull_s16(vget_low_s16(x), g);
+        int32x4_t p1 = vmull_s16(vget_high_s16(x), g);
+        vst1q_s16(&pcm[i], vcombine_s16(vqrshrn_n_s32(p0, GAIN_SHIFT), vqrshrn_n_s32(p1, GAIN_SHIFT)));
+    }
+#endif
+
+    for (; i < count; i++) {
+        pcm[i] = saturate16((pcm[i] * gain + GAIN_ROUND) >> GAIN_SHIFT);
+    }
+}
+
+static int pcm_peak(const short *pcm, int count) {
+    int peak = 0;
+    for (int i = 0; i < count; i++) {
+        int v = abs(pcm[i]);
+        if (v > peak) peak = v;
+    }
+    return peak;
+}
+
+void audio_gain_init(struct audio_gain_s *gain, int boost_perc, int agc) {
+    if (boost_perc < AUDIO_BOOST_MIN) boost_perc = AUDIO_BOOST_MIN;
+    if (boost_perc > AUDIO_BOOST_MAX) boost_perc = AUDIO_BOOST_MAX;
+
+    gain->manual = boost_perc * GAIN_UNITY / 100;
+    gain->agc = agc;
+    gain->agc_gain = GAIN_UNITY;
+    gain->peak_env = 0;
+}
+
+void audio_gain_apply(struct audio_gain_s *gain, short *pcm, int count) {
+    int total = gain->manual;
+
+    if (count <= 0)
+        return;
+
+    if (gain->agc) {
+        // instant attack, slow release on the peak envelope
+        int peak = pcm_peak(pcm, count);
+        if (peak > gain->peak_env)
+            gain->peak_env = peak;
+        else
+            gain->peak_env -= gain->peak_env >> AGC_RELEASE_SHIFT;
+
+        // post-manual-boost peak, so the two stages cooperate
+        int level = (int) (((long) gain->peak_env * gain->manual) >> GAIN_SHIFT);
+        int wanted = AGC_MAX_GAIN;
+        if (level > 0)
+            wanted = (int) (((long) AGC_TARGET_PEAK << GAIN_SHIFT) / level);
+        if (wanted > AGC_MAX_GAIN)
+            wanted = AGC_MAX_GAIN;
+
+        if (wanted < gain->agc_gain) {
+            gain->agc_gain = wanted;
+        } else if (gain->peak_env > AGC_NOISE_FLOOR) {
+            gain->agc_gain += AGC_RISE_STEP;
+            if (gain->agc_gain > wanted) gain->agc_gain = wanted;
+        }
+
+        total = (int) (((long) total * gain->agc_gain) >> GAIN_SHIFT);
+    }
+
+    if (total > 32767) total = 32767;
+    if (total != GAIN_UNITY)
+        pcm_apply_gain(pcm, count, total);
+}
@@ -6,13 +6,22 @@
  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
  */
 
+#if __linux__
+#include <linux/limits.h>
+#endif
+
+#if __FreeBSD__
+#include <sys/limits.h>
+#endif
+
 #include "common.h"
+#include "settings.h"
 #include "decoder.h"
+#include "trace.h"
 
 
 #define AUDIO_RATE     16000
 #define AUDIO_CHANNELS     1
-#define PERIOD_TIME    (DROIDCAM_CHUNK_MS_2 * 1000)
 
 char snd_device[32];
 
@@ -21,16 +30,38 @@ static snd_pcm_format_t format = SND_PCM_FORMAT_S16;
 static snd_pcm_sframes_t buffer_size;
 static snd_pcm_sframes_t period_size;
 
-static unsigned int period_time = PERIOD_TIME;/* period time in us */
-static unsigned int buffer_time = DROIDCAM_SPEEX_BACKBUF_MAX_COUNT * PERIOD_TIME; /* ring buffer length in us */
+/* Period and buffer geometry, times in us.
+ * The period is negotiated within [period_min, period_max] if the device
+ * allows it, otherwise whatever the device grants is used.
+ */
+struct snd_profile_s {
+    const char *name;
+    unsigned int period_time;
+    unsigned int period_min;
+    unsigned int period_max;
+    unsigned int periods;
+};
+
+static const struct snd_profile_s snd_profiles[] = {
+    [LATENCY_NORMAL] = { "normal", 20000, 10000, 40000, 2 },
+    [LATENCY_LOW]    = { "low",     5000,  5000, 10000, 3 },
+    [LATENCY_ROBUST] = { "robust", 20000, 10000, 40000, 4 },
+};
+
+static const struct snd_profile_s *snd_profile = &snd_profiles[LATENCY_NORMAL];
+
+void snd_set_latency_profile(int profile) {
+    if (profile >= 0 && profile < (int) ARRAY_LEN(snd_profiles))
+        snd_profile = &snd_profiles[profile];
+}
 
 snd_pcm_hw_params_t *hwparams;
 snd_pcm_sw_params_t *swparams;
 
-static int set_hwparams(snd_pcm_t *handle, snd_pcm_hw_params_t *params, snd_pcm_access_t access) {
-    unsigned int rrate;
+static int set_hwparams(snd_pcm_t *handle, snd_pcm_hw_params_t *params, snd_pcm_access_t access, int strict) {
+    unsigned int rrate, periods, period_time, period_min, period_max;
     snd_pcm_uframes_t size;
-    int err, dir;
+    int err, dir = 0, dir_max = 0;
     int resample = 1;
     /* choose all parameters */
     err = snd_pcm_hw_params_any(handle, params);
@@ -73,19 +104,19 @@ static int set_hwparams(snd_pcm_t *handle, snd_pcm_hw_params_t *params, snd_pcm_
         errprint("Rate doesn't match (requested %uHz, get %iHz)\n", AUDIO_RATE, err);
         return -EINVAL;
     }
-    /* set the buffer time */
-    err = snd_pcm_hw_params_set_buffer_time_near(handle, params, &buffer_time, &dir);
-    if (err < 0) {
-        errprint("Unable to set buffer time %u for playback: %s\n", buffer_time, snd_strerror(err));
-        return err;
-    }
-    err = snd_pcm_hw_params_get_buffer_size(params, &size);
-    if (err < 0) {
-        errprint("Unable to get buffer size for playback: %s\n", snd_strerror(err));
-        return err;
+    /* keep the period in the profile's range */
+    if (strict) {
+        period_min = snd_profile->period_min;
+        period_max = snd_profile->period_max;
+        err = snd_pcm_hw_params_set_period_time_minmax(handle, params, &period_min, &dir, &period_max, &dir_max);
+        if (err < 0) {
+            errprint("Period time %u-%uus not available for playback: %s\n",
+                snd_profile->period_min, snd_profile->period_max, snd_strerror(err));
+            return err;
+        }
     }
-    buffer_size = size;
     /* set the period time */
+    period_time = snd_profile->period_time;
     err = snd_pcm_hw_params_set_period_time_near(handle, params, &period_time, &dir);
     if (err < 0) {
         errprint("Unable to set period time %u for playback: %s\n", period_time, snd_strerror(err));
@@ -97,6 +128,19 @@ static int set_hwparams(snd_pcm_t *handle, snd_pcm_hw_params_t *params, snd_pcm_
         return err;
     }
     period_size = size;
+    /* set the buffer length, in periods */
+    periods = snd_profile->periods;
+    err = snd_pcm_hw_params_set_periods_near(handle, params, &periods, &dir);
+    if (err < 0) {
+        errprint("Unable to set %u periods for playback: %s\n", periods, snd_strerror(err));
+        return err;
+    }
+    err = snd_pcm_hw_params_get_buffer_size(params, &size);
+    if (err < 0) {
+        errprint("Unable to get buffer size for playback: %s\n", snd_strerror(err));
+        return err;
+    }
+    buffer_size = size;
     /* write the parameters to device */
     err = snd_pcm_hw_params(handle, params);
     if (err < 0) {
@@ -141,10 +185,21 @@ static int set_swparams(snd_pcm_t *handle, snd_pcm_sw_params_t *swparams) {
     return 0;
 }
 
+// audio side of the event loop only, read from elsewhere as a rough count
+static unsigned long snd_underruns, snd_recoveries;
+
+void snd_get_xruns(unsigned long *underruns, unsigned long *recoveries) {
+    *underruns = snd_underruns;
+    *recoveries = snd_recoveries;
+}
+
 static int xrun_recovery(snd_pcm_t *handle, int err) {
     dbgprint("stream recovery\n");
+    snd_recoveries++;
+    trace_instant("xrun", err);
 
     if (err == -EPIPE) {    /* under-run */
+        snd_underruns++;
         err = snd_pcm_prepare(handle);
         if (err < 0) errprint("Can't recover from underrun\n");
     }
@@ -194,6 +249,7 @@ int snd_transfer_check(snd_pcm_t *handle, struct snd_transfer_s *transfer) {
         return 0;
     }
 
+    transfer->queued = (avail < buffer_size) ? (buffer_size - avail) : 0;
     if (avail < period_size) {
         if (transfer->first) {
             transfer->first = 0;
@@ -202,16 +258,8 @@ int snd_transfer_check(snd_pcm_t *handle, struct snd_transfer_s *transfer) {
                 errprint("snd_pcm_start failed: %s\n", snd_strerror(err));
                 return err;
             }
-        } else {
-            err = snd_pcm_wait(handle, 2000);
-            if (err < 0) {
-                if ((err = xrun_recovery(handle, err)) < 0) {
-                    errprint("snd_pcm_wait error: %s\n", snd_strerror(err));
-                    return err;
-                }
-                transfer->first = 1;
-            }
         }
+        // caller waits on the poll descriptors for the next period
         return 0;
     }
 
@@ -229,6 +277,31 @@ int snd_transfer_check(snd_pcm_t *handle, struct snd_transfer_s *transfer) {
 }
 
 
+int snd_poll_descriptors(snd_pcm_t *handle, struct pollfd *pfds, int max) {
+    int count = snd_pcm_poll_descriptors_count(handle);
+    if (count <= 0 || count > max) {
+        errprint("Unexpected audio poll descriptor count: %d\n", count);
+        return -1;
+    }
+
+    count = snd_pcm_poll_descriptors(handle, pfds, count);
+    if (count < 0) {
+        errprint("Unable to obtain audio poll descriptors: %s\n", snd_strerror(count));
+        return -1;
+    }
+    return count;
+}
+
+int snd_poll_ready(snd_pcm_t *handle, struct pollfd *pfds, int count) {
+    unsigned short revents;
+    int err = snd_pcm_poll_descriptors_revents(handle, pfds, count, &revents);
+    if (err < 0) {
+        // let snd_transfer_check() sort out the device state
+        return 1;
+    }
+    return (revents & (POLLOUT | POLLERR)) != 0;
+}
+
 int snd_transfer_commit(snd_pcm_t *handle, struct snd_transfer_s *transfer) {
     int err;
     snd_pcm_sframes_t commits = snd_pcm_mmap_commit(handle, transfer->offset, transfer->frames);
@@ -245,58 +318,160 @@ int snd_transfer_commit(snd_pcm_t *handle, struct snd_transfer_s *transfer) {
 }
 
 
+void snd_get_geometry(snd_pcm_uframes_t *period, snd_pcm_uframes_t *buffer) {
+    *period = period_size;
+    *buffer = buffer_size;
+}
+
+/* Discovery
+ * Only runs once audio is actually requested. A subdevice somebody else
+ * is already playing to shows up as not "closed" in procfs, so busy ones
+ * are skipped without opening them and negotiating hw params. The last
+ * good subdevice is cached in a file and tried first next time.
+ */
+#define SND_CARDS_MAX      50
+#define SND_SUBDEVICES_MAX 8
+
+static int snd_load_cached(int *card, int *sub) {
+    char buf[32];
+
+    if (LoadCache("alsa", buf, sizeof(buf)) < 0 || sscanf(buf, "hw:%d,0,%d", card, sub) != 2)
+        return -1;
+    return 0;
+}
+
+static void snd_save_cached(int card, int sub) {
+    char buf[32];
+    int cached_card, cached_sub;
+
+    if (snd_load_cached(&cached_card, &cached_sub) == 0 && cached_card == card && cached_sub == sub)
+        return;
+
+    snprintf(buf, sizeof(buf), "hw:%d,0,%d", card, sub);
+    SaveCache("alsa", buf);
+}
+
+static int snd_is_loopback(int card) {
+    char path[64];
+    char id[16] = {0};
+
+    snprintf(path, sizeof(path), "/proc/asound/card%d/id", card);
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return 0;
+
+    int len = fread(id, 1, sizeof(id) - 1, fp);
+    fclose(fp);
+    return len > 0 && strncmp(id, "Loopback", 8) == 0;
+}
+
+// 1 when nobody has the playback subdevice open, 0 when busy, -1 if it doesn't exist
+static int snd_subdevice_free(int card, int sub) {
+    char path[64];
+    char state[16] = {0};
+
+    snprintf(path, sizeof(path), "/proc/asound/card%d/pcm0p/sub%d/status", card, sub);
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return -1;
+
+    int len = fread(state, 1, sizeof(state) - 1, fp);
+    fclose(fp);
+    return len > 0 && strncmp(state, "closed", 6) == 0;
+}
+
+/* Opens and sets up hw:card,0,sub. Returns 1 with *handle set, 0 to try
+ * the next one, -1 to give up.
+ */
+static int snd_open_subdevice(int card, int sub, snd_pcm_t **handle) {
+    int err;
+
+    snprintf(snd_device, sizeof(snd_device), "hw:%d,0,%d", card, sub);
+    dbgprint("Trying to open audio device: %s\n", snd_device);
+    err = snd_pcm_open(handle, snd_device, SND_PCM_STREAM_PLAYBACK, 0);
+    if (err < 0 || !*handle) {
+        errprint("warn: snd_pcm_open(%s) failed: %s\n", snd_device, snd_strerror(err));
+        return 0;
+    }
+
+    // got a handle
+
+    if (set_hwparams(*handle, hwparams, SND_PCM_ACCESS_MMAP_INTERLEAVED, 1) < 0
+     && set_hwparams(*handle, hwparams, SND_PCM_ACCESS_MMAP_INTERLEAVED, 0) < 0) {
+        errprint("setting audio hwparams failed for %s\n", snd_device);
+        snd_pcm_close(*handle);
+        return 0;
+    }
+
+    if (set_swparams(*handle, swparams) < 0) {
+        errprint("setting audio swparams failed for %s\n", snd_device);
+        snd_pcm_close(*handle);
+        return 0;
+    }
+
+    if (period_size <= 0 || buffer_size < period_size * 2) {
+        errprint("Unusable audio device geometry: period %ld, buffer %ld frames\n",
+            period_size, buffer_size);
+        snd_pcm_close(*handle);
+        return -1;
+    }
+    dbgprint("audio profile %s: period %ld, buffer %ld frames\n",
+        snd_profile->name, period_size, buffer_size);
+
+    // update the buffer to have output device name, which will be shown in the UI
+    snprintf(snd_device, sizeof(snd_device), "hw:%d,1,%d", card, sub);
+    snd_save_cached(card, sub);
+    return 1;
+}
+
+// Shows the device audio will most likely use, without touching ALSA
+void snd_guess_device(void) {
+    int card, sub;
+
+    if (snd_load_cached(&card, &sub) == 0 && snd_is_loopback(card))
+        snprintf(snd_device, sizeof(snd_device), "hw:%d,1,%d", card, sub);
+    else
+        snd_device[0] = 0;
+}
+
 snd_pcm_t *find_snd_device(void) {
-    int err, card, i;
+    int rc, card, sub;
     snd_pcm_t *handle = NULL;
     snd_pcm_hw_params_alloca(&hwparams);
     snd_pcm_sw_params_alloca(&swparams);
 
-    for (card = 0; card < 50; card++) {
-        snprintf(snd_device, sizeof(snd_device), "/proc/asound/card%d/id", card);
-        dbgprint("Trying %s\n", snd_device);
-
-        FILE *fp = fopen(snd_device, "r");
-        if (!fp)
-            continue;
+    if (snd_load_cached(&card, &sub) == 0 && snd_is_loopback(card)
+        && snd_subdevice_free(card, sub) == 1)
+    {
+        rc = snd_open_subdevice(card, sub, &handle);
+        if (rc > 0)
+            return handle;
+        if (rc < 0)
+            goto OUT;
+    }
 
-        err = fread(snd_device, 1, sizeof(snd_device), fp);
-        fclose(fp);
-        if (err <= 0 || strncmp(snd_device, "Loopback", 8) != 0)
+    for (card = 0; card < SND_CARDS_MAX; card++) {
+        dbgprint("Trying card %d\n", card);
+        if (!snd_is_loopback(card))
             continue;
 
-        for (i = 0; i < 8; i++) {
-            snprintf(snd_device, sizeof(snd_device), "hw:%d,0,%d", card, i);
-            dbgprint("Trying to open audio device: %s\n", snd_device);
-            err = snd_pcm_open(&handle, snd_device, SND_PCM_STREAM_PLAYBACK, 0);
-            if (err < 0 || !handle) {
-                errprint("warn: snd_pcm_open(%s) failed: %s\n", snd_device, snd_strerror(err));
-                continue;
-            }
-
-            // got a handle
+        // no status in procfs at all, fall back to trying every subdevice
+        int probe = snd_subdevice_free(card, 0) >= 0;
 
-            if (set_hwparams(handle, hwparams, SND_PCM_ACCESS_MMAP_INTERLEAVED) < 0) {
-                errprint("setting audio hwparams failed for %s\n", snd_device);
-                snd_pcm_close(handle);
+        for (sub = 0; sub < SND_SUBDEVICES_MAX; sub++) {
+            rc = probe ? snd_subdevice_free(card, sub) : 1;
+            if (rc < 0)
+                break;
+            if (rc == 0) {
+                dbgprint("hw:%d,0,%d is busy\n", card, sub);
                 continue;
             }
 
-            if (set_swparams(handle, swparams) < 0) {
-                errprint("setting audio swparams failed for %s\n", snd_device);
-                snd_pcm_close(handle);
-                continue;
-            }
-
-            if (buffer_size != DROIDCAM_PCM_CHUNK_BYTES_2) {
-                errprint("Unexpected audio device buffer size: %ld expected %ld\n",
-                    buffer_size, DROIDCAM_PCM_CHUNK_BYTES_2);
-                snd_pcm_close(handle);
+            rc = snd_open_subdevice(card, sub, &handle);
+            if (rc > 0)
+                return handle;
+            if (rc < 0)
                 goto OUT;
-            }
-
-            // update the buffer to have output device name, which will be shown in the UI
-            snprintf(snd_device, sizeof(snd_device), "hw:%d,1,%d", card, i);
-            return handle;
         }
     }
 
@@ -6,11 +6,22 @@
  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
  */
 
+#include <dirent.h>
 #include <linux/videodev2.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 
+#if __linux__
+#include <linux/limits.h>
+#endif
+
+#if __FreeBSD__
+#include <sys/limits.h>
+#include <sys/param.h>
+#endif
+
 #include "common.h"
+#include "settings.h"
 #include "decoder.h"
 
 char v4l2_device[32];
@@ -96,32 +107,183 @@ int open_v4l2_device(void) {
     return fd;
 }
 
-int find_v4l2_device(const char* bus_info) {
-    int bus_info_len = strlen(bus_info);
-    int video_dev_fd;
-    int video_dev_nr = 0;
+/* Discovery
+ * The nodes come from sysfs instead of blindly opening /dev/video0..98,
+ * and nodes backed by real hardware (usb, pci) are skipped without being
+ * opened, which would otherwise wake the camera. Loopback devices are
+ * virtual or platform devices. The last match is cached in a file and
+ * checked first on the next run. Without sysfs, all 99 nodes are tried
+ * as before.
+ */
+#define V4L2_SYSFS     "/sys/class/video4linux"
+#define V4L2_NODES_MAX 99
+
+static int cmp_int(const void *a, const void *b) {
+    return *(const int*) a - *(const int*) b;
+}
+
+static int list_v4l2_nodes(int *nodes) {
+    int count = 0;
+    struct dirent *e;
+    DIR *dir = opendir(V4L2_SYSFS);
+
+    if (!dir) {
+        for (count = 0; count < V4L2_NODES_MAX; count++)
+            nodes[count] = count;
+        return count;
+    }
+
+    while ((e = readdir(dir)) != NULL && count < V4L2_NODES_MAX) {
+        if (sscanf(e->d_name, "video%d", &nodes[count]) == 1)
+            count++;
+    }
+    closedir(dir);
+
+    qsort(nodes, count, sizeof(int), cmp_int);
+    return count;
+}
+
+static int is_hardware_node(int nr) {
+    char path[PATH_MAX];
+    char link[PATH_MAX];
+    ssize_t len;
+
+    snprintf(path, sizeof(path), V4L2_SYSFS "/video%d/device/subsystem", nr);
+    len = readlink(path, link, sizeof(link) - 1);
+    if (len < 0)
+        return 0;
+
+    link[len] = 0;
+    const char *subsystem = strrchr(link, '/');
+    return strcmp(subsystem ? subsystem + 1 : link, "platform") != 0;
+}
+
+static int load_cached_node(void) {
+    char buf[32];
+    int nr = -1;
+
+    if (LoadCache("v4l2", buf, sizeof(buf)) < 0 || sscanf(buf, "/dev/video%d", &nr) != 1)
+        return -1;
+    return nr;
+}
+
+static void save_cached_node(int nr) {
+    char buf[32];
+
+    if (nr == load_cached_node())
+        return;
+
+    snprintf(buf, sizeof(buf), "/dev/video%d", nr);
+    SaveCache("v4l2", buf);
+}
+
+/* Opens /dev/videoN and checks its bus info. Returns 2 for the droidcam
+ * driver, 1 for a plain v4l2loopback device, and 0 (fd closed) otherwise.
+ */
+static int probe_v4l2_node(int nr, int *fd) {
     struct v4l2_capability v4l2cap;
+    const char *bus_info;
+
+    snprintf(v4l2_device, sizeof(v4l2_device), "/dev/video%d", nr);
+    *fd = open_v4l2_device();
+    if (*fd <= 0)
+        return 0;
+
+    if (xioctl(*fd, VIDIOC_QUERYCAP, &v4l2cap) < 0) {
+        close(*fd);
+        return 0;
+    }
+
+    bus_info = (const char*) v4l2cap.bus_info;
+    dbgprint("Device %s is '%s' @ %s\n", v4l2_device, v4l2cap.card, bus_info);
+    if (0 == strncmp(V4L2_PLATFORM_DC, bus_info, strlen(V4L2_PLATFORM_DC)))
+        return 2;
+    if (0 == strncmp(V4L2_PLATFORM, bus_info, strlen(V4L2_PLATFORM)))
+        return 1;
+
+    close(*fd);
+    return 0;
+}
+
+// Reads the card name sysfs has for /dev/videoN, 0 if there is none
+static int read_node_name(int nr, char *name, size_t size) {
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), V4L2_SYSFS "/video%d/name", nr);
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return 0;
 
-    dbgprint("Looking for v4l2 card: %s\n", bus_info);
-    for (video_dev_nr = 0; video_dev_nr < 99; video_dev_nr++) {
-        snprintf(v4l2_device, sizeof(v4l2_device), "/dev/video%d", video_dev_nr);
+    if (!fgets(name, size, fp)) {
+        fclose(fp);
+        return 0;
+    }
+    fclose(fp);
+    name[strcspn(name, "\n")] = 0;
+    return 1;
+}
 
-        video_dev_fd = open_v4l2_device();
-        if (video_dev_fd <= 0)
+/* Finds the droidcam device, else the first generic v4l2loopback one.
+ * Where sysfs has the card names only the node named after the droidcam
+ * driver is opened, QUERYCAP then just confirms it. Other loopback nodes
+ * are only opened if there is no such node.
+ */
+int find_v4l2_device(void) {
+    int nodes[V4L2_NODES_MAX];
+    int generic[V4L2_NODES_MAX];
+    int count = list_v4l2_nodes(nodes);
+    int cached = load_cached_node();
+    int fd, generic_fd = -1, generic_nr = -1, generic_count = 0;
+    char name[64];
+
+    dbgprint("Looking for v4l2 card: %d nodes, cached %d\n", count, cached);
+    for (int i = -1; i < count; i++) {
+        int nr = (i < 0) ? cached : nodes[i];
+        if (nr < 0 || (i >= 0 && nr == cached))
             continue;
 
-        if (xioctl(video_dev_fd, VIDIOC_QUERYCAP, &v4l2cap) < 0) {
-            close(video_dev_fd);
+        if (is_hardware_node(nr)) {
+            dbgprint("Skipping /dev/video%d, not a loopback device\n", nr);
             continue;
         }
 
-        dbgprint("Device %s is '%s' @ %s\n", v4l2_device, v4l2cap.card, v4l2cap.bus_info);
-        if (0 == strncmp(bus_info, (const char*) v4l2cap.bus_info, bus_info_len)) {
-            return video_dev_fd;
+        if (read_node_name(nr, name, sizeof(name))
+            && strncmp(name, V4L2_CARD_DC, strlen(V4L2_CARD_DC)) != 0)
+        {
+            dbgprint("Skipping /dev/video%d for now, card is '%s'\n", nr, name);
+            generic[generic_count++] = nr;
+            continue;
         }
 
-        close(video_dev_fd);
-        continue;
+        int rc = probe_v4l2_node(nr, &fd);
+        if (rc == 2) {
+            if (generic_fd > 0)
+                close(generic_fd);
+            save_cached_node(nr);
+            return fd;
+        }
+        if (rc == 1) {
+            // no name to go by, keep the first generic node open meanwhile
+            if (generic_fd < 0) {
+                generic_fd = fd;
+                generic_nr = nr;
+            } else {
+                close(fd);
+            }
+        }
+    }
+
+    if (generic_fd > 0) {
+        snprintf(v4l2_device, sizeof(v4l2_device), "/dev/video%d", generic_nr);
+        save_cached_node(generic_nr);
+        return generic_fd;
+    }
+
+    for (int i = 0; i < generic_count; i++) {
+        if (probe_v4l2_node(generic[i], &fd) > 0) {
+            save_cached_node(generic[i]);
+            return fd;
+        }
     }
 
     v4l2_device[0] = 0;
@@ -0,0 +1,88 @@
+/* DroidCam & DroidCamX (C) 2010-2021
+ * https://github.com/dev47apps
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "common.h"
+#include "decoder.h"
+
+/* Chroma downsampling to 4:2:0, for jpegs decoded in their native
+ * 4:2:2 / 4:4:0 / 4:4:4 planes. Each output sample is the rounded mean
+ * of the xs * ys source samples it covers (pairwise rounded).
+ */
+
+// dst[x] = mean(a[x], b[x])
+static void avg_rows(const BYTE *a, const BYTE *b, BYTE *dst, int w) {
+    int x = 0;
+
+#if defined(__SSE2__)
+    for (; x + 16 <= w; x += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i*) &a[x]);
+        __m128i vb = _mm_loadu_si128((const __m128i*) &b[x]);
+        _mm_storeu_si128((__m128i*) &dst[x], _mm_avg_epu8(va, vb));
+    }
+#elif defined(__ARM_NEON)
+    for (; x + 16 <= w; x += 16)
+        vst1q_u8(&dst[x], vrhaddq_u8(vld1q_u8(&a[x]), vld1q_u8(&b[x])));
+#endif
+
+    for (; x < w; x++)
+        dst[x] = (a[x] + b[x] + 1) >> 1;
+}
+
+// dst[x] = mean(a[2x], a[2x+1], b[2x], b[2x+1]), b may be a
+static void avg_pairs(const BYTE *a, const BYTE *b, BYTE *dst, int w) {
+    int x = 0;
+
+#if defined(__SSE2__)
+    const __m128i lo = _mm_set1_epi16(0x00FF);
+    for (; x + 16 <= w; x += 16) {
+        __m128i v0 = _mm_avg_epu8(_mm_loadu_si128((const __m128i*) &a[2*x]),
+                                  _mm_loadu_si128((const __m128i*) &b[2*x]));
+        __m128i v1 = _mm_avg_epu8(_mm_loadu_si128((const __m128i*) &a[2*x + 16]),
+                                  _mm_loadu_si128((const __m128i*) &b[2*x + 16]));
+        __m128i h0 = _mm_avg_epu16(_mm_and_si128(v0, lo), _mm_srli_epi16(v0, 8));
+        __m128i h1 = _mm_avg_epu16(_mm_and_si128(v1, lo), _mm_srli_epi16(v1, 8));
+        _mm_storeu_si128((__m128i*) &dst[x], _mm_packus_epi16(h0, h1));
+    }
+#elif defined(__ARM_NEON)
+    for (; x + 16 <= w; x += 16) {
+        uint8x16x2_t va = vld2q_u8(&a[2*x]);
+        uint8x16x2_t vb = vld2q_u8(&b[2*x]);
+        uint8x16_t even = vrhaddq_u8(va.val[0], vb.val[0]);
+        uint8x16_t odd  = vrhaddq_u8(va.val[1], vb.val[1]);
+        vst1q_u8(&dst[x], vrhaddq_u8(even, odd));
+    }
+#endif
+
+    // rounded the same way as the vector paths
+    for (; x < w; x++)
+        dst[x] = (((a[2*x] + b[2*x] + 1) >> 1) + ((a[2*x + 1] + b[2*x + 1] + 1) >> 1) + 1) >> 1;
+}
+
+/* src is a chroma plane of (dst_w * xs) x (dst_h * ys) samples, xs and
+ * ys are 1 or 2.
+ */
+void yuv_chroma_to_420(const BYTE *src, int src_stride, BYTE *dst, int dst_w, int dst_h, int xs, int ys) {
+    for (int y = 0; y < dst_h; y++) {
+        const BYTE *r0 = src + (y * ys) * src_stride;
+        const BYTE *r1 = (ys == 2) ? r0 + src_stride : r0;
+        BYTE *out = dst + y * dst_w;
+
+        if (xs == 2)
+            avg_pairs(r0, r1, out, dst_w);
+        else if (ys == 2)
+            avg_rows(r0, r1, out, dst_w);
+        else
+            memcpy(out, r0, dst_w);
+    }
+}
@@ -8,20 +8,29 @@
 
 #include <pthread.h>
 #include <signal.h>
+#include <sys/wait.h>
 
 #include "common.h"
 #include "settings.h"
 #include "connection.h"
 #include "decoder.h"
+#include "reactor.h"
+#include "metrics.h"
+#include "trace.h"
+
+#define RUNNING_CHECK_MS 100
+#define SESSIONS_MAX     8
 
 typedef struct Thread {
     pthread_t t;
     int rc;
 } Thread;
 
-Thread athread = {0, -1}, vthread = {0, -1}, dthread = {0, -1};
+Thread dthread = {0, -1};
 
 char *v4l2_dev = 0;
+char *metrics_addr = 0;
+char *trace_file = 0;
 unsigned v4l2_width = 640, v4l2_height = 480;
 volatile int a_active = 0;
 volatile int v_active = 0;
@@ -31,12 +40,32 @@ volatile int thread_cmd = 0;
 int no_controls = 0;
 struct settings g_settings = {0};
 
+/* Listen mode sessions, one v4l2 device each. A phone is routed to the
+ * device mapped to its address, else to the first free one in the order
+ * the devices were given. Every session runs in its own process, since
+ * the decoder keeps one device and frame queue per process.
+ */
+struct session {
+    const char *dev;
+    char peer[16];
+    pid_t pid;
+};
+
+struct session sessions[SESSIONS_MAX];
+int session_count = 0;
+
 extern const char *thread_cmd_val_str;
 extern char snd_device[32];
 extern char v4l2_device[32];
-void * AudioThreadProc(void * args);
-void * VideoThreadProc(void * args);
 void * DecodeThreadProc(void * args);
+void VideoStart(SOCKET s);
+void VideoStop(void);
+int VideoBusy(void);
+void AudioStart(void);
+void AudioStop(void);
+void BatteryStart(void);
+void BatteryStop(void);
+void PhoneRoute(int route, const char *ip);
 
 void sig_handler(__attribute__((__unused__)) int sig) {
     a_running = 0;
@@ -70,11 +99,19 @@ static inline void usage(__attribute__((__unused__)) int argc, char *argv[]) {
     " %s [options] ios <port>\n"
     "   Connect via usbmuxd to iDevice\n"
     "\n"
+    " %s [options] -udid=<udid> ios <port>\n"
+    "   Connect via usbmuxd to the iDevice with the given UDID\n"
+    "\n"
     "Options:\n"
     " -a          Enable Audio\n"
     " -v          Enable Video\n"
     "             (only -v by default)\n"
     "\n"
+    " -boost=PCT  Audio gain in percent, 100 is unchanged (10-800)\n"
+    " -agc        Enable automatic audio gain control\n"
+    "\n"
+    " -latency=P  Audio buffering profile: low (5-10ms periods), normal, robust\n"
+    "\n"
     " -vflip      Apply vertical flip\n"
     " -hflip      Apply horizontal flip\n"
     "\n"
@@ -83,18 +120,57 @@ static inline void usage(__attribute__((__unused__)) int argc, char *argv[]) {
     "\n"
     " -dev=PATH   Specify v4l2loopback device to use, instead of first available.\n"
     "             Ex: -dev=/dev/video5\n"
+    "             With -l, repeat it to serve one phone per device at the same\n"
+    "             time, in the order the phones connect (controls are disabled).\n"
+    "\n"
+    " -map=IP=PATH  With -l, send the phone connecting from IP to this device.\n"
+    "             Ex: -map=192.168.1.20=/dev/video6\n"
     "\n"
     " -size=WxH   Specify video size (when using the regular v4l2loopback module)\n"
     "             Ex: 640x480, 1280x720, 1920x1080\n"
     "\n"
+    " -metrics=ADDR  Serve stream statistics on ADDR, a port on 127.0.0.1\n"
+    "             or a unix socket path. Text by default, JSON for /json.\n"
+    "             Ex: -metrics=9100, -metrics=/run/droidcam.sock\n"
+    "\n"
+    " -log=SPEC   Logging: a level (error, info, debug), rate=N messages per\n"
+    "             second per message (0 for no limit) and json, comma separated.\n"
+    "             Ex: -log=debug,rate=5. Also read from DROIDCAM_LOG.\n"
+    "             SIGUSR2 toggles debug messages while running.\n"
+    "\n"
+    " -trace=FILE Record a timeline of recent pipeline events, written to FILE\n"
+    "             as Chrome trace JSON on SIGUSR1 and at exit (ui.perfetto.dev).\n"
+    "\n"
     ,
     argv[0],
     argv[0],
     argv[0],
     argv[0],
+    argv[0],
     argv[0]);
 }
 
+static int add_session(const char *dev, const char *peer) {
+    if (session_count == SESSIONS_MAX)
+        return -1;
+
+    struct session *sn = &sessions[session_count++];
+    sn->dev = dev;
+    sn->pid = 0;
+    sn->peer[0] = 0;
+    if (peer) {
+        if (strlen(peer) >= sizeof(sn->peer))
+            return -1;
+        strcpy(sn->peer, peer);
+    }
+    return 0;
+}
+
+// several -dev options, or one tied to a phone, make listen mode serve a session per phone
+static inline int several_devices(void) {
+    return session_count > 1 || sessions[0].peer[0];
+}
+
 static void parse_args(int argc, char *argv[]) {
     if (argc >= 3) {
         int i = 1;
@@ -108,6 +184,42 @@ static void parse_args(int argc, char *argv[]) {
                 continue;
             }
 
+            if (strcmp(argv[i], "-agc") == 0) {
+                g_settings.audio_agc = 1;
+                continue;
+            }
+            if (argv[i][0] == '-' && argv[i][1] == 'b' && argv[i][2] == 'o') {
+                if (sscanf(argv[i], "-boost=%d", &g_settings.audio_boost) != 1)
+                    goto ERROR;
+                continue;
+            }
+
+            if (argv[i][0] == '-' && argv[i][1] == 'l' && argv[i][2] == 'a') {
+                if (strncmp(argv[i], "-latency=", 9) != 0
+                    || (g_settings.latency = ParseLatency(&argv[i][9])) < 0)
+                    goto ERROR;
+                continue;
+            }
+
+            if (argv[i][0] == '-' && argv[i][1] == 'l' && argv[i][2] == 'o') {
+                if (strncmp(argv[i], "-log=", 5) != 0 || log_configure(&argv[i][5]) < 0)
+                    goto ERROR;
+                continue;
+            }
+
+            if (argv[i][0] == '-' && argv[i][1] == 't' && argv[i][2] == 'r') {
+                if (strncmp(argv[i], "-trace=", 7) != 0 || argv[i][7] == 0)
+                    goto ERROR;
+                trace_file = &argv[i][7];
+                continue;
+            }
+
+            if (argv[i][0] == '-' && argv[i][1] == 'u' && argv[i][2] == 'd') {
+                if (sscanf(argv[i], "-udid=%47s", g_settings.ios_udid) != 1)
+                    goto ERROR;
+                continue;
+            }
+
             if (argv[i][0] == '-' && argv[i][1] == 'a') {
                 a_running = 1;
                 continue;
@@ -121,7 +233,30 @@ static void parse_args(int argc, char *argv[]) {
                 if (argv[i][4] != '=' || argv[i][5] == 0)
                     goto ERROR;
 
-                v4l2_dev = &argv[i][5];
+                if (!v4l2_dev)
+                    v4l2_dev = &argv[i][5];
+                if (add_session(&argv[i][5], NULL) < 0)
+                    goto ERROR;
+                continue;
+            }
+            if (argv[i][0] == '-' && argv[i][1] == 'm' && argv[i][2] == 'e') {
+                if (strncmp(argv[i], "-metrics=", 9) != 0 || argv[i][9] == 0)
+                    goto ERROR;
+                metrics_addr = &argv[i][9];
+                continue;
+            }
+            if (argv[i][0] == '-' && argv[i][1] == 'm' && argv[i][2] == 'a') {
+                char *dev;
+                if (strncmp(argv[i], "-map=", 5) != 0)
+                    goto ERROR;
+
+                dev = strchr(&argv[i][5], '=');
+                if (!dev || dev[1] == 0)
+                    goto ERROR;
+
+                *dev = 0;
+                if (add_session(dev + 1, &argv[i][5]) < 0)
+                    goto ERROR;
                 continue;
             }
             if (argv[i][0] == '-' && argv[i][1] == 's' && argv[i][3] == 'z') {
@@ -140,6 +275,10 @@ static void parse_args(int argc, char *argv[]) {
             goto ERROR;
 
         if (argv[i][0] == '-' && argv[i][1] == 'l') {
+            if (a_running && several_devices()) {
+                errprint("-a is not supported with several devices, sessions are video only\n");
+                exit(1);
+            }
             g_settings.port = strtoul(argv[i+1], NULL, 10);
             g_settings.connection = CB_WIFI_SRVR;
             a_running = 0;
@@ -171,75 +310,239 @@ ERROR:
     exit(1);
 }
 
-void wait_command() {
-    char buf[1];
-    int flags;
-    ssize_t len;
+static void run_command(char c) {
+    switch(c) {
+        case '?':
+            printf("M: Horizontal Flip / Mirror\n");
+            printf("V: Vertical Flip\n");
+            printf("A: Auto-focus\n");
+            printf("L: Toggle Flash\n");
+            printf("+: Zoom In\n");
+            printf("-: Zoom Out\n");
+            break;
+        case '=':
+        case '+':
+            thread_cmd = CB_CONTROL_ZOOM_IN;
+            break;
+        case '-':
+            thread_cmd = CB_CONTROL_ZOOM_OUT;
+            break;
+        case 'a':
+        case 'A':
+            thread_cmd = CB_CONTROL_AF;
+            break;
+        case 'l':
+        case 'L':
+            thread_cmd = CB_CONTROL_LED;
+            break;
+        case 'm':
+        case 'M':
+            decoder_horizontal_flip();
+            break;
+        case 'v':
+        case 'V':
+            decoder_vertical_flip();
+            break;
+    }
+}
+
+static void on_command(int fd, __attribute__((__unused__)) uint32_t events,
+    __attribute__((__unused__)) void *data)
+{
+    char buf[16];
+    ssize_t len = read(fd, buf, sizeof(buf));
 
-    flags = fcntl(STDIN_FILENO, F_GETFL, 0);
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return;
+
+    if (len <= 0) {
+        reactor_del(fd);
+        return;
+    }
+
+    for (ssize_t i = 0; i < len; i++)
+        run_command(buf[i]);
+}
+
+// nothing to do, just wakes the main loop to see if it should stop
+static void on_tick(__attribute__((__unused__)) int fd,
+    __attribute__((__unused__)) uint32_t events, __attribute__((__unused__)) void *data)
+{
+}
+
+static void wait_command() {
+    int flags = fcntl(STDIN_FILENO, F_GETFL, 0);
     if (flags < 0)
       return;
 
     fcntl(STDIN_FILENO, F_SETFL, flags | O_NONBLOCK);
+    if (reactor_add(STDIN_FILENO, EPOLLIN, on_command, NULL) < 0) {
+        dbgprint("stdin can't be watched: %s\n", strerror(errno));
+    }
+}
 
-    while (v_running) {
-        len = read(STDIN_FILENO, buf, 1);
-        if (len == 0)
-            return;
+static struct session *pick_session(const char *peer) {
+    for (int i = 0; i < session_count; i++) {
+        if (sessions[i].pid == 0 && strcmp(sessions[i].peer, peer) == 0)
+            return &sessions[i];
+    }
+    for (int i = 0; i < session_count; i++) {
+        if (sessions[i].pid == 0 && sessions[i].peer[0] == 0)
+            return &sessions[i];
+    }
+    return NULL;
+}
 
-        if (len < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                usleep(2000);
-                continue;
+static void run_session(SOCKET s, const char *dev) {
+    // the listener and the loop belong to the parent
+    reactor_fini();
+    connection_cleanup();
+    log_start();
+
+    if (!decoder_init(dev, v4l2_width, v4l2_height)) {
+        log_stop();
+        _exit(2);
+    }
+
+    if (g_settings.vertical_flip)
+        decoder_vertical_flip();
+
+    if (g_settings.horizontal_flip)
+        decoder_horizontal_flip();
+
+    if (reactor_init() < 0) {
+        decoder_fini();
+        log_stop();
+        _exit(2);
+    }
+
+    v_running = 1;
+    dthread.rc = pthread_create(&dthread.t, NULL, DecodeThreadProc, NULL);
+    VideoStart(s);
+    while (v_running && VideoBusy())
+        reactor_dispatch(-1);
+    VideoStop();
+
+    v_running = 0;
+    if (dthread.rc == 0) pthread_join(dthread.t, NULL);
+    decoder_fini();
+    reactor_fini();
+    log_stop();
+    _exit(0);
+}
+
+static void on_accept(int fd, __attribute__((__unused__)) uint32_t events,
+    __attribute__((__unused__)) void *data)
+{
+    char peer[16] = {0};
+    SOCKET s;
+
+    while ((s = AcceptClient(fd, peer, sizeof(peer))) != INVALID_SOCKET) {
+        struct session *sn = pick_session(peer);
+        if (!sn) {
+            errprint("%s: no free device, dropping it\n", peer);
+            disconnect(s);
+            continue;
+        }
+
+        pid_t pid = fork();
+        if (pid == 0)
+            run_session(s, sn->dev);
+
+        disconnect(s);
+        if (pid < 0) {
+            errprint("fork() error %d '%s'\n", errno, strerror(errno));
+            continue;
+        }
+
+        sn->pid = pid;
+        errprint("%s: streaming to %s\n", peer, sn->dev);
+    }
+}
+
+static void reap_sessions(__attribute__((__unused__)) int fd,
+    __attribute__((__unused__)) uint32_t events, __attribute__((__unused__)) void *data)
+{
+    pid_t pid;
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+        for (int i = 0; i < session_count; i++) {
+            if (sessions[i].pid == pid) {
+                errprint("%s is free\n", sessions[i].dev);
+                sessions[i].pid = 0;
             }
-            return;
         }
+    }
+}
 
-        switch(buf[0]) {
-            case '?':
-                printf("M: Horizontal Flip / Mirror\n");
-                printf("V: Vertical Flip\n");
-                printf("A: Auto-focus\n");
-                printf("L: Toggle Flash\n");
-                printf("+: Zoom In\n");
-                printf("-: Zoom Out\n");
-                break;
-            case '=':
-            case '+':
-                thread_cmd = CB_CONTROL_ZOOM_IN;
-                break;
-            case '-':
-                thread_cmd = CB_CONTROL_ZOOM_OUT;
-                break;
-            case 'a':
-            case 'A':
-                thread_cmd = CB_CONTROL_AF;
-                break;
-            case 'l':
-            case 'L':
-                thread_cmd = CB_CONTROL_LED;
-                break;
-            case 'm':
-            case 'M':
-                decoder_horizontal_flip();
-                break;
-            case 'v':
-            case 'V':
-                decoder_vertical_flip();
-                break;
+static int listen_sessions(void) {
+    SOCKET server = ListenSocket(g_settings.port);
+    if (server == INVALID_SOCKET)
+        return 1;
+
+    if (reactor_add(server, EPOLLIN, on_accept, NULL) < 0) {
+        errprint("epoll error %d '%s'\n", errno, strerror(errno));
+        return 1;
+    }
+
+    signal(SIGINT, sig_handler);
+    signal(SIGHUP, sig_handler);
+
+    int tick = reactor_timer_add(RUNNING_CHECK_MS, RUNNING_CHECK_MS, reap_sessions, NULL);
+    errprint("waiting on port %d for up to %d phones..\n", g_settings.port, session_count);
+    while (v_running)
+        reactor_dispatch(-1);
+    reactor_timer_del(tick);
+
+    dbgprint("stopping sessions\n");
+    for (int i = 0; i < session_count; i++) {
+        if (sessions[i].pid > 0) {
+            kill(sessions[i].pid, SIGHUP);
+            waitpid(sessions[i].pid, NULL, 0);
         }
     }
+
+    reactor_fini();
+    connection_cleanup();
+    return 0;
 }
 
 int main(int argc, char *argv[]) {
+    char *log_spec = getenv("DROIDCAM_LOG");
+    if (log_spec && log_configure(log_spec) < 0)
+        errprint("DROIDCAM_LOG: can't parse '%s'\n", log_spec);
+
+    g_settings.audio_boost = 100;
     parse_args(argc, argv);
+    log_start();
+    atexit(log_stop);
 
     if (!v_running && !a_running)
         v_running = 1;
 
+    PhoneRoute(g_settings.connection, g_settings.ip);
+    snd_set_latency_profile(g_settings.latency);
+    SetSocketLatencyProfile(g_settings.latency);
+    if (g_settings.connection == CB_WIFI_SRVR && several_devices()) {
+        if (metrics_addr || trace_file)
+            errprint("-metrics and -trace are not supported with several devices, ignoring them\n");
+        if (reactor_init() < 0)
+            return 2;
+        return listen_sessions();
+    }
+
     if (!decoder_init(v4l2_dev, v4l2_width, v4l2_height)) {
         return 2;
     }
+    decoder_set_audio_gain(g_settings.audio_boost, g_settings.audio_agc);
+    if (reactor_init() < 0) {
+        return 2;
+    }
+    if (metrics_addr && metrics_start(metrics_addr) < 0) {
+        return 2;
+    }
+    if (trace_file && trace_start(trace_file) < 0) {
+        return 2;
+    }
 
     printf("Client v" APP_VER_STR "\n");
     if (v_running) {
@@ -273,8 +576,8 @@ int main(int argc, char *argv[]) {
                 }
             }
         }
-        vthread.rc = pthread_create(&vthread.t, NULL, VideoThreadProc, (void*) (SOCKET_PTR) videoSocket);
         dthread.rc = pthread_create(&dthread.t, NULL, DecodeThreadProc, NULL);
+        VideoStart(videoSocket);
     }
 
     if (a_running){
@@ -284,7 +587,7 @@ int main(int argc, char *argv[]) {
                 return 1;
         }
 
-        athread.rc = pthread_create(&athread.t, NULL, AudioThreadProc, NULL);
+        AudioStart();
     }
 
     signal(SIGINT, sig_handler);
@@ -296,19 +599,34 @@ int main(int argc, char *argv[]) {
     if (g_settings.horizontal_flip)
         decoder_horizontal_flip();
 
-    if (!no_controls)
+    // controls are only sent over the video connection
+    if (!no_controls && v_running)
         wait_command();
 
+    // link rtt and battery for the metrics, the phone's address isn't known when listening
+    if (metrics_addr && g_settings.connection != CB_WIFI_SRVR)
+        BatteryStart();
+
+    // signals interrupt the wait right away, the tick covers the running flags
+    int tick = reactor_timer_add(RUNNING_CHECK_MS, RUNNING_CHECK_MS, on_tick, NULL);
     while (v_running || a_running)
-        usleep(2000);
+        reactor_dispatch(-1);
+    reactor_timer_del(tick);
+    if (metrics_addr) {
+        BatteryStop();
+        metrics_stop();
+    }
 
     dbgprint("joining\n");
     sig_handler(SIGHUP);
-    if (athread.rc == 0) pthread_join(athread.t, NULL);
-    if (vthread.rc == 0) pthread_join(vthread.t, NULL);
+    AudioStop();
     if (dthread.rc == 0) pthread_join(dthread.t, NULL);
+    VideoStop();
 
+    trace_stop();
     decoder_fini();
+    iOSUnsubscribe();
+    reactor_fini();
     dbgprint("exit\n");
     return 0;
 }
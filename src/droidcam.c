@@ -13,6 +13,7 @@
 #include <libappindicator/app-indicator.h>
 #endif
 
+#include <glib-unix.h>
 #include <X11/Xlib.h>
 #include <stdint.h>
 
@@ -20,6 +21,7 @@
 #include "settings.h"
 #include "connection.h"
 #include "decoder.h"
+#include "reactor.h"
 
 /* Globals */
 GtkWidget *menu;
@@ -34,10 +36,8 @@ GtkWidget *videoCheckbox;
 GtkEntry * ipEntry;
 GtkEntry * portEntry;
 GtkButton *start_button;
-GThread* hVideoThread;
-GThread* hAudioThread;
 GThread* hDecodeThread;
-GThread* hBatteryThread;
+GThread* hConnectThread;
 
 char *v4l2_dev = 0;
 volatile int a_active = 0;
@@ -52,10 +52,21 @@ extern char snd_device[32];
 extern char v4l2_device[32];
 const char *APP_ICON_FILE = "/opt/droidcam-icon.png";
 
-void * AudioThreadProc(void * args);
-void * VideoThreadProc(void * args);
 void * DecodeThreadProc(void * args);
-void * BatteryThreadProc(void * args);
+void VideoStart(SOCKET s);
+void VideoStop(void);
+void AudioStart(void);
+void AudioStop(void);
+void BatteryStart(void);
+void BatteryStop(void);
+void PhoneRoute(int route, const char *ip);
+SOCKET RaceConnection(struct connect_race *race, const char *ip, int port, int *route);
+
+/* Connection attempt in flight, owned by the UI thread */
+struct connect_race *race;
+SOCKET race_socket = INVALID_SOCKET;
+int race_route;
+char race_ip[16];
 
 const char* wb_options[] = {
 	"Automatic",
@@ -101,6 +112,12 @@ void ShowError(const char* in_title, const char* in_msg) {
 	gdk_threads_add_idle(ShowError_GTK, NULL);
 }
 
+// the reactor shares the GTK main loop, its callbacks run on the UI thread
+static gboolean ReactorReady(gint fd, GIOCondition condition, gpointer data) {
+	reactor_dispatch(0);
+	return G_SOURCE_CONTINUE;
+}
+
 void UpdateBatteryLabel(char *battery_value)  {
 	gtk_label_set_text(GTK_LABEL(batteryText), battery_value);
 }
@@ -109,22 +126,24 @@ static void Stop(void) {
 	a_running = 0;
 	v_running = 0;
 	dbgprint("join\n");
-	if (hVideoThread) {
-		g_thread_join(hVideoThread);
-		hVideoThread = NULL;
-	}
-	if (hAudioThread) {
-		g_thread_join(hAudioThread);
-		hAudioThread = NULL;
+	if (hConnectThread) {
+		ConnectRaceCancel(race);
+		g_thread_join(hConnectThread);
+		hConnectThread = NULL;
+		ConnectRaceRelease(race);
+		race = NULL;
+		if (race_socket != INVALID_SOCKET) {
+			disconnect(race_socket);
+			race_socket = INVALID_SOCKET;
+		}
 	}
+	AudioStop();
 	if (hDecodeThread) {
 		g_thread_join(hDecodeThread);
 		hDecodeThread = NULL;
 	}
-	if (hBatteryThread) {
-		g_thread_join(hBatteryThread);
-		hBatteryThread = NULL;
-	}
+	VideoStop();
+	BatteryStop();
 
 	a_active = 0;
 	v_active = 0;
@@ -134,9 +153,79 @@ static void Stop(void) {
 	UpdateBatteryLabel("");
 }
 
+// video and audio run on the reactor, only decoding has a thread
+static void StartStreams(SOCKET s) {
+	if (g_settings.video) {
+		v_active = 0;
+		v_running = 1;
+		hDecodeThread = g_thread_new(NULL, DecodeThreadProc, NULL);
+		VideoStart(s);
+	} else {
+		disconnect(s);
+	}
+
+	if (g_settings.audio) {
+		a_active = 0;
+		a_running = 1;
+		AudioStart();
+	}
+
+	BatteryStart();
+}
+
+static void SetRunningUI(void) {
+	gtk_button_set_label(start_button, "Stop");
+	gtk_widget_set_sensitive(GTK_WIDGET(ipEntry), FALSE);
+	gtk_widget_set_sensitive(GTK_WIDGET(portEntry), FALSE);
+	gtk_widget_set_sensitive(GTK_WIDGET(audioCheckbox), FALSE);
+	gtk_widget_set_sensitive(GTK_WIDGET(videoCheckbox), FALSE);
+	gtk_widget_set_sensitive(GTK_WIDGET(elButton), TRUE);
+	gtk_widget_set_sensitive(GTK_WIDGET(wbButton), TRUE);
+	gtk_widget_set_sensitive(GTK_WIDGET(menuButton), TRUE);
+}
+
+static gboolean ConnectDone(gpointer data) {
+	int cancelled = atomic_load(&race->cancel);
+
+	g_thread_join(hConnectThread);
+	hConnectThread = NULL;
+	ConnectRaceRelease(race);
+	race = NULL;
+
+	gtk_widget_set_sensitive(GTK_WIDGET(ipEntry), g_settings.connection == CB_RADIO_WIFI);
+	gtk_widget_set_sensitive(GTK_WIDGET(portEntry), TRUE);
+	gtk_widget_set_sensitive(GTK_WIDGET(audioCheckbox), TRUE);
+	gtk_widget_set_sensitive(GTK_WIDGET(videoCheckbox), TRUE);
+
+	if (race_socket == INVALID_SOCKET || cancelled) {
+		if (race_socket != INVALID_SOCKET)
+			disconnect(race_socket);
+		race_socket = INVALID_SOCKET;
+		gtk_button_set_label(start_button, "Connect");
+		return FALSE;
+	}
+
+	// remember the address the user typed in, as before
+	if (g_settings.connection == CB_RADIO_WIFI) {
+		strncpy(g_settings.ip, race_ip, sizeof(g_settings.ip) - 1);
+		g_settings.ip[sizeof(g_settings.ip) - 1] = '\0';
+	}
+
+	// audio and battery follow whichever route won, for this session only
+	PhoneRoute(race_route, race_route == CB_RADIO_ADB ? ADB_LOCALHOST_IP : race_ip);
+	StartStreams(race_socket);
+	race_socket = INVALID_SOCKET;
+	SetRunningUI();
+	return FALSE;
+}
+
+static void *ConnectThreadProc(void *args) {
+	race_socket = RaceConnection(race, race_ip, g_settings.port, &race_route);
+	gdk_threads_add_idle(ConnectDone, NULL);
+	return 0;
+}
+
 static void Start(void) {
-	const char* ip = NULL;
-	SOCKET s = INVALID_SOCKET;
 	int port = strtoul(gtk_entry_get_text(portEntry), NULL, 10);
 
 	if (port <= 0 || port > 65535) {
@@ -146,10 +235,12 @@ static void Start(void) {
 	g_settings.port = port;
 
 	if (g_settings.connection == CB_WIFI_SRVR) {
+		PhoneRoute(CB_WIFI_SRVR, "");
 		v_running = 1;
-		hVideoThread = g_thread_new(NULL, VideoThreadProc, (void*) (SOCKET_PTR) s);
 		hDecodeThread = g_thread_new(NULL, DecodeThreadProc, NULL);
-		goto EARLY_OUT;
+		VideoStart(INVALID_SOCKET);
+		SetRunningUI();
+		return;
 	}
 
 	if (!g_settings.audio && !g_settings.video) {
@@ -157,72 +248,34 @@ static void Start(void) {
 		return;
 	}
 
-	if (g_settings.connection == CB_RADIO_ADB) {
-		int rc = CheckAdbDevices(port);
-		if (rc != NO_ERROR) {
-			AdbErrorPrint(rc);
-			return;
-		}
-		ip = ADB_LOCALHOST_IP;
-	} else if (g_settings.connection == CB_RADIO_IOS) {
-		s = CheckiOSDevices(port);
-		if (s <= 0) {
-			iOSErrorPrint(s);
-			return;
-		}
-	} else if (g_settings.connection == CB_RADIO_WIFI) {
-		ip = (char*)gtk_entry_get_text(ipEntry);
-	} else {
-		MSG_ERROR("Invalid connection mode");
-		return;
-	}
-
-
-	// wifi or USB
-	if (ip != NULL) {
+	if (g_settings.connection == CB_RADIO_WIFI) {
+		const char *ip = gtk_entry_get_text(ipEntry);
 		if (strlen(ip) < 7) {
 			MSG_ERROR("Invalid IP value");
 			return;
 		}
-
-		char *errmsg = NULL;
-		gtk_button_set_label(start_button, "Please wait");
-		s = Connect(ip, port, &errmsg);
-		if (s == INVALID_SOCKET) {
-			gtk_button_set_label(start_button, "Connect");
-			if (errmsg)  MSG_ERROR(errmsg);
-			return;
-		}
-		strncpy(g_settings.ip, ip, sizeof(g_settings.ip) - 1);
-		g_settings.ip[sizeof(g_settings.ip) - 1] = '\0';
-	}
-
-	if (g_settings.video) {
-		v_active = 0;
-		v_running = 1;
-		hVideoThread = g_thread_new(NULL, VideoThreadProc, (void*) (SOCKET_PTR) s);
-		hDecodeThread = g_thread_new(NULL, DecodeThreadProc, NULL);
+		strncpy(race_ip, ip, sizeof(race_ip) - 1);
+	} else if (g_settings.connection == CB_RADIO_ADB || g_settings.connection == CB_RADIO_IOS) {
+		// still race a previously used Wi-Fi address alongside USB
+		strncpy(race_ip, g_settings.ip, sizeof(race_ip) - 1);
 	} else {
-		disconnect(s);
+		MSG_ERROR("Invalid connection mode");
+		return;
 	}
+	race_ip[sizeof(race_ip) - 1] = '\0';
 
-	if (g_settings.audio) {
-                a_active = 0;
-		a_running = 1;
-		hAudioThread = g_thread_new(NULL, AudioThreadProc, NULL);
+	race = ConnectRaceNew();
+	if (!race) {
+		MSG_ERROR("Out of memory");
+		return;
 	}
 
-	hBatteryThread = g_thread_new(NULL, BatteryThreadProc, NULL);
-
-EARLY_OUT:
-	gtk_button_set_label(start_button, "Stop");
+	gtk_button_set_label(start_button, "Cancel");
 	gtk_widget_set_sensitive(GTK_WIDGET(ipEntry), FALSE);
 	gtk_widget_set_sensitive(GTK_WIDGET(portEntry), FALSE);
 	gtk_widget_set_sensitive(GTK_WIDGET(audioCheckbox), FALSE);
 	gtk_widget_set_sensitive(GTK_WIDGET(videoCheckbox), FALSE);
-	gtk_widget_set_sensitive(GTK_WIDGET(elButton), TRUE);
-	gtk_widget_set_sensitive(GTK_WIDGET(wbButton), TRUE);
-	gtk_widget_set_sensitive(GTK_WIDGET(menuButton), TRUE);
+	hConnectThread = g_thread_new(NULL, ConnectThreadProc, NULL);
 }
 
 /* Messages */
@@ -258,6 +311,10 @@ _up:
 	dbgprint("the_callback=%d\n", cb);
 	switch (cb) {
 		case CB_BUTTON:
+			if (race) {
+				ConnectRaceCancel(race);
+				break;
+			}
 			if (v_running || a_running) {
 				Stop();
 				cb = (int)g_settings.connection;
@@ -315,7 +372,7 @@ _up:
 		break;
 	}
 
-	if (text != NULL && v_running == 0){
+	if (text != NULL && v_running == 0 && race == NULL){
 		gtk_button_set_label(start_button, text);
 		gtk_widget_set_sensitive(GTK_WIDGET(ipEntry), ipEdit);
 		gtk_widget_set_sensitive(GTK_WIDGET(portEntry), portEdit);
@@ -462,6 +519,12 @@ int main(int argc, char *argv[])
 	XInitThreads();
 	gtk_init(&argc, &argv);
 
+	char *log_spec = getenv("DROIDCAM_LOG");
+	if (log_spec && log_configure(log_spec) < 0)
+		errprint("DROIDCAM_LOG: can't parse '%s'\n", log_spec);
+	log_start();
+	atexit(log_stop);
+
 	window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
 	gtk_window_set_title(GTK_WINDOW(window), "DroidCam (Classic)");
 	gtk_container_set_border_width(GTK_CONTAINER(window), 1);
@@ -682,6 +745,8 @@ int main(int argc, char *argv[])
 	if (g_settings.video)
 		gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(videoCheckbox), TRUE);
 
+	snd_set_latency_profile(g_settings.latency);
+	SetSocketLatencyProfile(g_settings.latency);
 	if (decoder_init(v4l2_dev, g_settings.v4l2_width, g_settings.v4l2_height))
 	{
 		// add info about devices
@@ -691,6 +756,8 @@ int main(int argc, char *argv[])
 		printf("Video: %s\n", v4l2_device);
 		printf("Audio: %s\n", snd_device);
 
+		decoder_set_audio_gain(g_settings.audio_boost, g_settings.audio_agc);
+
 		// re-load flip values from last run
 		if (g_settings.horizontal_flip)
 			decoder_horizontal_flip();
@@ -709,10 +776,14 @@ int main(int argc, char *argv[])
 		add_indicator(window);
 
 		// main loop
+		if (reactor_init() == 0)
+			g_unix_fd_add(reactor_fd(), G_IO_IN, ReactorReady, NULL);
 		gtk_main();
 		Stop();
 		decoder_fini();
 		connection_cleanup();
+		iOSUnsubscribe();
+		reactor_fini();
 		SaveSettings(&g_settings);
 	}
 
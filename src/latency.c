@@ -0,0 +1,148 @@
+/* DroidCam & DroidCamX (C) 2010-2021
+ * https://github.com/dev47apps
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <stdatomic.h>
+#include <stdio.h>
+
+#include "common.h"
+#include "latency.h"
+#include "trace.h"
+
+#define LAT_SUB_BITS 4
+#define LAT_SUB      (1 << LAT_SUB_BITS)
+#define LAT_LINEAR   (LAT_SUB * 2)
+#define LAT_BUCKETS  (LAT_LINEAR + (31 - LAT_SUB_BITS) * LAT_SUB)
+
+struct lat_hist {
+    atomic_uint_least32_t bucket[LAT_BUCKETS];
+    atomic_uint_least64_t count;
+    atomic_uint_least64_t sum_us;
+    atomic_uint_least32_t max_us;
+};
+
+static struct lat_hist hists[LAT_STAGES];
+static atomic_ulong drops[LAT_DROPS];
+
+static const char *stage_names[LAT_STAGES] = {
+    [LAT_RECV]      = "recv",
+    [LAT_QUEUE]     = "queue",
+    [LAT_TRANSFORM] = "transform",
+    [LAT_DECODE]    = "decode",
+    [LAT_SCALE]     = "scale",
+    [LAT_WRITE]     = "write",
+    [LAT_TOTAL]     = "total",
+};
+
+static const char *drop_names[LAT_DROPS] = {
+    [LAT_DROP_BEHIND]  = "behind",
+    [LAT_DROP_NO_SLOT] = "no_slot",
+    [LAT_DROP_DECODE]  = "decode",
+};
+
+static int lat_bucket(uint32_t us) {
+    if (us < LAT_LINEAR)
+        return us;
+
+    int msb = 31 - __builtin_clz(us);
+    int shift = msb - LAT_SUB_BITS;
+    return LAT_LINEAR + (msb - LAT_SUB_BITS - 1) * LAT_SUB + (int) (us >> shift) - LAT_SUB;
+}
+
+// highest value that lands in the bucket
+static uint32_t lat_bucket_max(int i) {
+    if (i < LAT_LINEAR)
+        return i;
+
+    int shift = (i - LAT_LINEAR) / LAT_SUB + 1;
+    uint64_t sub = (i - LAT_LINEAR) % LAT_SUB + LAT_SUB;
+    return (uint32_t) (((sub + 1) << shift) - 1);
+}
+
+// single writer per stage, a load and a store do instead of a locked add
+#define BUMP(a, n) atomic_store_explicit(&(a), atomic_load_explicit(&(a), memory_order_relaxed) + (n), memory_order_relaxed)
+
+void lat_record(enum lat_stage stage, int64_t us) {
+    struct lat_hist *h = &hists[stage];
+    uint32_t v = us < 0 ? 0 : us > INT32_MAX ? INT32_MAX : (uint32_t) us;
+
+    BUMP(h->bucket[lat_bucket(v)], 1);
+    BUMP(h->count, 1);
+    BUMP(h->sum_us, v);
+    if (v > atomic_load_explicit(&h->max_us, memory_order_relaxed))
+        atomic_store_explicit(&h->max_us, v, memory_order_relaxed);
+
+    // queue and total overlap the work on the decode thread, keep them off its timeline
+    if (stage != LAT_QUEUE && stage != LAT_TOTAL)
+        trace_span(stage_names[stage], lat_now() - v, v);
+}
+
+// drops come from both threads, and rarely
+void lat_drop(enum lat_drop reason) {
+    atomic_fetch_add_explicit(&drops[reason], 1, memory_order_relaxed);
+    trace_instant(drop_names[reason], 0);
+}
+
+unsigned long lat_count(enum lat_stage stage) {
+    return (unsigned long) atomic_load_explicit(&hists[stage].count, memory_order_relaxed);
+}
+
+unsigned long lat_drops(enum lat_drop reason) {
+    return atomic_load_explicit(&drops[reason], memory_order_relaxed);
+}
+
+const char *lat_stage_name(enum lat_stage stage) {
+    return stage_names[stage];
+}
+
+const char *lat_drop_name(enum lat_drop reason) {
+    return drop_names[reason];
+}
+
+void lat_summarize(enum lat_stage stage, struct lat_summary *out) {
+    struct lat_hist *h = &hists[stage];
+    uint32_t snap[LAT_BUCKETS];
+    static const int perc[3] = { 50, 90, 99 };
+    int *pout[3] = { &out->p50_us, &out->p90_us, &out->p99_us };
+    uint64_t total = 0, sum;
+
+    // the bucket total, not h->count, so the percentiles add up
+    for (int i = 0; i < LAT_BUCKETS; i++) {
+        snap[i] = atomic_load_explicit(&h->bucket[i], memory_order_relaxed);
+        total += snap[i];
+    }
+    sum = atomic_load_explicit(&h->sum_us, memory_order_relaxed);
+
+    out->count = (unsigned long) total;
+    out->mean_us = total ? (int) (sum / total) : 0;
+    out->max_us = (int) atomic_load_explicit(&h->max_us, memory_order_relaxed);
+
+    uint64_t seen = 0;
+    int p = 0, i = 0;
+    for (; p < 3; p++) {
+        uint64_t want = (total * perc[p] + 99) / 100;
+        while (i < LAT_BUCKETS - 1 && seen + snap[i] < want)
+            seen += snap[i++];
+        *pout[p] = total ? (int) lat_bucket_max(i) : 0;
+        if (*pout[p] > out->max_us)
+            *pout[p] = out->max_us;
+    }
+}
+
+void lat_report(void) {
+    struct lat_summary s;
+
+    for (int i = 0; i < LAT_STAGES; i++) {
+        lat_summarize(i, &s);
+        if (s.count == 0)
+            continue;
+        infoprint("video %-9s: %lu frames, mean %dus, p50 %dus, p90 %dus, p99 %dus, max %dus\n",
+            stage_names[i], s.count, s.mean_us, s.p50_us, s.p90_us, s.p99_us, s.max_us);
+    }
+    infoprint("video drops: %lu behind, %lu no slot, %lu undecodable\n",
+        lat_drops(LAT_DROP_BEHIND), lat_drops(LAT_DROP_NO_SLOT), lat_drops(LAT_DROP_DECODE));
+}
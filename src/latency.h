@@ -0,0 +1,65 @@
+/* DroidCam & DroidCamX (C) 2010-2021
+ * https://github.com/dev47apps
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __LATENCY_H__
+#define __LATENCY_H__
+
+#include <stdint.h>
+#include <time.h>
+
+/* Where a video frame's time goes, one histogram per pipeline stage.
+ * There is one writer per stage: LAT_RECV is recorded on the reactor
+ * thread, where the stream is received, and every other stage on the
+ * decode thread. Recording is a couple of relaxed stores and never takes
+ * a lock. Readers can look at any time and see a slightly stale but
+ * consistent enough picture.
+ *
+ * Buckets are log-linear: exact below 32us, then 16 per power of two
+ * (about 6% resolution), up to 2^31us.
+ */
+enum lat_stage {
+    LAT_RECV,       // frame header to payload received
+    LAT_QUEUE,      // waiting for the decode thread
+    LAT_TRANSFORM,  // tjTransform (flip / rotation)
+    LAT_DECODE,     // tjDecompressToYUVPlanes
+    LAT_SCALE,      // sws_scale or chroma downsampling
+    LAT_WRITE,      // write() to the v4l2 device
+    LAT_TOTAL,      // frame header to the frame written out
+    LAT_STAGES
+};
+
+enum lat_drop {
+    LAT_DROP_BEHIND,  // decode queue over its limit
+    LAT_DROP_NO_SLOT, // no free receive slot left
+    LAT_DROP_DECODE,  // frame didn't decode
+    LAT_DROPS
+};
+
+struct lat_summary {
+    unsigned long count;
+    int mean_us;
+    int p50_us, p90_us, p99_us, max_us;
+};
+
+static inline int64_t lat_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void lat_record(enum lat_stage stage, int64_t us);
+void lat_drop(enum lat_drop reason);
+
+const char *lat_stage_name(enum lat_stage stage);
+const char *lat_drop_name(enum lat_drop reason);
+void lat_summarize(enum lat_stage stage, struct lat_summary *out);
+unsigned long lat_count(enum lat_stage stage);
+unsigned long lat_drops(enum lat_drop reason);
+void lat_report(void);
+
+#endif
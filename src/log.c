@@ -0,0 +1,410 @@
+/* DroidCam & DroidCamX (C) 2010-2021
+ * https://github.com/dev47apps
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if __linux__
+#include <sys/syscall.h>
+#define LOG_CLOCK_COARSE CLOCK_MONOTONIC_COARSE
+#endif
+
+#if __FreeBSD__
+#include <pthread_np.h>
+#define LOG_CLOCK_COARSE CLOCK_MONOTONIC_FAST
+#endif
+
+#include "common.h"
+#include "log.h"
+
+struct log_record {
+    int64_t ts_us; // realtime
+    int level;
+    int len;
+    char text[LOG_MSG_MAX];
+};
+
+/* Single producer (the owning thread), single consumer (the drain
+ * thread). A ring whose thread exited is handed to the next new thread
+ * once the drain emptied it.
+ */
+struct log_ring {
+    struct log_record rec[LOG_RING_SIZE];
+    atomic_size_t head;
+    atomic_size_t tail;
+    atomic_int owned;
+    atomic_ulong dropped;
+    int tid;
+};
+
+#ifdef DEBUG
+#define LOG_DEFAULT LL_DEBUG
+#else
+#define LOG_DEFAULT LL_INFO
+#endif
+
+volatile int log_level = LOG_DEFAULT;
+
+static int base_level = LOG_DEFAULT;
+static atomic_int rate = LOG_RATE;
+static int json;
+
+static _Atomic(struct log_ring *) rings[LOG_RINGS];
+static __thread struct log_ring *my_ring;
+static pthread_key_t ring_key;
+static pthread_t drain_thread;
+static atomic_int draining;
+static atomic_int drain_stop;
+
+/* The drain thread sleeps on drain_wake once every ring is empty, with
+ * drain_idle set. Writers only look at the flag, the first one to push
+ * after it was set takes the lock and wakes the thread.
+ */
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t drain_wake = PTHREAD_COND_INITIALIZER;
+static atomic_int drain_idle;
+
+static const char *level_names[] = {
+    [LL_ERROR] = "error",
+    [LL_INFO]  = "info",
+    [LL_DEBUG] = "debug",
+};
+
+static void ring_release(void *ring) {
+    atomic_store_explicit(&((struct log_ring*) ring)->owned, 0, memory_order_release);
+}
+
+static struct log_ring *ring_get(void) {
+    struct log_ring *ring = my_ring;
+    if (ring)
+        return ring;
+
+    for (int i = 0; i < LOG_RINGS; i++) {
+        ring = atomic_load_explicit(&rings[i], memory_order_acquire);
+        if (!ring) {
+            struct log_ring *fresh = calloc(1, sizeof(*fresh));
+            if (!fresh)
+                return NULL;
+            fresh->owned = 1;
+            if (atomic_compare_exchange_strong(&rings[i], &ring, fresh)) {
+                ring = fresh;
+                goto claimed;
+            }
+            free(fresh);
+        }
+
+        // left over from a thread that exited
+        int was = 0;
+        if (atomic_load(&ring->head) == atomic_load(&ring->tail)
+            && atomic_compare_exchange_strong(&ring->owned, &was, 1))
+            goto claimed;
+    }
+    return NULL;
+
+claimed:
+    ring->tid = log_tid();
+    my_ring = ring;
+    pthread_setspecific(ring_key, ring);
+    return ring;
+}
+
+int log_tid(void) {
+#if __FreeBSD__
+    return pthread_getthreadid_np();
+#else
+    return (int) syscall(SYS_gettid);
+#endif
+}
+
+static int64_t realtime_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// returns 0 to drop the message, else 1 plus how many were dropped before it
+static int rate_check(struct log_site *site, int *suppressed) {
+    struct timespec ts;
+    int limit = atomic_load_explicit(&rate, memory_order_relaxed);
+
+    *suppressed = 0;
+    if (limit <= 0)
+        return 1;
+
+    clock_gettime(LOG_CLOCK_COARSE, &ts);
+    long window = atomic_load_explicit(&site->window, memory_order_relaxed);
+    if (window != ts.tv_sec) {
+        // racy across threads, an off by a few count is fine here
+        atomic_store_explicit(&site->window, ts.tv_sec, memory_order_relaxed);
+        atomic_store_explicit(&site->count, 0, memory_order_relaxed);
+        *suppressed = atomic_exchange_explicit(&site->suppressed, 0, memory_order_relaxed);
+    }
+
+    if (atomic_fetch_add_explicit(&site->count, 1, memory_order_relaxed) >= limit) {
+        atomic_fetch_add_explicit(&site->suppressed, 1, memory_order_relaxed);
+        return 0;
+    }
+    return 1;
+}
+
+static void emit(int64_t ts_us, int level, int tid, const char *text, int len) {
+    if (!json) {
+        fwrite(text, 1, len, stderr);
+        return;
+    }
+
+    // one object per line, the message without its trailing newline
+    fprintf(stderr, "{\"ts\":%lld.%06lld,\"level\":\"%s\",\"thread\":%d,\"msg\":\"",
+        (long long) (ts_us / 1000000), (long long) (ts_us % 1000000), level_names[level], tid);
+    for (int i = 0; i < len; i++) {
+        unsigned char c = text[i];
+        if (c == '\n' && i == len - 1)
+            break;
+        if (c == '"' || c == '\\')
+            fprintf(stderr, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(stderr, "\\u%04x", c);
+        else
+            fputc(c, stderr);
+    }
+    fputs("\"}\n", stderr);
+}
+
+void log_write(struct log_site *site, int level, const char *fmt, ...) {
+    char text[LOG_MSG_MAX];
+    struct log_ring *ring = NULL;
+    int suppressed, len;
+    va_list ap;
+
+    if (!rate_check(site, &suppressed))
+        return;
+
+    va_start(ap, fmt);
+    len = vsnprintf(text, sizeof(text), fmt, ap);
+    va_end(ap);
+    if (len >= (int) sizeof(text))
+        len = sizeof(text) - 1;
+    if (len < 0)
+        return;
+
+    if (suppressed > 0) {
+        char note[64];
+        int n = snprintf(note, sizeof(note), "(%d similar messages suppressed)\n", suppressed);
+        if (len > 0 && text[len - 1] != '\n' && len < (int) sizeof(text) - 1)
+            text[len++] = '\n';
+        if (len + n < (int) sizeof(text)) {
+            memcpy(&text[len], note, n + 1);
+            len += n;
+        }
+    }
+
+    if (atomic_load_explicit(&draining, memory_order_acquire))
+        ring = ring_get();
+
+    if (!ring) {
+        emit(realtime_us(), level, log_tid(), text, len);
+        return;
+    }
+
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail == LOG_RING_SIZE) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    struct log_record *r = &ring->rec[head & (LOG_RING_SIZE - 1)];
+    r->ts_us = realtime_us();
+    r->level = level;
+    r->len = len;
+    memcpy(r->text, text, len);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+    // pairs with the drain thread setting drain_idle, then looking at the rings
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&drain_idle, memory_order_relaxed)
+        && atomic_exchange(&drain_idle, 0))
+    {
+        pthread_mutex_lock(&drain_lock);
+        pthread_cond_signal(&drain_wake);
+        pthread_mutex_unlock(&drain_lock);
+    }
+}
+
+// writes out everything queued, oldest first across the rings
+static int drain_once(void) {
+    int written = 0;
+
+    for (;;) {
+        struct log_ring *next = NULL;
+        int64_t next_ts = 0;
+
+        for (int i = 0; i < LOG_RINGS; i++) {
+            struct log_ring *ring = atomic_load_explicit(&rings[i], memory_order_acquire);
+            if (!ring)
+                continue;
+
+            unsigned long dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+            if (dropped)
+                fprintf(stderr, "log: %lu messages dropped\n", dropped);
+
+            size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+            if (tail == atomic_load_explicit(&ring->head, memory_order_acquire))
+                continue;
+
+            int64_t ts = ring->rec[tail & (LOG_RING_SIZE - 1)].ts_us;
+            if (!next || ts < next_ts) {
+                next = ring;
+                next_ts = ts;
+            }
+        }
+
+        if (!next)
+            break;
+
+        size_t tail = atomic_load_explicit(&next->tail, memory_order_relaxed);
+        struct log_record *r = &next->rec[tail & (LOG_RING_SIZE - 1)];
+        emit(r->ts_us, r->level, next->tid, r->text, r->len);
+        atomic_store_explicit(&next->tail, tail + 1, memory_order_release);
+        written++;
+    }
+
+    if (written)
+        fflush(stderr);
+    return written;
+}
+
+static int rings_empty(void) {
+    for (int i = 0; i < LOG_RINGS; i++) {
+        struct log_ring *ring = atomic_load(&rings[i]);
+        if (ring && atomic_load(&ring->head) != atomic_load(&ring->tail))
+            return 0;
+    }
+    return 1;
+}
+
+static void *DrainThreadProc(__attribute__((__unused__)) void *args) {
+    while (!atomic_load(&drain_stop)) {
+        if (drain_once() > 0)
+            continue;
+
+        pthread_mutex_lock(&drain_lock);
+        atomic_store(&drain_idle, 1);
+        // a record pushed before the flag was visible didn't wake us, look again
+        while (atomic_load(&drain_idle) && !atomic_load(&drain_stop) && rings_empty())
+            pthread_cond_wait(&drain_wake, &drain_lock);
+        atomic_store(&drain_idle, 0);
+        pthread_mutex_unlock(&drain_lock);
+    }
+    drain_once();
+    return 0;
+}
+
+static void on_sigusr2(__attribute__((__unused__)) int sig) {
+    log_level = (log_level == LL_DEBUG) ? base_level : LL_DEBUG;
+}
+
+/* The drain thread doesn't survive a fork, write directly until restarted.
+ * Whatever the parent had queued is the parent's to write out, the child
+ * starts with every ring empty and free.
+ */
+static void after_fork(void) {
+    atomic_store(&draining, 0);
+    atomic_store(&drain_idle, 0);
+    pthread_mutex_init(&drain_lock, NULL);
+    pthread_cond_init(&drain_wake, NULL);
+    my_ring = NULL;
+
+    for (int i = 0; i < LOG_RINGS; i++) {
+        struct log_ring *ring = atomic_load(&rings[i]);
+        if (!ring)
+            continue;
+        atomic_store(&ring->tail, atomic_load(&ring->head));
+        atomic_store(&ring->dropped, 0);
+        atomic_store(&ring->owned, 0);
+    }
+}
+
+/* spec is a comma separated list: a level (error, info, debug),
+ * "rate=N" messages per second per call site (0 for no limit), "json".
+ * Returns -1 on anything else.
+ */
+int log_configure(const char *spec) {
+    char buf[64];
+    char *tok, *save;
+
+    if (strlen(spec) >= sizeof(buf))
+        return -1;
+    strcpy(buf, spec);
+
+    for (tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        int level = -1;
+        for (int i = 0; i < (int) ARRAY_LEN(level_names); i++) {
+            if (strcmp(tok, level_names[i]) == 0)
+                level = i;
+        }
+
+        if (level >= 0) {
+            base_level = level;
+            log_level = level;
+        }
+        else if (strncmp(tok, "rate=", 5) == 0 && tok[5] >= '0' && tok[5] <= '9')
+            atomic_store(&rate, atoi(&tok[5]));
+        else if (strcmp(tok, "json") == 0)
+            json = 1;
+        else
+            return -1;
+    }
+
+    return 0;
+}
+
+void log_start(void) {
+    static int once;
+    struct sigaction sa;
+
+    if (!once) {
+        once = 1;
+        pthread_key_create(&ring_key, ring_release);
+        pthread_atfork(NULL, NULL, after_fork);
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = on_sigusr2;
+        sa.sa_flags = SA_RESTART;
+        sigaction(SIGUSR2, &sa, NULL);
+    }
+
+    if (atomic_load(&draining))
+        return;
+
+    atomic_store(&drain_stop, 0);
+    if (pthread_create(&drain_thread, NULL, DrainThreadProc, NULL) != 0)
+        return;
+    atomic_store_explicit(&draining, 1, memory_order_release);
+}
+
+// back to direct writes, with everything queued written out
+void log_stop(void) {
+    if (!atomic_load(&draining))
+        return;
+
+    atomic_store(&draining, 0);
+    pthread_mutex_lock(&drain_lock);
+    atomic_store(&drain_stop, 1);
+    pthread_cond_signal(&drain_wake);
+    pthread_mutex_unlock(&drain_lock);
+    pthread_join(drain_thread, NULL);
+}
@@ -0,0 +1,59 @@
+/* DroidCam & DroidCamX (C) 2010-2021
+ * https://github.com/dev47apps
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include <stdatomic.h>
+
+/* Logging that stays off the stream threads' critical path. Messages
+ * are formatted into a per-thread ring and written out by a background
+ * thread, a full ring drops instead of blocking. Each call site is rate
+ * limited on its own, so a stream going bad logs a few lines a second
+ * rather than one per frame. The level and the rate can change at any
+ * time: log_configure(), or SIGUSR2 to toggle debug messages.
+ *
+ * Before log_start() (and in forked children) messages go straight to
+ * stderr, as they always did.
+ */
+enum log_level {
+    LL_ERROR,
+    LL_INFO,
+    LL_DEBUG,
+};
+
+#define LOG_RINGS      16
+#define LOG_RING_SIZE  64  /* records per thread, power of 2 */
+#define LOG_MSG_MAX    240
+#define LOG_RATE       20  /* messages per second per call site, default */
+
+struct log_site {
+    atomic_long window;   // second the count is for
+    atomic_int count;
+    atomic_int suppressed;
+};
+
+extern volatile int log_level;
+
+#define LOG_AT(lvl, ...) do { \
+    static struct log_site _log_site; \
+    if ((lvl) <= log_level) \
+        log_write(&_log_site, (lvl), __VA_ARGS__); \
+} while (0)
+
+void log_write(struct log_site *site, int level, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+/* Kernel thread id of the caller, as ps and gdb show it. */
+int  log_tid(void);
+
+int  log_configure(const char *spec);
+void log_start(void);
+void log_stop(void);
+
+#endif
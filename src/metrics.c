@@ -0,0 +1,313 @@
+/* DroidCam & DroidCamX (C) 2010-2021
+ * https://github.com/dev47apps
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "connection.h"
+#include "decoder.h"
+#include "latency.h"
+#include "metrics.h"
+#include "reactor.h"
+
+#define SAMPLE_MS 1000
+
+extern volatile int v_active;
+extern volatile int a_active;
+extern struct udp_stream_stats audio_udp_stats;
+extern unsigned long video_reconnects;
+int StatusRttMs(void);
+int StatusBattery(void);
+
+struct metrics_client {
+    SOCKET sock;
+    int got;
+    int age_s;
+    char req[METRICS_REQ_MAX];
+};
+
+static struct {
+    SOCKET server;
+    int timer;
+    char *path; // unix socket to remove on stop
+
+    // frame counters at the last sample, for the rates
+    int64_t sample_us;
+    unsigned long frames_in, frames_out;
+    double fps_in, fps_out;
+
+    struct metrics_client clients[METRICS_CLIENTS];
+} metrics = { .server = INVALID_SOCKET, .timer = -1 };
+
+struct reply {
+    char buf[METRICS_REPLY_MAX];
+    int len;
+};
+
+static void put(struct reply *r, const char *fmt, ...) {
+    va_list ap;
+    int room = sizeof(r->buf) - r->len;
+    if (room <= 1)
+        return;
+
+    va_start(ap, fmt);
+    int n = vsnprintf(r->buf + r->len, room, fmt, ap);
+    va_end(ap);
+    r->len += (n < room) ? n : room - 1;
+}
+
+struct snapshot {
+    int video, audio;
+    struct lat_summary stage[LAT_STAGES];
+    unsigned long drops[LAT_DROPS];
+    unsigned long underruns, recoveries;
+    int staged_ms;
+    int rtt_ms, battery;
+};
+
+static void take_snapshot(struct snapshot *s) {
+    s->video = v_active;
+    s->audio = a_active;
+    for (int i = 0; i < LAT_STAGES; i++)
+        lat_summarize(i, &s->stage[i]);
+    for (int i = 0; i < LAT_DROPS; i++)
+        s->drops[i] = lat_drops(i);
+    snd_get_xruns(&s->underruns, &s->recoveries);
+    s->staged_ms = decoder_audio_staged() * DROIDCAM_CHUNK_MS_2 / DROIDCAM_PCM_CHUNK_SAMPLES_2;
+    s->rtt_ms = StatusRttMs();
+    s->battery = StatusBattery();
+}
+
+static void format_text(struct reply *r, struct snapshot *s) {
+    put(r, "droidcam_video_active %d\n", s->video);
+    put(r, "droidcam_video_fps_in %.1f\n", metrics.fps_in);
+    put(r, "droidcam_video_fps_out %.1f\n", metrics.fps_out);
+    put(r, "droidcam_video_frames_in_total %lu\n", lat_count(LAT_RECV));
+    put(r, "droidcam_video_frames_out_total %lu\n", lat_count(LAT_WRITE));
+    put(r, "droidcam_video_reconnects_total %lu\n", video_reconnects);
+    for (int i = 0; i < LAT_DROPS; i++)
+        put(r, "droidcam_video_drops_total{reason=\"%s\"} %lu\n", lat_drop_name(i), s->drops[i]);
+
+    for (int i = 0; i < LAT_STAGES; i++) {
+        const char *name = lat_stage_name(i);
+        struct lat_summary *l = &s->stage[i];
+        put(r, "droidcam_video_stage_us{stage=\"%s\",quantile=\"0.5\"} %d\n", name, l->p50_us);
+        put(r, "droidcam_video_stage_us{stage=\"%s\",quantile=\"0.9\"} %d\n", name, l->p90_us);
+        put(r, "droidcam_video_stage_us{stage=\"%s\",quantile=\"0.99\"} %d\n", name, l->p99_us);
+        put(r, "droidcam_video_stage_us{stage=\"%s\",quantile=\"1\"} %d\n", name, l->max_us);
+        put(r, "droidcam_video_stage_us_count{stage=\"%s\"} %lu\n", name, l->count);
+    }
+
+    put(r, "droidcam_audio_active %d\n", s->audio);
+    put(r, "droidcam_audio_underruns_total %lu\n", s->underruns);
+    put(r, "droidcam_audio_xrun_recoveries_total %lu\n", s->recoveries);
+    put(r, "droidcam_audio_staged_ms %d\n", s->staged_ms);
+    put(r, "droidcam_audio_jitter_us %d\n", audio_udp_stats.jitter_us);
+    put(r, "droidcam_audio_packets_total %lu\n", audio_udp_stats.packets);
+    put(r, "droidcam_audio_lost_total %lu\n", audio_udp_stats.lost);
+    put(r, "droidcam_audio_late_total %lu\n", audio_udp_stats.late);
+
+    put(r, "droidcam_link_rtt_ms %d\n", s->rtt_ms);
+    put(r, "droidcam_battery_percent %d\n", s->battery);
+}
+
+static void format_json(struct reply *r, struct snapshot *s) {
+    put(r, "{\"video\":{\"active\":%d,\"fps_in\":%.1f,\"fps_out\":%.1f,"
+        "\"frames_in\":%lu,\"frames_out\":%lu,\"reconnects\":%lu,\"drops\":{",
+        s->video, metrics.fps_in, metrics.fps_out,
+        lat_count(LAT_RECV), lat_count(LAT_WRITE), video_reconnects);
+    for (int i = 0; i < LAT_DROPS; i++)
+        put(r, "%s\"%s\":%lu", i ? "," : "", lat_drop_name(i), s->drops[i]);
+
+    put(r, "},\"stages\":{");
+    for (int i = 0; i < LAT_STAGES; i++) {
+        struct lat_summary *l = &s->stage[i];
+        put(r, "%s\"%s\":{\"count\":%lu,\"mean_us\":%d,\"p50_us\":%d,\"p90_us\":%d,\"p99_us\":%d,\"max_us\":%d}",
+            i ? "," : "", lat_stage_name(i), l->count, l->mean_us, l->p50_us, l->p90_us, l->p99_us, l->max_us);
+    }
+
+    put(r, "}},\"audio\":{\"active\":%d,\"underruns\":%lu,\"xrun_recoveries\":%lu,"
+        "\"staged_ms\":%d,\"jitter_us\":%d,\"packets\":%lu,\"lost\":%lu,\"late\":%lu},",
+        s->audio, s->underruns, s->recoveries, s->staged_ms, audio_udp_stats.jitter_us,
+        audio_udp_stats.packets, audio_udp_stats.lost, audio_udp_stats.late);
+    put(r, "\"link\":{\"rtt_ms\":%d,\"battery_percent\":%d}}\n", s->rtt_ms, s->battery);
+}
+
+/* Never blocks the loop, and a scraper hanging up early mustn't raise
+ * SIGPIPE. The reply fits the socket buffer of a fresh local connection.
+ */
+static void client_send(struct metrics_client *c, struct reply *r) {
+    if (send(c->sock, r->buf, r->len, MSG_NOSIGNAL | MSG_DONTWAIT) != r->len) {
+        dbgprint("metrics: short reply\n");
+    }
+}
+
+static void client_close(struct metrics_client *c) {
+    reactor_del(c->sock);
+    disconnect(c->sock);
+    c->sock = INVALID_SOCKET;
+}
+
+static void client_reply(struct metrics_client *c) {
+    static struct reply body, head;
+    struct snapshot s;
+    int http = strncmp(c->req, "GET ", 4) == 0;
+    char *eol = strpbrk(c->req, "\r\n");
+    if (eol)
+        *eol = 0;
+
+    take_snapshot(&s);
+    body.len = 0;
+    if (strstr(c->req, "json"))
+        format_json(&body, &s);
+    else
+        format_text(&body, &s);
+
+    head.len = 0;
+    if (http) {
+        put(&head, "HTTP/1.0 200 OK\r\nContent-Type: %s\r\nContent-Length: %d\r\nConnection: close\r\n\r\n",
+            strstr(c->req, "json") ? "application/json" : "text/plain; version=0.0.4", body.len);
+        client_send(c, &head);
+    }
+    client_send(c, &body);
+    client_close(c);
+}
+
+static void on_client(__attribute__((__unused__)) int fd, __attribute__((__unused__)) uint32_t events, void *data) {
+    struct metrics_client *c = data;
+    int closed = 0;
+
+    while (c->got < METRICS_REQ_MAX - 1) {
+        int r = RecvNonBlock(c->req + c->got, METRICS_REQ_MAX - 1 - c->got, c->sock);
+        if (r > 0) {
+            c->got += r;
+            continue;
+        }
+        closed = (r < 0);
+        break;
+    }
+    c->req[c->got] = 0;
+
+    // http asks once the headers are in, a bare request once its line is
+    int http = c->got >= 4 && strncmp(c->req, "GET ", 4) == 0;
+    if (closed || c->got == METRICS_REQ_MAX - 1
+        || (http ? strstr(c->req, "\r\n\r\n") != NULL : strchr(c->req, '\n') != NULL))
+    {
+        client_reply(c);
+    }
+}
+
+static void on_accept(int fd, __attribute__((__unused__)) uint32_t events,
+    __attribute__((__unused__)) void *data)
+{
+    SOCKET s;
+
+    while ((s = AcceptClient(fd, NULL, 0)) != INVALID_SOCKET) {
+        struct metrics_client *c = NULL;
+        for (int i = 0; i < METRICS_CLIENTS; i++) {
+            if (metrics.clients[i].sock == INVALID_SOCKET) {
+                c = &metrics.clients[i];
+                break;
+            }
+        }
+
+        if (!c || reactor_add(s, EPOLLIN | EPOLLRDHUP, on_client, c) < 0) {
+            dbgprint("metrics: dropping a client\n");
+            disconnect(s);
+            continue;
+        }
+
+        c->sock = s;
+        c->got = 0;
+        c->age_s = 0;
+    }
+}
+
+static void on_sample(__attribute__((__unused__)) int fd,
+    __attribute__((__unused__)) uint32_t events, __attribute__((__unused__)) void *data)
+{
+    int64_t now = lat_now();
+    unsigned long in = lat_count(LAT_RECV);
+    unsigned long out = lat_count(LAT_WRITE);
+    double secs = (now - metrics.sample_us) / 1000000.0;
+
+    if (metrics.sample_us && secs > 0) {
+        metrics.fps_in = (in - metrics.frames_in) / secs;
+        metrics.fps_out = (out - metrics.frames_out) / secs;
+    }
+    metrics.sample_us = now;
+    metrics.frames_in = in;
+    metrics.frames_out = out;
+
+    for (int i = 0; i < METRICS_CLIENTS; i++) {
+        struct metrics_client *c = &metrics.clients[i];
+        if (c->sock != INVALID_SOCKET && ++c->age_s > METRICS_TIMEOUT_S)
+            client_close(c);
+    }
+}
+
+/* addr is a port on 127.0.0.1 or a unix socket path. The reactor has
+ * to be set up already.
+ */
+int metrics_start(const char *addr) {
+    for (int i = 0; i < METRICS_CLIENTS; i++)
+        metrics.clients[i].sock = INVALID_SOCKET;
+
+    metrics.server = ListenLocal(addr);
+    if (metrics.server == INVALID_SOCKET)
+        return -1;
+
+    if (reactor_add(metrics.server, EPOLLIN, on_accept, NULL) < 0) {
+        errprint("epoll error %d '%s'\n", errno, strerror(errno));
+        goto fail;
+    }
+
+    metrics.timer = reactor_timer_add(SAMPLE_MS, SAMPLE_MS, on_sample, NULL);
+    if (metrics.timer < 0) {
+        reactor_del(metrics.server);
+        goto fail;
+    }
+
+    if (strchr(addr, '/'))
+        metrics.path = strdup(addr);
+    infoprint("metrics on %s\n", addr);
+    return 0;
+
+fail:
+    disconnect(metrics.server);
+    metrics.server = INVALID_SOCKET;
+    return -1;
+}
+
+void metrics_stop(void) {
+    if (metrics.server == INVALID_SOCKET)
+        return;
+
+    for (int i = 0; i < METRICS_CLIENTS; i++) {
+        if (metrics.clients[i].sock != INVALID_SOCKET)
+            client_close(&metrics.clients[i]);
+    }
+
+    reactor_timer_del(metrics.timer);
+    metrics.timer = -1;
+    reactor_del(metrics.server);
+    disconnect(metrics.server);
+    metrics.server = INVALID_SOCKET;
+
+    if (metrics.path) {
+        unlink(metrics.path);
+        free(metrics.path);
+        metrics.path = NULL;
+    }
+}
@@ -0,0 +1,27 @@
+/* DroidCam & DroidCamX (C) 2010-2021
+ * https://github.com/dev47apps
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+/* Read-only stats endpoint, served from the reactor loop. Each
+ * connection gets one snapshot and is closed:
+ *   curl http://127.0.0.1:PORT/            text, Prometheus format
+ *   curl http://127.0.0.1:PORT/json        JSON
+ *   curl --unix-socket PATH http://x/json  same, over a unix socket
+ *   echo json | nc -U PATH                 a bare line works too
+ */
+#define METRICS_CLIENTS   4
+#define METRICS_REQ_MAX   1024
+#define METRICS_REPLY_MAX 8192
+#define METRICS_TIMEOUT_S 5
+
+int  metrics_start(const char *addr);
+void metrics_stop(void);
+
+#endif
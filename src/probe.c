@@ -0,0 +1,487 @@
+/* DroidCam & DroidCamX (C) 2010-2021
+ * https://github.com/dev47apps
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/* Glass-to-glass latency probe.
+ *
+ * Stands in for the phone: serves a synthetic stream whose frames carry
+ * their number and the time they were made, drawn as a grid of black and
+ * white cells, while reading the loopback device back and decoding the
+ * grid off every new frame. The latency is from making the frame (before
+ * its JPEG encode) to it being readable on the device, so it covers the
+ * network and everything droidcam-cli does in between.
+ *
+ *   droidcam-probe 4747 /dev/video0 &
+ *   droidcam-cli -nocontrols 127.0.0.1 4747
+ *
+ * The cells scale with the frame, a -size on the client is fine. Flips
+ * are not, they move the cells around.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/videodev2.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <turbojpeg.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "connection.h"
+
+#define GRID           8   /* cells per side, one bit each */
+#define QUALITY        80
+#define FPS_DEFAULT    30
+#define FRAMES_DEFAULT 600
+#define ACCEPT_POLL_MS 250
+#define FORMAT_POLL_MS 200
+
+#define WIDTH_DEFAULT  640
+#define HEIGHT_DEFAULT 480
+
+#define Y_BLACK 16
+#define Y_WHITE 235
+
+static struct {
+    int port;
+    int width, height; // 0 for what the client asks for
+    int fps;
+    int frames;
+    const char *device;
+} opt = { .fps = FPS_DEFAULT, .frames = FRAMES_DEFAULT };
+
+static volatile int running = 1;
+
+static int64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* 64 bits: frame number (16), low 32 bits of the monotonic clock in us,
+ * and a 16 bit check so the client's own test image, or a frame torn by
+ * the scaler, doesn't decode as a sample.
+ */
+static uint16_t pattern_check(uint16_t seq, uint32_t ts) {
+    return (uint16_t) ((seq * 0x9E37u) ^ ts ^ (ts >> 16) ^ 0xA5C3u);
+}
+
+static uint64_t pattern_pack(uint16_t seq, uint32_t ts) {
+    return (uint64_t) seq | (uint64_t) ts << 16 | (uint64_t) pattern_check(seq, ts) << 48;
+}
+
+static int pattern_unpack(uint64_t bits, uint16_t *seq, uint32_t *ts) {
+    *seq = (uint16_t) bits;
+    *ts = (uint32_t) (bits >> 16);
+    return (uint16_t) (bits >> 48) == pattern_check(*seq, *ts);
+}
+
+static void pattern_draw(uint8_t *y, int w, int h, uint64_t bits) {
+    for (int j = 0; j < h; j++) {
+        int row = j * GRID / h;
+        uint8_t *line = y + (size_t) j * w;
+        for (int col = 0; col < GRID; col++) {
+            int x0 = col * w / GRID;
+            int x1 = (col + 1) * w / GRID;
+            int bit = (bits >> (row * GRID + col)) & 1;
+            memset(line + x0, bit ? Y_WHITE : Y_BLACK, x1 - x0);
+        }
+    }
+}
+
+// averages the middle of each cell, clear of the blurred edges
+static uint64_t pattern_read(const uint8_t *y, int stride, int w, int h) {
+    uint64_t bits = 0;
+
+    for (int row = 0; row < GRID; row++) {
+        int y0 = row * h / GRID, y1 = (row + 1) * h / GRID;
+        int my = (y1 - y0) / 4;
+        for (int col = 0; col < GRID; col++) {
+            int x0 = col * w / GRID, x1 = (col + 1) * w / GRID;
+            int mx = (x1 - x0) / 4;
+            unsigned sum = 0, n = 0;
+
+            for (int j = y0 + my; j < y1 - my; j += 2) {
+                const uint8_t *line = y + (size_t) j * stride;
+                for (int i = x0 + mx; i < x1 - mx; i += 2) {
+                    sum += line[i];
+                    n++;
+                }
+            }
+            if (n && sum / n > (Y_BLACK + Y_WHITE) / 2)
+                bits |= (uint64_t) 1 << (row * GRID + col);
+        }
+    }
+    return bits;
+}
+
+static int send_all(SOCKET s, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = send(s, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// one client, from the video request to it going away
+static void serve_client(SOCKET s) {
+    char req[128];
+    uint8_t header[9] = {0};
+    uint8_t *yuv = NULL, *jpg = NULL;
+    tjhandle tj = NULL;
+    int w = 0, h = 0;
+    struct timeval tv = { .tv_sec = 1 };
+
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    int one = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    ssize_t len = recv(s, req, sizeof(req) - 1, 0);
+    if (len <= 0)
+        goto out;
+    req[len] = 0;
+
+    // CMD /v3/video/<codec>/<W>x<H>, anything else (battery polls) is turned away
+    if (sscanf(req, "CMD /v3/video/%*[^/]/%dx%d", &w, &h) != 2) {
+        dbgprint("not a video request: %s\n", req);
+        goto out;
+    }
+    if (opt.width) {
+        w = opt.width;
+        h = opt.height;
+    }
+    if (w <= 0 || h <= 0) {
+        w = WIDTH_DEFAULT;
+        h = HEIGHT_DEFAULT;
+    }
+
+    int cw = (w + 1) / 2, ch = (h + 1) / 2;
+    unsigned long jpg_cap = tjBufSize(w, h, TJSAMP_420);
+    yuv = malloc((size_t) w * h + (size_t) cw * ch * 2);
+    jpg = malloc(jpg_cap);
+    tj = tjInitCompress();
+    if (!yuv || !jpg || !tj) {
+        errprint("can't set up the encoder\n");
+        goto out;
+    }
+    memset(yuv + (size_t) w * h, 128, (size_t) cw * ch * 2);
+
+    const uint8_t *planes[3] = { yuv, yuv + (size_t) w * h, yuv + (size_t) w * h + (size_t) cw * ch };
+    int strides[3] = { w, cw, cw };
+
+    header[0] = (w >> 8) & 0xFF;
+    header[1] = (w >> 0) & 0xFF;
+    header[2] = (h >> 8) & 0xFF;
+    header[3] = (h >> 0) & 0xFF;
+    if (send_all(s, header, sizeof(header)) < 0)
+        goto out;
+
+    errprint("streaming %dx%d at %d fps\n", w, h, opt.fps);
+
+    uint16_t seq = 0;
+    int64_t interval = 1000000 / opt.fps;
+    int64_t next = now_us();
+    while (running) {
+        // controls and pings from the client, not acted on
+        len = recv(s, req, sizeof(req), MSG_DONTWAIT);
+        if (len == 0 || (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+            break;
+
+        pattern_draw(yuv, w, h, pattern_pack(seq++, (uint32_t) now_us()));
+
+        unsigned long size = jpg_cap;
+        if (tjCompressFromYUVPlanes(tj, planes, w, strides, h, TJSAMP_420,
+                &jpg, &size, QUALITY, TJFLAG_NOREALLOC | TJFLAG_FASTDCT) != 0) {
+            errprint("encode error: %s\n", tjGetErrorStr());
+            break;
+        }
+
+        uint32_t length = htole32((uint32_t) size);
+        if (send_all(s, &length, 4) < 0 || send_all(s, jpg, size) < 0)
+            break;
+
+        next += interval;
+        int64_t wait = next - now_us();
+        if (wait > 0)
+            usleep(wait);
+        else if (wait < -interval)
+            next = now_us(); // fell behind, don't burst to catch up
+    }
+    errprint("client gone\n");
+
+out:
+    if (tj)
+        tjDestroy(tj);
+    free(jpg);
+    free(yuv);
+    close(s);
+}
+
+static void *ServeThreadProc(__attribute__((__unused__)) void *args) {
+    SOCKET server = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_in sin = {
+        .sin_family = AF_INET,
+        .sin_port = htons(opt.port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    int one = 1;
+
+    setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (server < 0 || bind(server, (struct sockaddr*) &sin, sizeof(sin)) < 0 || listen(server, 1) < 0) {
+        errprint("can't listen on port %d: %s\n", opt.port, strerror(errno));
+        running = 0;
+        kill(getpid(), SIGTERM); // wakes the reader
+        goto out;
+    }
+
+    while (running) {
+        struct pollfd pfd = { .fd = server, .events = POLLIN };
+        if (poll(&pfd, 1, ACCEPT_POLL_MS) <= 0)
+            continue;
+
+        SOCKET s = accept4(server, NULL, NULL, SOCK_CLOEXEC);
+        if (s >= 0)
+            serve_client(s);
+    }
+
+out:
+    if (server >= 0)
+        close(server);
+    return 0;
+}
+
+static int cmp_int(const void *a, const void *b) {
+    return *(const int*) a - *(const int*) b;
+}
+
+static int percentile(const int *sorted, int n, double p) {
+    return sorted[(int) ((n - 1) * p / 100.0 + 0.5)];
+}
+
+static void report(int *samples, int n, unsigned long missed, unsigned long repeats, unsigned long unreadable) {
+    static const int bounds_ms[] = { 1, 2, 4, 8, 16, 33, 66, 133, 266 };
+    int buckets[ARRAY_LEN(bounds_ms) + 1] = {0};
+    int64_t sum = 0;
+    int peak = 0;
+
+    printf("\n%d frames, %lu missed, %lu repeated, %lu unreadable\n", n, missed, repeats, unreadable);
+    if (n == 0)
+        return;
+
+    qsort(samples, n, sizeof(int), cmp_int);
+    for (int i = 0; i < n; i++) {
+        unsigned b = 0;
+        while (b < ARRAY_LEN(bounds_ms) && samples[i] >= bounds_ms[b] * 1000)
+            b++;
+        buckets[b]++;
+        sum += samples[i];
+    }
+
+    printf("latency ms: min %.1f, mean %.1f, p50 %.1f, p90 %.1f, p95 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n\n",
+        samples[0] / 1000.0, sum / (double) n / 1000.0,
+        percentile(samples, n, 50) / 1000.0, percentile(samples, n, 90) / 1000.0,
+        percentile(samples, n, 95) / 1000.0, percentile(samples, n, 99) / 1000.0,
+        percentile(samples, n, 99.9) / 1000.0, samples[n - 1] / 1000.0);
+
+    for (unsigned b = 0; b < ARRAY_LEN(buckets); b++) {
+        if (buckets[b] > peak)
+            peak = buckets[b];
+    }
+    for (unsigned b = 0; b < ARRAY_LEN(buckets); b++) {
+        char range[16];
+        if (b < ARRAY_LEN(bounds_ms))
+            snprintf(range, sizeof(range), "< %d", bounds_ms[b]);
+        else
+            snprintf(range, sizeof(range), ">= %d", bounds_ms[b - 1]);
+        printf("%8s ms %6d ", range, buckets[b]);
+        for (int i = 0; i < buckets[b] * 50 / peak; i++)
+            putchar('#');
+        putchar('\n');
+    }
+}
+
+// the format is only there once the client has opened the device as its output
+static int wait_format(int fd, struct v4l2_format *fmt) {
+    while (running) {
+        memset(fmt, 0, sizeof(*fmt));
+        fmt->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        if (ioctl(fd, VIDIOC_G_FMT, fmt) == 0 && fmt->fmt.pix.width > 0 && fmt->fmt.pix.sizeimage > 0) {
+            if (fmt->fmt.pix.pixelformat != V4L2_PIX_FMT_YUV420) {
+                errprint("%s: not a droidcam device (format %.4s)\n", opt.device, (char*) &fmt->fmt.pix.pixelformat);
+                return -1;
+            }
+            return 0;
+        }
+        usleep(FORMAT_POLL_MS * 1000);
+    }
+    return -1;
+}
+
+static int measure(void) {
+    struct v4l2_format fmt;
+    unsigned long missed = 0, repeats = 0, unreadable = 0;
+    int n = 0, have_last = 0;
+    uint16_t last = 0;
+    int *samples = NULL;
+    uint8_t *frame = NULL;
+    int rc = 1;
+
+    int fd = open(opt.device, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        errprint("can't open %s: %s\n", opt.device, strerror(errno));
+        return 1;
+    }
+
+    printf("waiting for the client on 127.0.0.1:%d to write to %s\n", opt.port, opt.device);
+    fflush(stdout);
+    if (wait_format(fd, &fmt) < 0)
+        goto out;
+
+    int w = fmt.fmt.pix.width, h = fmt.fmt.pix.height;
+    int stride = fmt.fmt.pix.bytesperline ? (int) fmt.fmt.pix.bytesperline : w;
+    samples = malloc(opt.frames * sizeof(int));
+    frame = malloc(fmt.fmt.pix.sizeimage);
+    if (!samples || !frame) {
+        errprint("out of memory\n");
+        goto out;
+    }
+
+    printf("timing %d frames off %s (%dx%d), Ctrl-C to stop early\n", opt.frames, opt.device, w, h);
+    fflush(stdout);
+    while (running && n < opt.frames) {
+        ssize_t len = read(fd, frame, fmt.fmt.pix.sizeimage);
+        uint32_t now = (uint32_t) now_us();
+        uint16_t seq;
+        uint32_t ts;
+
+        if (len < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            errprint("read error on %s: %s\n", opt.device, strerror(errno));
+            break;
+        }
+        if (len < (ssize_t) stride * h)
+            continue;
+
+        if (!pattern_unpack(pattern_read(frame, stride, w, h), &seq, &ts)) {
+            // the client's test image until the stream starts
+            if (have_last)
+                unreadable++;
+            continue;
+        }
+
+        if (have_last && seq == last) {
+            repeats++;
+            continue;
+        }
+        if (have_last)
+            missed += (uint16_t) (seq - last - 1);
+        have_last = 1;
+        last = seq;
+
+        int32_t latency = (int32_t) (now - ts);
+        if (latency < 0) {
+            unreadable++;
+            continue;
+        }
+        samples[n++] = latency;
+    }
+
+    report(samples, n, missed, repeats, unreadable);
+    rc = 0;
+out:
+    close(fd);
+    free(frame);
+    free(samples);
+    return rc;
+}
+
+static void on_signal(__attribute__((__unused__)) int sig) {
+    running = 0;
+}
+
+static void usage(char *argv0) {
+    fprintf(stderr, "Usage: %s [options] <port> <device>\n"
+    "  Serve a test stream on 127.0.0.1:<port> in place of the phone and time\n"
+    "  its frames coming out of the v4l2loopback <device>. Then start the client\n"
+    "  on this machine, without flips: droidcam-cli -nocontrols 127.0.0.1 <port>\n"
+    "\n"
+    "Options:\n"
+    " -size=WxH   Stream size, instead of what the client asks for\n"
+    " -fps=N      Frame rate (default %d)\n"
+    " -frames=N   Frames to time before reporting (default %d)\n"
+    "\n",
+    argv0, FPS_DEFAULT, FRAMES_DEFAULT);
+}
+
+int main(int argc, char *argv[]) {
+    struct sigaction sa;
+    sigset_t block, old;
+    pthread_t serve;
+    int i, rc;
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (sscanf(argv[i], "-size=%dx%d", &opt.width, &opt.height) == 2 && opt.width > 0 && opt.height > 0)
+            continue;
+        if (sscanf(argv[i], "-fps=%d", &opt.fps) == 1 && opt.fps > 0 && opt.fps <= 240)
+            continue;
+        if (sscanf(argv[i], "-frames=%d", &opt.frames) == 1 && opt.frames > 0)
+            continue;
+        goto usage;
+    }
+    if (argc - i != 2)
+        goto usage;
+
+    opt.port = strtoul(argv[i], NULL, 10);
+    opt.device = argv[i + 1];
+    if (opt.port <= 0 || opt.port > 65535)
+        goto usage;
+
+    // no SA_RESTART, a signal has to break the reader out of read()
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    // and land on the reader, not the server thread
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    if (pthread_create(&serve, NULL, ServeThreadProc, NULL) != 0) {
+        errprint("can't start the server thread\n");
+        return 1;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    rc = measure();
+    running = 0;
+    pthread_join(serve, NULL);
+    return rc;
+
+usage:
+    usage(argv[0]);
+    return 1;
+}
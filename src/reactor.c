@@ -0,0 +1,175 @@
+/* DroidCam & DroidCamX (C) 2010-2021
+ * https://github.com/dev47apps
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "reactor.h"
+#include "uring.h"
+
+struct reactor_slot {
+    int fd;
+    int timer;    // a timerfd, its expirations are read before the callback
+    uint32_t gen; // stale events from a reused slot are skipped
+    reactor_cb cb;
+    void *data;
+};
+
+static int epoll_fd = -1;
+static struct reactor_slot slots[REACTOR_MAX];
+
+int reactor_init(void) {
+    if (epoll_fd >= 0)
+        return 0;
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        errprint("epoll_create1() error %d '%s'\n", errno, strerror(errno));
+        return -1;
+    }
+
+    for (int i = 0; i < REACTOR_MAX; i++)
+        slots[i].fd = -1;
+
+#ifdef USE_IO_URING
+    // optional, the receive paths use the sockets without it
+    uring_init();
+#endif
+    return 0;
+}
+
+void reactor_fini(void) {
+    if (epoll_fd < 0)
+        return;
+
+#ifdef USE_IO_URING
+    uring_fini();
+#endif
+    close(epoll_fd);
+    epoll_fd = -1;
+}
+
+int reactor_fd(void) {
+    return epoll_fd;
+}
+
+static struct reactor_slot *find_slot(int fd) {
+    for (int i = 0; i < REACTOR_MAX; i++) {
+        if (slots[i].fd == fd)
+            return &slots[i];
+    }
+    return NULL;
+}
+
+static uint64_t slot_key(struct reactor_slot *slot) {
+    return ((uint64_t) slot->gen << 32) | (uint64_t) (slot - slots);
+}
+
+int reactor_add(int fd, uint32_t events, reactor_cb cb, void *data) {
+    struct epoll_event ev;
+    struct reactor_slot *slot = find_slot(-1);
+    if (!slot) {
+        errprint("reactor: out of slots\n");
+        return -1;
+    }
+
+    slot->gen++;
+    ev.events = events;
+    ev.data.u64 = slot_key(slot);
+    // errno is left for the caller, regular files can't be watched
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        return -1;
+
+    slot->fd = fd;
+    slot->timer = 0;
+    slot->cb = cb;
+    slot->data = data;
+    return 0;
+}
+
+int reactor_mod(int fd, uint32_t events) {
+    struct epoll_event ev;
+    struct reactor_slot *slot = find_slot(fd);
+    if (fd < 0 || !slot)
+        return -1;
+
+    ev.events = events;
+    ev.data.u64 = slot_key(slot);
+    return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+void reactor_del(int fd) {
+    struct reactor_slot *slot = find_slot(fd);
+    if (fd < 0 || !slot)
+        return;
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    slot->fd = -1;
+    slot->gen++;
+}
+
+/* Periodic timer, or one shot when interval_ms is 0. The callback gets
+ * the timerfd, the expiration count is already consumed.
+ */
+int reactor_timer_add(int first_ms, int interval_ms, reactor_cb cb, void *data) {
+    struct itimerspec its;
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (tfd < 0) {
+        errprint("timerfd_create() error %d '%s'\n", errno, strerror(errno));
+        return -1;
+    }
+
+    // a zero it_value would disarm the timer
+    if (first_ms <= 0)
+        first_ms = 1;
+
+    its.it_value.tv_sec = first_ms / 1000;
+    its.it_value.tv_nsec = (first_ms % 1000) * 1000000L;
+    its.it_interval.tv_sec = interval_ms / 1000;
+    its.it_interval.tv_nsec = (interval_ms % 1000) * 1000000L;
+    if (timerfd_settime(tfd, 0, &its, NULL) < 0 || reactor_add(tfd, EPOLLIN, cb, data) < 0) {
+        close(tfd);
+        return -1;
+    }
+
+    find_slot(tfd)->timer = 1;
+    return tfd;
+}
+
+void reactor_timer_del(int tfd) {
+    if (tfd < 0)
+        return;
+    reactor_del(tfd);
+    close(tfd);
+}
+
+// Returns the number of events handled, or -1 on error (EINTR included)
+int reactor_dispatch(int timeout_ms) {
+    struct epoll_event events[REACTOR_MAX];
+
+    int n = epoll_wait(epoll_fd, events, REACTOR_MAX, timeout_ms);
+    for (int i = 0; i < n; i++) {
+        struct reactor_slot *slot = &slots[events[i].data.u64 & 0xFFFFFFFF];
+        if (slot->fd < 0 || slot->gen != (uint32_t) (events[i].data.u64 >> 32))
+            continue;
+
+        if (slot->timer && (events[i].events & EPOLLIN)) {
+            uint64_t expirations;
+            if (read(slot->fd, &expirations, sizeof(expirations)) < 0)
+                continue;
+        }
+
+        slot->cb(slot->fd, events[i].events, slot->data);
+    }
+
+    return n;
+}
@@ -0,0 +1,40 @@
+/* DroidCam & DroidCamX (C) 2010-2021
+ * https://github.com/dev47apps
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __REACTOR_H__
+#define __REACTOR_H__
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+/* One epoll/timerfd event loop per process for the I/O side work:
+ * controls, timers and short request/response connections.
+ * Not thread safe, only touch it from the thread that dispatches it.
+ * The epoll fd is itself pollable, so it can be driven from another
+ * loop (GTK) instead of reactor_dispatch() blocking.
+ * With USE_IO_URING it also owns the process' io_uring, see uring.h.
+ * On FreeBSD epoll and timerfd come from epoll-shim.
+ */
+#define REACTOR_MAX 64
+
+typedef void (*reactor_cb)(int fd, uint32_t events, void *data);
+
+int  reactor_init(void);
+void reactor_fini(void);
+int  reactor_fd(void);
+
+int  reactor_add(int fd, uint32_t events, reactor_cb cb, void *data);
+int  reactor_mod(int fd, uint32_t events);
+void reactor_del(int fd);
+
+int  reactor_timer_add(int first_ms, int interval_ms, reactor_cb cb, void *data);
+void reactor_timer_del(int tfd);
+
+int  reactor_dispatch(int timeout_ms);
+
+#endif
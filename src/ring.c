@@ -0,0 +1,92 @@
+/* DroidCam & DroidCamX (C) 2010-2021
+ * https://github.com/dev47apps
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ring.h"
+
+int pcm_ring_init(pcm_ring *r, size_t min_size) {
+    size_t size = 1;
+    while (size < min_size)
+        size <<= 1;
+
+    r->buf = (short *)calloc(size, sizeof(short));
+    if (r->buf == NULL) {
+        perror("ring: malloc failed");
+        return -1;
+    }
+
+    r->mask = size - 1;
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    return 0;
+}
+
+void pcm_ring_destroy(pcm_ring *r) {
+    free(r->buf);
+    r->buf = NULL;
+}
+
+size_t pcm_ring_used(pcm_ring *r) {
+    size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    return head - tail;
+}
+
+size_t pcm_ring_free(pcm_ring *r) {
+    return (r->mask + 1) - pcm_ring_used(r);
+}
+
+size_t pcm_ring_write(pcm_ring *r, const short *src, size_t count) {
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    size_t space = (r->mask + 1) - (head - tail);
+    if (count > space)
+        count = space;
+
+    // at most two copies: up to the end of the buffer, then from the start
+    size_t offset = head & r->mask;
+    size_t first = r->mask + 1 - offset;
+    if (first > count)
+        first = count;
+
+    memcpy(&r->buf[offset], src, first * sizeof(short));
+    memcpy(&r->buf[0], &src[first], (count - first) * sizeof(short));
+
+    atomic_store_explicit(&r->head, head + count, memory_order_release);
+    return count;
+}
+
+size_t pcm_ring_read(pcm_ring *r, short *dst, size_t count) {
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    if (count > head - tail)
+        count = head - tail;
+
+    size_t offset = tail & r->mask;
+    size_t first = r->mask + 1 - offset;
+    if (first > count)
+        first = count;
+
+    memcpy(dst, &r->buf[offset], first * sizeof(short));
+    memcpy(&dst[first], &r->buf[0], (count - first) * sizeof(short));
+
+    atomic_store_explicit(&r->tail, tail + count, memory_order_release);
+    return count;
+}
+
+size_t pcm_ring_drop(pcm_ring *r, size_t count) {
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    if (count > head - tail)
+        count = head - tail;
+
+    atomic_store_explicit(&r->tail, tail + count, memory_order_release);
+    return count;
+}
@@ -0,0 +1,38 @@
+/* DroidCam & DroidCamX (C) 2010-2021
+ * https://github.com/dev47apps
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __RING_H__
+#define __RING_H__
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+/* Single producer / single consumer ring of PCM samples.
+ * head is only written by the producer, tail only by the consumer.
+ */
+typedef struct pcm_ring_s {
+    short *buf;
+    size_t mask;
+    atomic_size_t head;
+    atomic_size_t tail;
+} pcm_ring;
+
+int pcm_ring_init(pcm_ring *r, size_t min_size);
+void pcm_ring_destroy(pcm_ring *r);
+
+size_t pcm_ring_used(pcm_ring *r);
+size_t pcm_ring_free(pcm_ring *r);
+
+// producer
+size_t pcm_ring_write(pcm_ring *r, const short *src, size_t count);
+
+// consumer
+size_t pcm_ring_read(pcm_ring *r, short *dst, size_t count);
+size_t pcm_ring_drop(pcm_ring *r, size_t count);
+
+#endif
@@ -9,6 +9,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #if __linux__
 #include <linux/limits.h>
@@ -22,12 +23,72 @@
 #include "common.h"
 #include "settings.h"
 
+// device lookups are remembered in the settings file, as cache_<key>=<value> lines
+#define CACHE_PREFIX "cache_"
+#define CACHE_LINES_MAX 4096
+
+static int GetPath(char *buf, size_t size) {
+    const char *home = getenv("HOME");
+    if (!home || !*home)
+        return -1;
+
+    snprintf(buf, size, "%s/.config/droidcam", home);
+    return 0;
+}
+
 static inline FILE *GetFile(const char* mode) {
     char buf[PATH_MAX];
-    snprintf(buf, sizeof(buf), "%s/.config/droidcam", getenv("HOME"));
+    if (GetPath(buf, sizeof(buf)) < 0)
+        return NULL;
     return fopen(buf, mode);
 }
 
+// the line's cache key matches key (NULL matches any cache line)
+static int IsCacheLine(const char *line, const char *key) {
+    if (strncmp(line, CACHE_PREFIX, sizeof(CACHE_PREFIX) - 1) != 0)
+        return 0;
+    if (!key)
+        return 1;
+
+    line += sizeof(CACHE_PREFIX) - 1;
+    size_t len = strlen(key);
+    return strncmp(line, key, len) == 0 && line[len] == '=';
+}
+
+/* Reads back the settings file lines to keep on a rewrite: only the cache
+ * lines if cache_only, everything else too otherwise, minus skip_key's.
+ */
+static void KeepLines(char *out, size_t size, int cache_only, const char *skip_key) {
+    char buf[512];
+    size_t used = 0;
+    FILE *fp = GetFile("r");
+
+    out[0] = 0;
+    if (!fp)
+        return;
+
+    while (fgets(buf, sizeof(buf), fp)) {
+        if (cache_only && !IsCacheLine(buf, NULL))
+            continue;
+        if (skip_key && IsCacheLine(buf, skip_key))
+            continue;
+
+        size_t len = strlen(buf);
+        if (used + len >= size)
+            break;
+        memcpy(out + used, buf, len + 1);
+        used += len;
+    }
+    fclose(fp);
+}
+
+int ParseLatency(const char *name) {
+    if (strcmp(name, "normal") == 0) return LATENCY_NORMAL;
+    if (strcmp(name, "low") == 0)    return LATENCY_LOW;
+    if (strcmp(name, "robust") == 0) return LATENCY_ROBUST;
+    return -1;
+}
+
 void LoadSettings(struct settings* settings) {
     char buf[512];
     int version = 0;
@@ -41,6 +102,7 @@ void LoadSettings(struct settings* settings) {
     settings->v4l2_height = 480;
     settings->connection = CB_RADIO_WIFI;
     settings->confirm_close = 1;
+    settings->audio_boost = 100;
 
     if (!fp) {
         return;
@@ -100,10 +162,17 @@ void LoadSettings(struct settings* settings) {
             if (1 == sscanf(buf, "confirm_close=%d\n",&settings->confirm_close)) continue;
             if (1 == sscanf(buf, "vertical_flip=%d\n",&settings->vertical_flip)) continue;
             if (1 == sscanf(buf, "horizontal_flip=%d\n",&settings->horizontal_flip)) continue;
+            if (1 == sscanf(buf, "audio_boost=%d\n",&settings->audio_boost)) continue;
+            if (1 == sscanf(buf, "audio_agc=%d\n",&settings->audio_agc)) continue;
+            if (1 == sscanf(buf, "latency=%d\n",&settings->latency)) continue;
+            if (1 == sscanf(buf, "ios_udid=%47s\n", settings->ios_udid)) continue;
         }
     }
 
     fclose(fp);
+    if (settings->latency < 0 || settings->latency >= LATENCY_COUNT)
+        settings->latency = LATENCY_NORMAL;
+
     dbgprint(
         "settings: ip=%s\n"
         "settings: port=%d\n"
@@ -114,6 +183,10 @@ void LoadSettings(struct settings* settings) {
         "settings: confirm_close=%d\n"
         "settings: vertical_flip=%d\n"
         "settings: horizontal_flip=%d\n"
+        "settings: audio_boost=%d\n"
+        "settings: audio_agc=%d\n"
+        "settings: latency=%d\n"
+        "settings: ios_udid=%s\n"
         "settings: connection=%d\n"
         ,
         settings->ip,
@@ -125,11 +198,17 @@ void LoadSettings(struct settings* settings) {
         settings->confirm_close,
         settings->vertical_flip,
         settings->horizontal_flip,
+        settings->audio_boost,
+        settings->audio_agc,
+        settings->latency,
+        settings->ios_udid,
         settings->connection);
 }
 
 void SaveSettings(struct settings* settings) {
     int version = 4;
+    char cache[CACHE_LINES_MAX];
+    KeepLines(cache, sizeof(cache), 1, NULL);
     FILE * fp = GetFile("w");
     if (!fp) return;
 
@@ -144,6 +223,10 @@ void SaveSettings(struct settings* settings) {
         "confirm_close=%d\n"
         "vertical_flip=%d\n"
         "horizontal_flip=%d\n"
+        "audio_boost=%d\n"
+        "audio_agc=%d\n"
+        "latency=%d\n"
+        "ios_udid=%s\n"
         "type=%d\n"
         ,
         version,
@@ -155,6 +238,51 @@ void SaveSettings(struct settings* settings) {
         settings->confirm_close,
         settings->vertical_flip,
         settings->horizontal_flip,
+        settings->audio_boost,
+        settings->audio_agc,
+        settings->latency,
+        settings->ios_udid,
         settings->connection);
+    fputs(cache, fp);
     fclose(fp);
 }
+
+int LoadCache(const char *key, char *value, int size) {
+    char buf[512];
+    int rc = -1;
+    FILE *fp = GetFile("r");
+    if (!fp)
+        return -1;
+
+    while (fgets(buf, sizeof(buf), fp)) {
+        if (!IsCacheLine(buf, key))
+            continue;
+
+        char *p = buf + sizeof(CACHE_PREFIX) - 1 + strlen(key) + 1;
+        p[strcspn(p, "\n")] = 0;
+        snprintf(value, size, "%s", p);
+        rc = 0;
+    }
+    fclose(fp);
+    return rc;
+}
+
+void SaveCache(const char *key, const char *value) {
+    char lines[CACHE_LINES_MAX];
+    char path[PATH_MAX], tmp[PATH_MAX + 16];
+
+    if (GetPath(path, sizeof(path)) < 0)
+        return;
+
+    // several sessions may write at once, each goes through its own file
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int) getpid());
+    KeepLines(lines, sizeof(lines), 0, key);
+    FILE *fp = fopen(tmp, "w");
+    if (!fp)
+        return;
+
+    fputs(lines, fp);
+    fprintf(fp, CACHE_PREFIX "%s=%s\n", key, value);
+    if (fclose(fp) != 0 || rename(tmp, path) != 0)
+        unlink(tmp);
+}
@@ -21,6 +21,13 @@ enum widgets {
 };
 
 
+enum latency_profiles {
+    LATENCY_NORMAL,
+    LATENCY_LOW,
+    LATENCY_ROBUST,
+    LATENCY_COUNT
+};
+
 enum control_codes {
     CB_CONTROL_EMPTY_0 = 0,
     CB_CONTROL_EL_OFF,
@@ -49,10 +56,17 @@ struct settings {
     int confirm_close;
     int horizontal_flip;
     int vertical_flip;
+    int audio_boost; // percent, 100 = unity gain
+    int audio_agc;
+    int latency;     // enum latency_profiles
+    char ios_udid[48]; // iOS device to use, first one if empty
 };
 
+int ParseLatency(const char *name);
 void LoadSettings(struct settings* settings);
 void SaveSettings(struct settings* settings);
+int LoadCache(const char *key, char *value, int size);
+void SaveCache(const char *key, const char *value);
 
 #define NO_ERROR 0
 #define ERROR_NO_DEVICES      -1
@@ -62,6 +76,8 @@ void SaveSettings(struct settings* settings);
 #define ERROR_DEVICE_NOTAUTH  -5
 int CheckAdbDevices(int port);
 int CheckiOSDevices(int port);
+int iOSWaitAttach(int *seq, int timeout_ms);
+void iOSUnsubscribe(void);
 
 void AdbErrorPrint(int rc);
 void iOSErrorPrint(int rc);
@@ -0,0 +1,262 @@
+/* DroidCam & DroidCamX (C) 2010-2021
+ * https://github.com/dev47apps
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/* Runs the adb client against a fake adb server.
+ *
+ * The fake speaks just enough of the host protocol for adb.c: a device
+ * list, forwards (one OKAY for the transport, one for the forward),
+ * kill, device tracking and FAIL replies. It listens on a free loopback
+ * port which the client picks up from ANDROID_ADB_SERVER_PORT.
+ *
+ *   make test
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "adb.h"
+
+void ShowError(const char *title, const char *msg) {
+    errprint("%s: %s\n", title, msg);
+}
+
+#define FAKE_SERIAL    "R58M123ABC"
+#define FAKE_FORWARD   "host-serial:" FAKE_SERIAL ":forward:tcp:4747;tcp:4747"
+
+static const char *fake_devices =
+    FAKE_SERIAL "           device usb:1-1 product:a51 model:SM_A515F device:a51 transport_id:1\n"
+    "emulator-5554          unauthorized transport_id:2\n";
+
+// what track-devices sends, one update after the other
+static const char *fake_track[] = {
+    FAKE_SERIAL "\toffline\n",
+    FAKE_SERIAL "\tdevice\n",
+};
+
+static struct {
+    SOCKET listener;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    char last_service[256];
+    int killed;
+} fake = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static int failures;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+static void fake_send_string(SOCKET s, const char *str) {
+    char hex[5];
+    snprintf(hex, sizeof(hex), "%04x", (unsigned) strlen(str));
+    Send(hex, 4, s);
+    Send(str, strlen(str), s);
+}
+
+static void fake_fail(SOCKET s, const char *msg) {
+    Send("FAIL", 4, s);
+    fake_send_string(s, msg);
+}
+
+// one request per connection, as the real server does for host services
+static int fake_serve(SOCKET s) {
+    char hex[5] = {0};
+    char service[256];
+
+    if (RecvAll(hex, 4, s) != 4)
+        return 0;
+
+    int len = (int) strtol(hex, NULL, 16);
+    if (len <= 0 || len >= (int) sizeof(service) || RecvAll(service, len, s) != len)
+        return 0;
+    service[len] = 0;
+
+    pthread_mutex_lock(&fake.lock);
+    strcpy(fake.last_service, service);
+    pthread_mutex_unlock(&fake.lock);
+
+    if (strcmp(service, "host:devices-l") == 0) {
+        Send("OKAY", 4, s);
+        fake_send_string(s, fake_devices);
+    }
+    else if (strcmp(service, FAKE_FORWARD) == 0) {
+        Send("OKAY", 4, s);
+        Send("OKAY", 4, s);
+    }
+    else if (strncmp(service, "host-serial:" FAKE_SERIAL ":", 13 + strlen(FAKE_SERIAL)) == 0) {
+        // the transport is there, the forward itself fails
+        Send("OKAY", 4, s);
+        fake_fail(s, "cannot bind listener: Address already in use");
+    }
+    else if (strncmp(service, "host-serial:", 12) == 0) {
+        char msg[128];
+        snprintf(msg, sizeof(msg), "device '%.*s' not found",
+            (int) strcspn(service + 12, ":"), service + 12);
+        fake_fail(s, msg);
+    }
+    else if (strcmp(service, "host:track-devices") == 0) {
+        Send("OKAY", 4, s);
+        for (size_t i = 0; i < sizeof(fake_track) / sizeof(fake_track[0]); i++)
+            fake_send_string(s, fake_track[i]);
+    }
+    else if (strcmp(service, "host:kill") == 0) {
+        Send("OKAY", 4, s);
+        pthread_mutex_lock(&fake.lock);
+        fake.killed = 1;
+        pthread_mutex_unlock(&fake.lock);
+        return 1;
+    }
+    else {
+        fake_fail(s, "unknown host service");
+    }
+    return 0;
+}
+
+static void *fake_server(__attribute__((__unused__)) void *arg) {
+    for (;;) {
+        SOCKET s = accept(fake.listener, NULL, NULL);
+        if (s == INVALID_SOCKET) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        int stop = fake_serve(s);
+        close(s);
+        if (stop)
+            break;
+    }
+    return NULL;
+}
+
+static int fake_start(void) {
+    struct sockaddr_in sin = {0};
+    socklen_t len = sizeof(sin);
+    char port[16];
+
+    fake.listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (fake.listener == INVALID_SOCKET)
+        return -1;
+
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = inet_addr("127.0.0.1");
+    sin.sin_port = 0;
+    if (bind(fake.listener, (struct sockaddr*)&sin, sizeof(sin)) < 0
+        || listen(fake.listener, 4) < 0
+        || getsockname(fake.listener, (struct sockaddr*)&sin, &len) < 0)
+    {
+        close(fake.listener);
+        return -1;
+    }
+
+    snprintf(port, sizeof(port), "%d", ntohs(sin.sin_port));
+    setenv("ANDROID_ADB_SERVER_PORT", port, 1);
+    dbgprint("fake adb server on port %s\n", port);
+    return pthread_create(&fake.thread, NULL, fake_server, NULL) == 0 ? 0 : -1;
+}
+
+static void last_service(char *buf, size_t size) {
+    pthread_mutex_lock(&fake.lock);
+    snprintf(buf, size, "%s", fake.last_service);
+    pthread_mutex_unlock(&fake.lock);
+}
+
+static void test_devices(void) {
+    struct adb_device devices[ADB_DEVICES_MAX];
+
+    int count = AdbListDevices(devices, ADB_DEVICES_MAX);
+    CHECK(count == 2);
+    if (count != 2)
+        return;
+
+    CHECK(strcmp(devices[0].serial, FAKE_SERIAL) == 0);
+    CHECK(strcmp(devices[0].state, "device") == 0);
+    CHECK(strcmp(devices[1].serial, "emulator-5554") == 0);
+    CHECK(strcmp(devices[1].state, "unauthorized") == 0);
+
+    // a short list keeps the first entries
+    CHECK(AdbListDevices(devices, 1) == 1);
+}
+
+static void test_forward(void) {
+    char service[256];
+
+    CHECK(AdbForward(FAKE_SERIAL, 4747, 4747) == 0);
+    last_service(service, sizeof(service));
+    CHECK(strcmp(service, FAKE_FORWARD) == 0);
+
+    // FAIL for the transport, then for the forward after its OKAY
+    CHECK(AdbForward("0123456789", 4747, 4747) < 0);
+    CHECK(AdbForward(FAKE_SERIAL, 4747, 4748) < 0);
+}
+
+static void test_track(void) {
+    int online = -1;
+
+    SOCKET s = AdbTrackOpen();
+    CHECK(s != INVALID_SOCKET);
+    if (s == INVALID_SOCKET)
+        return;
+
+    CHECK(AdbTrackWait(s, &online, 1000) == 0);
+    CHECK(online == 0);
+    CHECK(AdbTrackWait(s, &online, 1000) == 1);
+    CHECK(online == 1);
+
+    // the server closed the connection
+    CHECK(AdbTrackWait(s, &online, 1000) < 0);
+    disconnect(s);
+}
+
+static void test_kill(void) {
+    struct adb_device devices[ADB_DEVICES_MAX];
+
+    CHECK(AdbKillServer() == 0);
+    pthread_join(fake.thread, NULL);
+    close(fake.listener);
+    CHECK(fake.killed == 1);
+
+    // nothing listens anymore
+    CHECK(AdbListDevices(devices, ADB_DEVICES_MAX) < 0);
+    CHECK(AdbTrackOpen() == INVALID_SOCKET);
+}
+
+int main(void) {
+    const char *dbg = getenv("DROIDCAM_LOG");
+    if (dbg)
+        log_configure(dbg);
+
+    if (fake_start() < 0) {
+        errprint("could not start the fake adb server: %s\n", strerror(errno));
+        return 2;
+    }
+
+    test_devices();
+    test_forward();
+    test_track();
+    test_kill();
+
+    if (failures) {
+        fprintf(stderr, "adb: %d checks failed\n", failures);
+        return 1;
+    }
+    printf("adb: all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,219 @@
+/* DroidCam & DroidCamX (C) 2010-2021
+ * https://github.com/dev47apps
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if __linux__
+#include <linux/limits.h>
+#endif
+
+#if __FreeBSD__
+#include <sys/limits.h>
+#endif
+
+#include "common.h"
+#include "latency.h"
+#include "reactor.h"
+#include "trace.h"
+
+/* A slot is written like a seqlock: seq is cleared, the fields filled
+ * in, then seq set to the event's index + 1. A dump only keeps slots
+ * whose seq reads the same before and after copying them.
+ */
+struct trace_event {
+    atomic_uint_least64_t seq;
+    const char *name;  // string literal
+    int64_t ts_us;
+    int32_t dur_us;    // -1 for an instant
+    int32_t arg;
+    int tid;
+};
+
+static struct trace_event *ring;
+static atomic_uint_least64_t head;
+
+static struct {
+    int tid;
+    const char *name;
+} threads[TRACE_THREADS];
+static atomic_int thread_count;
+
+static char *trace_path;
+static int timer = -1;
+static volatile sig_atomic_t dump_requested;
+static __thread int my_tid;
+
+static int trace_tid(void) {
+    if (!my_tid)
+        my_tid = log_tid();
+    return my_tid;
+}
+
+static void trace_add(const char *name, int64_t ts_us, int32_t dur_us, int32_t arg) {
+    uint64_t i = atomic_fetch_add_explicit(&head, 1, memory_order_relaxed);
+    struct trace_event *ev = &ring[i & (TRACE_EVENTS - 1)];
+
+    atomic_store_explicit(&ev->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    ev->name = name;
+    ev->ts_us = ts_us;
+    ev->dur_us = dur_us;
+    ev->arg = arg;
+    ev->tid = trace_tid();
+    atomic_store_explicit(&ev->seq, i + 1, memory_order_release);
+}
+
+void trace_span(const char *name, int64_t start_us, int64_t dur_us) {
+    if (ring)
+        trace_add(name, start_us, (int32_t) dur_us, 0);
+}
+
+void trace_instant(const char *name, int arg) {
+    if (ring)
+        trace_add(name, lat_now(), -1, arg);
+}
+
+// names the calling thread's track, call it once per thread
+void trace_thread(const char *name) {
+    int n = atomic_fetch_add(&thread_count, 1);
+    if (n >= TRACE_THREADS)
+        return;
+    threads[n].tid = trace_tid();
+    threads[n].name = name;
+}
+
+static int trace_dump(void) {
+    char tmp[PATH_MAX];
+    struct trace_event ev;
+    int pid = getpid();
+    int count = 0;
+    FILE *f;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", trace_path);
+    f = fopen(tmp, "w");
+    if (!f) {
+        errprint("trace: can't write %s: %s\n", tmp, strerror(errno));
+        return -1;
+    }
+
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"droidcam\"}}", pid);
+    int threads_named = atomic_load(&thread_count);
+    for (int i = 0; i < threads_named && i < TRACE_THREADS; i++) {
+        fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+            pid, threads[i].tid, threads[i].name);
+    }
+
+    uint64_t end = atomic_load_explicit(&head, memory_order_acquire);
+    uint64_t start = end > TRACE_EVENTS ? end - TRACE_EVENTS : 0;
+    for (uint64_t i = start; i < end; i++) {
+        struct trace_event *slot = &ring[i & (TRACE_EVENTS - 1)];
+        uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq != i + 1)
+            continue;
+
+        ev.name = slot->name;
+        ev.ts_us = slot->ts_us;
+        ev.dur_us = slot->dur_us;
+        ev.arg = slot->arg;
+        ev.tid = slot->tid;
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq)
+            continue;
+
+        if (ev.dur_us >= 0)
+            fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%d,\"pid\":%d,\"tid\":%d}",
+                ev.name, (long long) ev.ts_us, ev.dur_us, pid, ev.tid);
+        else
+            fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%lld,\"pid\":%d,\"tid\":%d,\"args\":{\"arg\":%d}}",
+                ev.name, (long long) ev.ts_us, pid, ev.tid, ev.arg);
+        count++;
+    }
+    fprintf(f, "\n]}\n");
+
+    if (fclose(f) != 0 || rename(tmp, trace_path) < 0) {
+        errprint("trace: can't write %s: %s\n", trace_path, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+
+    infoprint("trace: %d events written to %s\n", count, trace_path);
+    return 0;
+}
+
+static void on_sigusr1(__attribute__((__unused__)) int sig) {
+    dump_requested = 1;
+}
+
+// the dump runs on the loop, a signal handler can't do file I/O
+static void on_check(__attribute__((__unused__)) int fd,
+    __attribute__((__unused__)) uint32_t events, __attribute__((__unused__)) void *data)
+{
+    if (!dump_requested)
+        return;
+
+    dump_requested = 0;
+    trace_dump();
+}
+
+/* Starts recording, the reactor has to be set up already.
+ * `kill -USR1 <pid>` writes out what the ring holds so far.
+ */
+int trace_start(const char *path) {
+    struct sigaction sa;
+
+    ring = calloc(TRACE_EVENTS, sizeof(*ring));
+    trace_path = strdup(path);
+    if (!ring || !trace_path) {
+        MSG_ERROR("Out of memory");
+        goto fail;
+    }
+
+    timer = reactor_timer_add(TRACE_CHECK_MS, TRACE_CHECK_MS, on_check, NULL);
+    if (timer < 0)
+        goto fail;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sigusr1;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, NULL);
+
+    trace_thread("main");
+    infoprint("tracing to %s, send SIGUSR1 (pid %d) to write it out\n", path, getpid());
+    return 0;
+
+fail:
+    free(ring);
+    free(trace_path);
+    ring = NULL;
+    trace_path = NULL;
+    return -1;
+}
+
+// writes the trace out one last time, once the recording threads are gone
+void trace_stop(void) {
+    if (!ring)
+        return;
+
+    signal(SIGUSR1, SIG_IGN);
+    reactor_timer_del(timer);
+    timer = -1;
+    trace_dump();
+
+    free(ring);
+    free(trace_path);
+    ring = NULL;
+    trace_path = NULL;
+}
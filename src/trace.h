@@ -0,0 +1,31 @@
+/* DroidCam & DroidCamX (C) 2010-2021
+ * https://github.com/dev47apps
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+
+/* Timeline of pipeline events, for stalls that averages hide. Events go
+ * into a bounded ring that keeps the most recent ones, any thread can
+ * add to it without locking. The ring is written out as Chrome trace
+ * JSON (chrome://tracing, ui.perfetto.dev) on SIGUSR1 and when tracing
+ * stops. Nothing is recorded until trace_start().
+ */
+#define TRACE_EVENTS   65536 /* power of 2 */
+#define TRACE_THREADS  16
+#define TRACE_CHECK_MS 250
+
+int  trace_start(const char *path);
+void trace_stop(void);
+
+void trace_thread(const char *name);
+void trace_span(const char *name, int64_t start_us, int64_t dur_us);
+void trace_instant(const char *name, int arg);
+
+#endif
@@ -0,0 +1,494 @@
+/* DroidCam & DroidCamX (C) 2010-2021
+ * https://github.com/dev47apps
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifdef USE_IO_URING
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "uring.h"
+
+#define TAG_RECV    1
+#define TAG_CANCEL  2
+#define TAG_UDP     3
+#define TAG_SEND    4
+
+#define SEND_MAX    64
+
+/* One user of the shared ring. Completions are parked here until the
+ * user's callback picks them up, the slot index doubles as the fixed
+ * buffer index and the UDP buffer group id.
+ */
+struct uring_rx {
+    int used;
+    uint32_t gen; // stale completions from a reused slot are skipped
+    reactor_cb cb;
+    void *data;
+
+    // stream receive, into the registered frame pool when it can
+    void *fixed_base;
+    size_t fixed_len;
+    int recv_pending;
+    int recv_done;
+    int recv_res;
+
+    // control request
+    int send_pending;
+    char send_buf[SEND_MAX];
+
+    // multishot udp receive
+    SOCKET udp_sock;
+    int udp_armed;
+    int udp_err;
+    struct msghdr udp_msg;
+    struct io_uring_buf_ring *br;
+    char *udp_bufs;
+    size_t udp_buf_size;
+
+    // received datagrams not reaped yet, buffer id and length
+    unsigned udp_head;
+    unsigned udp_tail;
+    int udp_bid[URING_UDP_BUFS];
+    int udp_len[URING_UDP_BUFS];
+};
+
+static struct {
+    int ready;
+    int fixed; // sparse buffer table registered, one slot per channel
+    int event_fd;
+    struct io_uring ring;
+    struct uring_rx channels[URING_CHANNELS];
+} uring = { .event_fd = -1 };
+
+static uint64_t uring_key(struct uring_rx *rx, int tag) {
+    return ((uint64_t) rx->gen << 32) | ((uint64_t) (rx - uring.channels) << 8) | tag;
+}
+
+// flushes the queue when it's full, so there is always room for a cancel
+static struct io_uring_sqe *uring_sqe(void) {
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&uring.ring);
+    if (!sqe) {
+        io_uring_submit(&uring.ring);
+        sqe = io_uring_get_sqe(&uring.ring);
+    }
+    return sqe;
+}
+
+static void uring_udp_arm(struct uring_rx *rx) {
+    struct io_uring_sqe *sqe = uring_sqe();
+    if (!sqe) {
+        rx->udp_err = -EBUSY;
+        return;
+    }
+
+    io_uring_prep_recvmsg_multishot(sqe, rx->udp_sock, &rx->udp_msg, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = rx - uring.channels;
+    io_uring_sqe_set_data64(sqe, uring_key(rx, TAG_UDP));
+    io_uring_submit(&uring.ring);
+    rx->udp_armed = 1;
+}
+
+static void uring_udp_recycle(struct uring_rx *rx, int bid) {
+    io_uring_buf_ring_add(rx->br, rx->udp_bufs + bid * rx->udp_buf_size, rx->udp_buf_size,
+        bid, io_uring_buf_ring_mask(URING_UDP_BUFS), 0);
+    io_uring_buf_ring_advance(rx->br, 1);
+}
+
+static void uring_udp_complete(struct uring_rx *rx, int res, unsigned flags) {
+    if (!(flags & IORING_CQE_F_MORE))
+        rx->udp_armed = 0;
+
+    if (res < 0) {
+        /* Nothing is re-armed after an error: -EINVAL is a kernel without
+         * multishot recvmsg, -ENOBUFS means the reaps fell behind, and
+         * both would just fail again.
+         */
+        if (res != -ECANCELED && !rx->udp_err)
+            rx->udp_err = res;
+        return;
+    }
+
+    if (flags & IORING_CQE_F_BUFFER) {
+        unsigned n = rx->udp_tail++ % URING_UDP_BUFS;
+        rx->udp_bid[n] = flags >> IORING_CQE_BUFFER_SHIFT;
+        rx->udp_len[n] = res;
+    }
+
+    // a multishot receive may still end without an error, CQ overflow
+    if (!rx->udp_armed && !rx->udp_err)
+        uring_udp_arm(rx);
+}
+
+// parks one completion with its channel
+static void uring_complete(struct io_uring_cqe *cqe) {
+    uint64_t key = io_uring_cqe_get_data64(cqe);
+    int tag = key & 0xFF;
+    struct uring_rx *rx = &uring.channels[(key >> 8) & 0xFF];
+
+    if (tag == TAG_CANCEL || !rx->used || rx->gen != (uint32_t) (key >> 32))
+        return;
+
+    switch (tag) {
+    case TAG_RECV:
+        rx->recv_pending = 0;
+        rx->recv_done = 1;
+        rx->recv_res = cqe->res;
+        break;
+    case TAG_SEND:
+        rx->send_pending = 0;
+        if (cqe->res < 0)
+            dbgprint("io_uring: send failed: %s\n", strerror(-cqe->res));
+        break;
+    case TAG_UDP:
+        uring_udp_complete(rx, cqe->res, cqe->flags);
+        break;
+    }
+}
+
+static void uring_drain(void) {
+    struct io_uring_cqe *cqe;
+
+    while (io_uring_peek_cqe(&uring.ring, &cqe) == 0) {
+        uring_complete(cqe);
+        io_uring_cqe_seen(&uring.ring, cqe);
+    }
+}
+
+static int uring_rx_ready(struct uring_rx *rx) {
+    return rx->recv_done || rx->udp_head != rx->udp_tail || rx->udp_err;
+}
+
+static void uring_dispatch(int fd, __attribute__((__unused__)) uint32_t events,
+    __attribute__((__unused__)) void *data)
+{
+    uint64_t count;
+
+    if (read(fd, &count, sizeof(count)) < 0) {}
+    uring_drain();
+
+    // a callback may free any channel, or open a new one
+    for (int i = 0; i < URING_CHANNELS; i++) {
+        struct uring_rx *rx = &uring.channels[i];
+        if (rx->used && uring_rx_ready(rx))
+            rx->cb(-1, EPOLLIN, rx->data);
+    }
+
+    // come back for whatever a full batch left behind
+    for (int i = 0; i < URING_CHANNELS; i++) {
+        if (uring.channels[i].used && uring_rx_ready(&uring.channels[i])) {
+            if (eventfd_write(uring.event_fd, 1) < 0) {}
+            break;
+        }
+    }
+}
+
+/* Called by reactor_init(), failing only leaves the ring out.
+ * Completions are signalled on an eventfd, so the ring sits in the
+ * reactor next to plain sockets.
+ */
+int uring_init(void) {
+    int rc;
+
+    if (uring.ready)
+        return 0;
+
+    rc = io_uring_queue_init(URING_ENTRIES, &uring.ring, 0);
+    if (rc < 0) {
+        dbgprint("io_uring unavailable: %s\n", strerror(-rc));
+        return -1;
+    }
+
+    uring.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (uring.event_fd < 0 || io_uring_register_eventfd(&uring.ring, uring.event_fd) < 0
+        || reactor_add(uring.event_fd, EPOLLIN, uring_dispatch, NULL) < 0)
+    {
+        dbgprint("io_uring: eventfd failed\n");
+        goto error;
+    }
+
+    // frame pools are swapped in per channel, without fixed buffers receives just copy
+    uring.fixed = io_uring_register_buffers_sparse(&uring.ring, URING_CHANNELS) == 0;
+    uring.ready = 1;
+    return 0;
+
+error:
+    if (uring.event_fd >= 0)
+        close(uring.event_fd);
+    uring.event_fd = -1;
+    io_uring_queue_exit(&uring.ring);
+    return -1;
+}
+
+void uring_fini(void) {
+    if (!uring.ready)
+        return;
+
+    for (int i = 0; i < URING_CHANNELS; i++)
+        uring_rx_free(&uring.channels[i]);
+
+    reactor_del(uring.event_fd);
+    io_uring_queue_exit(&uring.ring);
+    close(uring.event_fd);
+    uring.event_fd = -1;
+    uring.ready = 0;
+}
+
+/* A channel on the reactor's ring, cb runs on the reactor whenever it
+ * has completions to reap. NULL without a ring.
+ */
+struct uring_rx *uring_rx_new(reactor_cb cb, void *data) {
+    if (!uring.ready)
+        return NULL;
+
+    for (int i = 0; i < URING_CHANNELS; i++) {
+        struct uring_rx *rx = &uring.channels[i];
+        if (rx->used)
+            continue;
+
+        uint32_t gen = rx->gen;
+        memset(rx, 0, sizeof(*rx));
+        rx->gen = gen + 1;
+        rx->used = 1;
+        rx->cb = cb;
+        rx->data = data;
+        rx->udp_sock = INVALID_SOCKET;
+        return rx;
+    }
+
+    dbgprint("io_uring: out of channels\n");
+    return NULL;
+}
+
+static void uring_cancel(struct uring_rx *rx, int tag) {
+    struct io_uring_sqe *sqe = uring_sqe();
+    if (!sqe)
+        return;
+
+    io_uring_prep_cancel64(sqe, uring_key(rx, tag), 0);
+    io_uring_sqe_set_data64(sqe, uring_key(rx, TAG_CANCEL));
+}
+
+/* Waits out everything the channel still has in flight, so its
+ * buffers can go. Other channels' completions that come in meanwhile
+ * are parked, and the eventfd is poked for them.
+ */
+void uring_rx_free(struct uring_rx *rx) {
+    struct io_uring_cqe *cqe;
+
+    if (!rx || !rx->used)
+        return;
+
+    if (rx->recv_pending)
+        uring_cancel(rx, TAG_RECV);
+    if (rx->send_pending)
+        uring_cancel(rx, TAG_SEND);
+    if (rx->udp_armed)
+        uring_cancel(rx, TAG_UDP);
+    io_uring_submit(&uring.ring);
+
+    while ((rx->recv_pending || rx->send_pending || rx->udp_armed)
+        && io_uring_wait_cqe(&uring.ring, &cqe) == 0)
+    {
+        uring_complete(cqe);
+        io_uring_cqe_seen(&uring.ring, cqe);
+    }
+    uring_drain();
+    if (eventfd_write(uring.event_fd, 1) < 0) {}
+
+    if (rx->br)
+        io_uring_free_buf_ring(&uring.ring, rx->br, URING_UDP_BUFS, rx - uring.channels);
+    free(rx->udp_bufs);
+    uring_rx_register(rx, NULL, 0);
+
+    rx->used = 0;
+    rx->gen++;
+}
+
+/* Register the frame pool, so frame payloads are received straight
+ * into it without the kernel mapping the pages on every read. Takes
+ * the channel's slot in the ring's buffer table, NULL clears it.
+ */
+int uring_rx_register(struct uring_rx *rx, void *base, size_t len) {
+    struct iovec iov = { .iov_base = base, .iov_len = len };
+    int rc;
+
+    if (!uring.fixed || (rx->fixed_base == base && rx->fixed_len == len))
+        return 0;
+
+    rc = io_uring_register_buffers_update_tag(&uring.ring, rx - uring.channels, &iov, NULL, 1);
+    if (rc < 0) {
+        dbgprint("io_uring: can't register frame pool: %s\n", strerror(-rc));
+        rx->fixed_base = NULL;
+        rx->fixed_len = 0;
+        return -1;
+    }
+
+    rx->fixed_base = base;
+    rx->fixed_len = len;
+    return 0;
+}
+
+/* Queues one receive, straight into the frame pool when buf is in it.
+ * It may complete short, the result comes from uring_rx_reap().
+ */
+int uring_rx_submit(struct uring_rx *rx, SOCKET s, char *buf, int len) {
+    struct io_uring_sqe *sqe = uring_sqe();
+    if (!sqe)
+        return -1;
+
+    if (rx->fixed_base && (char*) rx->fixed_base <= buf
+        && buf + len <= (char*) rx->fixed_base + rx->fixed_len)
+        io_uring_prep_read_fixed(sqe, s, buf, len, 0, rx - uring.channels);
+    else
+        io_uring_prep_recv(sqe, s, buf, len, MSG_WAITALL);
+    io_uring_sqe_set_data64(sqe, uring_key(rx, TAG_RECV));
+
+    int rc = io_uring_submit(&uring.ring);
+    if (rc < 0)
+        return rc;
+
+    rx->recv_pending = 1;
+    return 0;
+}
+
+/* Returns 1 and the recv() style result in *res (-errno on error) for a
+ * finished receive, 0 if it's still pending.
+ */
+int uring_rx_reap(struct uring_rx *rx, int *res) {
+    if (!rx->recv_done)
+        return 0;
+
+    rx->recv_done = 0;
+    *res = rx->recv_res;
+    return 1;
+}
+
+/* Queues a control request on the same submission queue as the
+ * receives. One at a time, -1 while the last one is still going out.
+ */
+int uring_rx_send(struct uring_rx *rx, SOCKET s, const char *buf, int len) {
+    struct io_uring_sqe *sqe;
+
+    if (rx->send_pending || len > SEND_MAX || !(sqe = uring_sqe()))
+        return -1;
+
+    memcpy(rx->send_buf, buf, len);
+    io_uring_prep_send(sqe, s, rx->send_buf, len, MSG_NOSIGNAL);
+    io_uring_sqe_set_data64(sqe, uring_key(rx, TAG_SEND));
+    if (io_uring_submit(&uring.ring) < 0)
+        return -1;
+
+    rx->send_pending = 1;
+    return 0;
+}
+
+/* Multishot recvmsg into a provided buffer ring: one submission keeps
+ * delivering datagrams, the channel callback runs as they come in.
+ */
+int uring_udp_start(struct uring_rx *rx, SOCKET s) {
+    int rc;
+
+    rx->udp_sock = s;
+    memset(&rx->udp_msg, 0, sizeof(rx->udp_msg));
+    rx->udp_msg.msg_namelen = sizeof(struct sockaddr_in);
+#ifdef SO_TIMESTAMPNS
+    rx->udp_msg.msg_controllen = CMSG_SPACE(sizeof(struct timespec));
+#endif
+    rx->udp_buf_size = sizeof(struct io_uring_recvmsg_out)
+        + rx->udp_msg.msg_namelen + rx->udp_msg.msg_controllen + UDP_PACKET_MAX;
+
+    rx->udp_bufs = malloc(rx->udp_buf_size * URING_UDP_BUFS);
+    if (!rx->udp_bufs)
+        return -1;
+
+    rx->br = io_uring_setup_buf_ring(&uring.ring, URING_UDP_BUFS, rx - uring.channels, 0, &rc);
+    if (!rx->br) {
+        dbgprint("io_uring: no buffer ring: %s\n", strerror(-rc));
+        return -1;
+    }
+    for (int i = 0; i < URING_UDP_BUFS; i++)
+        uring_udp_recycle(rx, i);
+
+    uring_udp_arm(rx);
+    return rx->udp_err ? -1 : 0;
+}
+
+/* Same contract as RecvBatchUDP(): fills the batch with datagrams from
+ * the phone, returns the count, 0 when nothing is pending, -1 on error.
+ * Once the multishot receive stopped on something the ring can't get
+ * past, URING_FALLBACK after the datagrams that made it in.
+ */
+int uring_udp_reap(struct uring_rx *rx, struct udp_batch *batch, const char *ip, int port) {
+    in_addr_t phone_addr = inet_addr(ip);
+    uint16_t phone_port = htons((uint16_t)port);
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    batch->count = 0;
+    batch->filtered = 0;
+    while (batch->count < UDP_BATCH_MAX && rx->udp_head != rx->udp_tail) {
+        unsigned q = rx->udp_head++ % URING_UDP_BUFS;
+        int bid = rx->udp_bid[q];
+        int res = rx->udp_len[q];
+        void *buf = rx->udp_bufs + bid * rx->udp_buf_size;
+        struct io_uring_recvmsg_out *o = io_uring_recvmsg_validate(buf, res, &rx->udp_msg);
+        if (!o) {
+            uring_udp_recycle(rx, bid);
+            continue;
+        }
+
+        struct sockaddr_in *from = io_uring_recvmsg_name(o);
+        if (from->sin_addr.s_addr != phone_addr || from->sin_port != phone_port) {
+            batch->filtered++;
+            uring_udp_recycle(rx, bid);
+            continue;
+        }
+
+        int n = batch->count++;
+        unsigned len = io_uring_recvmsg_payload_length(o, res, &rx->udp_msg);
+        if (len > UDP_PACKET_MAX)
+            len = UDP_PACKET_MAX;
+        memcpy(batch->data[n], io_uring_recvmsg_payload(o, &rx->udp_msg), len);
+        batch->len[n] = len;
+        batch->stamp[n] = (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+
+#ifdef SO_TIMESTAMPNS
+        for (struct cmsghdr *c = io_uring_recvmsg_cmsg_firsthdr(o, &rx->udp_msg); c;
+                c = io_uring_recvmsg_cmsg_nexthdr(o, &rx->udp_msg, c)) {
+            if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPNS) {
+                struct timespec ts;
+                memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+                batch->stamp[n] = (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+            }
+        }
+#endif
+        uring_udp_recycle(rx, bid);
+    }
+
+    if (batch->count > 0 || rx->udp_head != rx->udp_tail || !rx->udp_err)
+        return batch->count;
+
+    if (rx->udp_err == -EINVAL || rx->udp_err == -ENOBUFS
+        || rx->udp_err == -EOPNOTSUPP || rx->udp_err == -EBUSY)
+    {
+        dbgprint("io_uring: udp receive stopped: %s\n", strerror(-rx->udp_err));
+        return URING_FALLBACK;
+    }
+    errno = -rx->udp_err;
+    return -1;
+}
+
+#endif
@@ -0,0 +1,48 @@
+/* DroidCam & DroidCamX (C) 2010-2021
+ * https://github.com/dev47apps
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __URING_H__
+#define __URING_H__
+
+#include "connection.h"
+
+/* Optional io_uring receive path, built with `make IO_URING=1`.
+ * The reactor owns one ring for the process: the video and audio
+ * receives and the control requests on the video socket all go through
+ * its submission queue, and one eventfd in the epoll set reports the
+ * completions back to each user's callback.
+ * Every user falls back to the plain socket calls when the ring can't
+ * be set up (old kernel, seccomp, memlock limits) or can't do the job.
+ */
+struct uring_rx;
+
+#ifdef USE_IO_URING
+#include <liburing.h>
+#include "reactor.h"
+
+#define URING_ENTRIES  64
+#define URING_CHANNELS 8
+#define URING_UDP_BUFS 32 /* power of 2 */
+
+// uring_udp_reap(): multishot receive stopped, use RecvBatchUDP()
+#define URING_FALLBACK (-2)
+
+int  uring_init(void);
+void uring_fini(void);
+
+struct uring_rx *uring_rx_new(reactor_cb cb, void *data);
+void uring_rx_free(struct uring_rx *rx);
+int uring_rx_register(struct uring_rx *rx, void *base, size_t len);
+int uring_rx_submit(struct uring_rx *rx, SOCKET s, char *buf, int len);
+int uring_rx_reap(struct uring_rx *rx, int *res);
+int uring_rx_send(struct uring_rx *rx, SOCKET s, const char *buf, int len);
+int uring_udp_start(struct uring_rx *rx, SOCKET s);
+int uring_udp_reap(struct uring_rx *rx, struct udp_batch *batch, const char *ip, int port);
+#endif
+
+#endif
@@ -7,9 +7,12 @@
  */
 
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include "usbmuxd.h"
 
 #if __FreeBSD__
@@ -18,6 +21,9 @@
 
 #include "common.h"
 #include "settings.h"
+#include "adb.h"
+
+extern struct settings g_settings;
 
 void AdbErrorPrint(int rc) {
 	switch (rc) {
@@ -44,53 +50,56 @@ void AdbErrorPrint(int rc) {
 
 
 int CheckAdbDevices(int port) {
-	char buf[256];
-	FILE* pipe;
-	int rc = system("adb start-server");
-	if (WEXITSTATUS(rc) != 0){
-		rc = ERROR_LOADING_DEVICES;
-		goto EXIT;
-	}
+	struct adb_device devices[ADB_DEVICES_MAX];
+	const char *serial = NULL;
+	int rc;
 
-	pipe = popen("adb devices", "r");
-	if (!pipe) {
-		rc = ERROR_LOADING_DEVICES;
-		goto EXIT;
+	int count = AdbListDevices(devices, ADB_DEVICES_MAX);
+	if (count < 0) {
+		// server isn't running yet
+		if (AdbStartServer() != 0) {
+			rc = ERROR_LOADING_DEVICES;
+			goto EXIT;
+		}
+		count = AdbListDevices(devices, ADB_DEVICES_MAX);
+		if (count < 0) {
+			rc = ERROR_LOADING_DEVICES;
+			goto EXIT;
+		}
 	}
 
 	rc = ERROR_NO_DEVICES;
 
-	while (!feof(pipe)) {
-		if (fgets(buf, sizeof(buf), pipe) == NULL) break;
-		dbgprint("Got line: %s", buf);
-		if (strstr(buf, "List of") != NULL){
+	// same device selection the adb binary does
+	const char *wanted = getenv("ANDROID_SERIAL");
+	if (wanted && wanted[0] == 0)
+		wanted = NULL;
+
+	for (int i = 0; i < count; i++) {
+		dbgprint("Got device: %s %s\n", devices[i].serial, devices[i].state);
+		if (wanted && strcmp(devices[i].serial, wanted) != 0)
 			continue;
-		}
-		if (strstr(buf, "offline") != NULL){
+		if (strcmp(devices[i].state, "offline") == 0) {
 			rc = ERROR_DEVICE_OFFLINE;
-			if (system("adb kill-server") < 0){}
+			AdbKillServer();
 			break;
 		}
-		if (strstr(buf, "unauthorized") != NULL){
+		if (strcmp(devices[i].state, "unauthorized") == 0) {
 			rc = ERROR_DEVICE_NOTAUTH;
 			break;
 		}
-		if (strstr(buf, "device") != NULL && strstr(buf, "??") == NULL){
+		if (strcmp(devices[i].state, "device") == 0) {
+			serial = devices[i].serial;
 			rc = NO_ERROR;
 			break;
 		}
 	}
-	pclose(pipe);
 
 EXIT:
 	dbgprint("CheckAdbDevices rc=%d\n", rc);
 
-	if (rc == NO_ERROR) {
-		snprintf(buf, sizeof(buf), "adb forward tcp:%d tcp:%d", port, port);
-		rc = system(buf);
-		if (WEXITSTATUS(rc) != 0){
-			rc = ERROR_ADDING_FORWARD;
-		}
+	if (rc == NO_ERROR && AdbForward(serial, port, port) != 0) {
+		rc = ERROR_ADDING_FORWARD;
 	}
 
 	return rc;
@@ -117,22 +126,174 @@ void iOSErrorPrint(int rc) {
 	}
 }
 
-int CheckiOSDevices(int port) {
+/* usbmuxd events keep a cached device list, so picking a device for a
+ * connection doesn't need a round trip to enumerate them again.
+ */
+#define IOS_DEVICES_MAX 8
+
+static pthread_mutex_t ios_sub_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t ios_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ios_attached = PTHREAD_COND_INITIALIZER;
+static usbmuxd_subscription_context_t ios_ctx;
+static usbmuxd_device_info_t ios_devices[IOS_DEVICES_MAX];
+static int ios_count;
+static int ios_subscribed;
+static int ios_attach_seq;
+
+static void ios_device_add(const usbmuxd_device_info_t *device) {
+	for (int i = 0; i < ios_count; i++) {
+		if (ios_devices[i].handle == device->handle)
+			return;
+	}
+	if (ios_count < IOS_DEVICES_MAX)
+		ios_devices[ios_count++] = *device;
+}
+
+static void ios_event_cb(const usbmuxd_event_t *event, void *user_data) {
+	pthread_mutex_lock(&ios_lock);
+	if (event->event == UE_DEVICE_ADD || event->event == UE_DEVICE_PAIRED) {
+		dbgprint("usbmuxd: attached %s (%d)\n", event->device.udid, event->device.handle);
+		ios_device_add(&event->device);
+		ios_attach_seq++;
+		pthread_cond_broadcast(&ios_attached);
+	}
+	else if (event->event == UE_DEVICE_REMOVE) {
+		dbgprint("usbmuxd: removed %d\n", event->device.handle);
+		for (int i = 0; i < ios_count; i++) {
+			if (ios_devices[i].handle == event->device.handle) {
+				ios_devices[i] = ios_devices[--ios_count];
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&ios_lock);
+}
+
+// Subscribe once, seeding the cache with the devices already attached
+static int iOSSubscribe(void) {
 	usbmuxd_device_info_t *deviceList = NULL;
-	const int deviceCount = usbmuxd_get_device_list(&deviceList);
-	dbgprint("CheckiOSDevices: found %d devices\n", deviceCount);
+	int rc = 0;
 
+	pthread_mutex_lock(&ios_sub_lock);
+	if (ios_subscribed)
+		goto out;
+
+	const int deviceCount = usbmuxd_get_device_list(&deviceList);
+	dbgprint("usbmuxd: found %d devices\n", deviceCount);
 	if (deviceCount < 0) {
-		return ERROR_LOADING_DEVICES;
+		rc = ERROR_LOADING_DEVICES;
+		goto out;
 	}
-	if (deviceCount == 0) {
-		usbmuxd_device_list_free(&deviceList);
+	pthread_mutex_lock(&ios_lock);
+	for (int i = 0; i < deviceCount; i++)
+		ios_device_add(&deviceList[i]);
+	pthread_mutex_unlock(&ios_lock);
+	usbmuxd_device_list_free(&deviceList);
+
+	if (usbmuxd_events_subscribe(&ios_ctx, ios_event_cb, NULL) == 0) {
+		pthread_mutex_lock(&ios_lock);
+		ios_subscribed = 1;
+		pthread_mutex_unlock(&ios_lock);
+	} else {
+		// the list above is still good for this connection
+		errprint("usbmuxd: event subscription failed\n");
+	}
+
+out:
+	pthread_mutex_unlock(&ios_sub_lock);
+	return rc;
+}
+
+void iOSUnsubscribe(void) {
+	pthread_mutex_lock(&ios_sub_lock);
+	if (ios_subscribed)
+		usbmuxd_events_unsubscribe(ios_ctx);
+
+	pthread_mutex_lock(&ios_lock);
+	ios_subscribed = 0;
+	ios_count = 0;
+	pthread_cond_broadcast(&ios_attached);
+	pthread_mutex_unlock(&ios_lock);
+	pthread_mutex_unlock(&ios_sub_lock);
+}
+
+/* Waits for a device attach past *seq, returns 1 if one happened.
+ * Without a usbmuxd subscription there is nothing to wait for, it
+ * returns 0 right away.
+ */
+int iOSWaitAttach(int *seq, int timeout_ms) {
+	struct timespec ts;
+	int rc = 0;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += timeout_ms / 1000;
+	ts.tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&ios_lock);
+	if (!ios_subscribed)
+		goto out;
+
+	if (*seq < 0)
+		*seq = ios_attach_seq;
+	while (ios_subscribed && ios_attach_seq == *seq) {
+		if (pthread_cond_timedwait(&ios_attached, &ios_lock, &ts) != 0)
+			break;
+	}
+	if (ios_attach_seq != *seq) {
+		*seq = ios_attach_seq;
+		rc = 1;
+	}
+
+out:
+	pthread_mutex_unlock(&ios_lock);
+	return rc;
+}
+
+int CheckiOSDevices(int port) {
+	usbmuxd_device_info_t device;
+	int found = -1;
+
+	int rc = iOSSubscribe();
+	if (rc != 0)
+		return rc;
+
+	pthread_mutex_lock(&ios_lock);
+	for (int i = 0; i < ios_count; i++) {
+		if (g_settings.ios_udid[0]) {
+			if (strcmp(ios_devices[i].udid, g_settings.ios_udid) == 0) {
+				found = i;
+				break;
+			}
+			continue;
+		}
+		// prefer a cable over usbmuxd's network devices
+		if (found < 0 || (ios_devices[i].conn_type == CONNECTION_TYPE_USB
+			&& ios_devices[found].conn_type != CONNECTION_TYPE_USB))
+			found = i;
+	}
+	if (found >= 0)
+		device = ios_devices[found];
+	const int subscribed = ios_subscribed;
+	pthread_mutex_unlock(&ios_lock);
+
+	if (!subscribed) {
+		// no events to keep the cache fresh, enumerate next time
+		pthread_mutex_lock(&ios_lock);
+		ios_count = 0;
+		pthread_mutex_unlock(&ios_lock);
+	}
+
+	dbgprint("CheckiOSDevices: using %s\n", found >= 0 ? device.udid : "none");
+	if (found < 0) {
 		return ERROR_NO_DEVICES;
 	}
 
-	const int sfd = usbmuxd_connect(deviceList[0].handle, port);
+	const int sfd = usbmuxd_connect(device.handle, port);
 	if (sfd <= 0) {
-		usbmuxd_device_list_free(&deviceList);
 		return ERROR_ADDING_FORWARD;
 	}
 
@@ -141,6 +302,5 @@ int CheckiOSDevices(int port) {
 	flags &= ~O_NONBLOCK;
 	fcntl(sfd, F_SETFL, flags);
 
-	usbmuxd_device_list_free(&deviceList);
 	return sfd;
 }